@@ -68,6 +68,8 @@ char  def_codefile[NAMELENGTH] = {"wsfcode.c"};
 #define  OPT_PUSH    0x0010
 #define  OPT_FORM    0x0020
 #define  OPT_NOWARN  0x0040
+#define  OPT_SSE     0x0080
+#define  OPT_WSOCK   0x0100
 
 
 // Default option mask
@@ -92,7 +94,7 @@ unsigned char  readbuf[4096];
 #endif
 
 
-#define  NON_BINARY_FILE  (OPT_SSI|OPT_PUSH|OPT_CEXP|OPT_FORM)
+#define  NON_BINARY_FILE  (OPT_SSI|OPT_PUSH|OPT_CEXP|OPT_FORM|OPT_SSE|OPT_WSOCK)
 
 void dtrap() {
    printf("dtrap");
@@ -538,10 +540,12 @@ int opt_setstring(struct option * opt, char * parm) {
 
 /* opt_makefunc()
  *
- * Make an SSI, CGI, or server-side push 'code' function.
+ * Make an SSI, CGI, server-side push or WebSocket 'code' function, or
+ * name an event stream.
  *
  * "char * parm" is the args line, which should start with the name
- * for C routine to map to the the SSI, PUSH or FORM file.
+ * for C routine to map to the the SSI, PUSH, FORM or WebSocket file,
+ * or of the wi_sse for the event stream file.
  *
  *
  * returns 0 if OK.
@@ -573,7 +577,7 @@ enum caseparms { UPPERCASE, LOWERCASE, NOCASE };
 
 char * maketoken(const char * prefix, const char * name, unsigned number, enum caseparms caseparm) {
    int length = 0;
-   if ((NULL != prefix) && ('\0' != prefix)) {
+   if ((NULL != prefix) && ('\0' != *prefix)) {
        strcpy(tokenbuf, prefix);
        length += strlen(prefix);
    }
@@ -671,6 +675,10 @@ struct option options[] = {
       opt_makefunc, &optionTmp, OPT_FORM  },
    {   'p', "<funcname> file is server push, generate function", 0,
       opt_makefunc, &optionTmp, OPT_PUSH },
+   {   'v', "<name> file is server-sent event stream, wi_sse <name>", 0,
+      opt_makefunc, &optionTmp, OPT_SSE },
+   {   'u', "<funcname> file is WebSocket endpoint, messages go to function", 0,
+      opt_makefunc, &optionTmp, OPT_WSOCK },
    {   'g', "<filename> generate C code to handle SSI or form data", 0,
       opt_setstring, &optionTmp.codefile, 0 },
    {   'e', "<exp> file maps to a \"C\" expression", 0,
@@ -1169,6 +1177,11 @@ int main(int argc, char * argv[]) {
                      }
                   }
 
+                  // note SSI text, server has to scan this file
+                  if ( tagcmp("<!--#", cp) == TRUE) {
+                     newfile->flags |= FD_HASSSI;
+                  }
+
                   // record SSI file names in master list for later checking
                   if ( tagcmp("<!--#include", cp) == TRUE) {
                      char ssiname[TAGSIZE];
@@ -1243,9 +1256,26 @@ int main(int argc, char * argv[]) {
       fprintf(outdata, "\t\"%s\", /* name of file */\n", newfile->filename);
 
       /* Figure out what kind of EFS entry to make based on option bits */
-      if (newfile->opset.opmask & (OPT_SSI|OPT_PUSH|OPT_CEXP|OPT_FORM)) {
+      if (newfile->opset.opmask & (OPT_SSI|OPT_PUSH|OPT_CEXP|OPT_FORM|OPT_SSE|OPT_WSOCK)) {
          fprintf(outdata, "\tNULL, /* name of data array */\n");
-         if (newfile->opset.opmask & (OPT_SSI|OPT_PUSH|OPT_FORM)) {
+         if (newfile->opset.opmask & OPT_WSOCK) {
+            fprintf(outdata, "\t0, /* length of original file data */\n");
+            fprintf(outdata, "\t%s, /* WebSocket handler */\n", newfile->opset.routine );
+            fprintf(outheader, "\n" SINT " %s(wi_sess * sess, " SINT " event, " CHAR " * msg, " SINT " len);\n",
+               newfile->opset.routine );
+            fprintf(outcode, "\n/* %s()\n *\n * WebSocket handler stub for %s, see wi_wsaccept()\n */\n\n",
+               newfile->opset.routine, newfile->filename);
+            fprintf(outcode, SINT "\n%s(wi_sess * sess, " SINT " event, " CHAR " * msg, " SINT " len)\n",
+               newfile->opset.routine);
+            fprintf(outcode, "{\n\t/* Add your code here */\n\treturn 0;\n}\n\n\n");
+         } else if (newfile->opset.opmask & OPT_SSE) {
+            fprintf(outdata, "\t0, /* length of original file data */\n");
+            fprintf(outdata, "\t&%s, /* event stream */\n", newfile->opset.routine );
+            fprintf(outheader, "\nextern wi_sse %s;\n", newfile->opset.routine );
+            fprintf(outcode, "\n/* %s\n *\n * Event stream for %s, send with wi_ssesend()\n */\n\n",
+               newfile->opset.routine, newfile->filename);
+            fprintf(outcode, "wi_sse %s;\n\n\n", newfile->opset.routine);
+         } else if (newfile->opset.opmask & (OPT_SSI|OPT_PUSH|OPT_FORM)) {
             fprintf(outdata, "\t0, /* length of original file data */\n");
             fprintf(outdata, "\t%s, /* SSI/CGI data routine */\n", newfile->opset.routine );
 
@@ -1286,6 +1316,12 @@ int main(int argc, char * argv[]) {
       if (newfile->opset.opmask & OPT_PUSH) {
           strcat(emfflags, "EMF_PUSH | ");
       }
+      if (newfile->opset.opmask & OPT_SSE) {
+          strcat(emfflags, "EMF_SSE | ");
+      }
+      if (newfile->opset.opmask & OPT_WSOCK) {
+          strcat(emfflags, "EMF_WSOCK | ");
+      }
       if (newfile->opset.opmask & OPT_CEXP) {
           strcat(emfflags, "EMF_CEXP | ");
       }
@@ -1295,6 +1331,10 @@ int main(int argc, char * argv[]) {
       if (newfile->opset.opmask & OPT_FORM) {
           strcat(emfflags, "EMF_FORM | ");
       }
+      if (((newfile->opset.opmask & NON_BINARY_FILE) == 0) &&
+          ((newfile->flags & FD_HASSSI) == 0)) {
+          strcat(emfflags, "EMF_DATA | ");   // no SSIs, send as is
+      }
 
       if (strlen(emfflags) == 0) {
           strcat(emfflags, "0x0000");
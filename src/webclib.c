@@ -30,7 +30,7 @@
 #include <memory.h>
 #include <stdarg.h>
 
-static char output[DDB_SIZE];
+static WI_TLS char output[DDB_SIZE];
 int ssi_threshhold = DDB_SIZE/2;
 
 
@@ -71,7 +71,9 @@ void wi_printf(wi_sess * sess, char * fmt, ...) {
    }
 
    /* see if new data will fit in existing buffer */
-   if ((sess->ws_txtail == NULL) || (len >= (WI_TXBUFSIZE - sess->ws_txtail->tb_total)))
+   if ((sess->ws_txtail == NULL) || (sess->ws_txtail == sess->ws_txmark) ||
+       (sess->ws_txtail->tb_ext) ||
+       (len >= (WI_TXBUFSIZE - sess->ws_txtail->tb_total)))
    {
       /* won't fit, get another buffer */
       if (wi_txalloc(sess) == NULL)
@@ -83,6 +85,61 @@ void wi_printf(wi_sess * sess, char * fmt, ...) {
    return;
 }
 
+/* wi_setgenerator()
+ *
+ * Have the reply body made on demand, rather than all at once. This
+ * is called from a form handler or SSI routine. After it returns,
+ * gen(sess, ctx) is called whenever the session can take more output.
+ * It adds some with wi_printf() or wi_sendext() and returns 1 if there
+ * is more to come, 0 at the end of the body, or a negative WI_E_ code
+ * to drop the connection. The output is streamed as it is made (see
+ * wi_chunkmark), so only a little of it is held at a time.
+ *
+ * A generator with nothing to add yet returns 1 without adding any.
+ * It is then called again when wi_pushwake() is called with the
+ * session's ws_pushid, or on the next clock tick.
+ *
+ * If the session ends before the generator does, gen is called once
+ * more with ws_state set to WI_ENDING, so it can free ctx.
+ *
+ * Returns: 0 if no error, else negative WI_E_ error code.
+ */
+
+int wi_setgenerator(wi_sess * sess, wi_genfunc gen, void * ctx) {
+   if ((gen == NULL) || sess->ws_generator) {
+      return WI_E_BADPARM;
+   }
+   sess->ws_generator = gen;
+   sess->ws_genctx = ctx;
+   wi_genstart(sess);
+   return 0;
+}
+
+/* wi_sendext()
+ *
+ * Add "len" bytes at "data" to the reply without copying them; the
+ * txbuf just points at the data. The data must stay put and unchanged
+ * for as long as the server runs, e.g. a const table or embedded file
+ * data. Large blocks of it may be sent with MSG_ZEROCOPY.
+ *
+ * Returns: 0 if no error, else negative WI_E_ error code.
+ */
+
+int wi_sendext(wi_sess * sess, const char * data, int len) {
+   txbuf *  tb;
+
+   if (sess->ws_state == WI_ENDING) {
+      return 0;
+   }
+   tb = wi_txalloc(sess);
+   if (tb == NULL) {
+      return WI_E_MEMORY;
+   }
+   tb->tb_ext = data;
+   tb->tb_total = len;
+   return 0;
+}
+
 
 int wi_putlong(wi_sess * sess, u_long value) {
    wi_printf(sess, "%lu", value);
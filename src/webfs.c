@@ -27,6 +27,10 @@
 #include "webfs.h"
 
 #include <string.h>
+#ifdef WI_USE_STDFILES
+#include <limits.h>   /* PATH_MAX */
+#include <stdlib.h>   /* realpath() */
+#endif
 
 /* This file contins webio file access routines. The external "wi_f" entry 
  * points have the same semantics as C buffered file IO (fopen, etc). These 
@@ -35,14 +39,81 @@
  */
 
 #ifdef WI_USE_STDFILES
-/* Voiding these pointers is ugly, but so are the Linux declarations. */
+
+/* Host file system, through C buffered file IO. Names are relative to
+ * wi_docroot, and nothing is served until the application sets it.
+ * Absolute names and names with ".." are refused, and on Linux the
+ * resolved name must still be under the root, so neither a URI nor a
+ * symlink can reach outside of it.
+ */
+
+char *   wi_docroot = NULL;
+
+static WI_FILE * sys_fopen(const char * name, const char * mode) {
+   char     path[WI_MAXURLSIZE * 2];
+#ifdef LINUX
+   char     root[PATH_MAX];
+   char     real[PATH_MAX];
+   size_t   len;
+#endif
+
+   if ((wi_docroot == NULL) || (*wi_docroot == 0)) {
+      return NULL;
+   }
+   if ((name[0] == '/') || (name[0] == '\\') || strstr(name, "..")) {
+      return NULL;
+   }
+   if (snprintf(path, sizeof(path), "%s/%s", wi_docroot, name) >= (int)sizeof(path)) {
+      return NULL;      /* too long, would be cut short */
+   }
+
+#ifdef LINUX
+   if (!realpath(wi_docroot, root) || !realpath(path, real)) {
+      return NULL;      /* no root, or no such file */
+   }
+   len = strlen(root);
+   if ((len > 1) &&
+       ((strncmp(real, root, len) != 0) || ((real[len] != '/') && (real[len] != 0)))) {
+      return NULL;      /* a link led out of the root */
+   }
+   return (WI_FILE *)fopen(real, mode);
+#else
+   return (WI_FILE *)fopen(path, mode);
+#endif
+}
+
+static int sys_fread(char * buf, unsigned size1, unsigned size2, void * fd) {
+   return (int)fread(buf, size1, size2, (FILE *)fd);
+}
+
+static int sys_fwrite(char * buf, unsigned size1, unsigned size2, void * fd) {
+   return (int)fwrite(buf, size1, size2, (FILE *)fd);
+}
+
+static int sys_fclose(void * fd) {
+   return fclose((FILE *)fd);
+}
+
+static int sys_fseek(void * fd, long offset, int mode) {
+   return fseek((FILE *)fd, offset, mode);
+}
+
+static int sys_ftell(void * fd) {
+   return (int)ftell((FILE *)fd);
+}
+
+static int sys_fileno(void * fd) {
+   return fileno((FILE *)fd);
+}
+
 wi_filesys sysfs = {
-	.wfs_fopen  = em_fopen,
-	.wfs_fread  = em_fread,
-	.wfs_fwrite = em_fwrite,
-	.wfs_fclose = em_fclose,
-	.wfs_fseek  = em_fseek,
-	.wfs_ftell  = em_ftell
+	.wfs_fopen  = sys_fopen,
+	.wfs_fread  = sys_fread,
+	.wfs_fwrite = sys_fwrite,
+	.wfs_fclose = sys_fclose,
+	.wfs_fseek  = sys_fseek,
+	.wfs_ftell  = sys_ftell,
+	.wfs_fileno = sys_fileno
 };
 #endif   /* WI_USE_STDFILES */
 
@@ -161,7 +232,7 @@ extern em_file efslist[];
 em_file * emfiles = &efslist[0];
 
 /* transient list of em_ files which are currently open */
-EOFILE * em_openlist;
+WI_TLS EOFILE * em_openlist;
 
 /* em_verify()
  * 
@@ -205,8 +276,8 @@ wi_sess * em_lookupsess(void * fd) {
 }
 
 #ifndef WI_USE_MALLOC
-static EOFILE wi_eofile_slot[MAX_EOFILE_SLOTS];
-static u_char wi_eofile_slot_used[MAX_EOFILE_SLOTS];
+static WI_TLS EOFILE wi_eofile_slot[MAX_EOFILE_SLOTS];
+static WI_TLS u_char wi_eofile_slot_used[MAX_EOFILE_SLOTS];
 
 EOFILE * wi_get_eofile_slot(void) {
 	int i;
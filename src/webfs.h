@@ -53,11 +53,16 @@ typedef struct wi_filesys_s {
    int         (*wfs_ftell) (void * fd);
    int         (*wfs_fauth) (void * fd, const char * name, const char * pw);  /* Optional, for authentication */
    int         (*wfs_push)  (void * fd, wi_sess * sess);  /* Optional, server push */
+   int         (*wfs_fileno)(void * fd);  /* Optional, OS descriptor for direct reads */
 } wi_filesys;
 
 
 extern   wi_filesys *   wi_filesystems[];
 
+#ifdef WI_USE_STDFILES
+extern   char *   wi_docroot;    /* host directory sysfs serves, NULL for none */
+#endif
+
 extern   wi_file *      wi_files;   /* list of open files */
 
 /* Top level file access routines. These just map to lower routines */
@@ -95,6 +100,8 @@ extern   em_file * emfiles;            /* master list of embedded files */
 #define     EMF_PUSH    0x0010         /* Server side push routine */
 #define     EMF_AUTH    0x0020         /* Accessing file requires auth. */
 #define     EMF_CEXP    0x0040         /* file just prints C expression. */
+#define     EMF_SSE     0x0080         /* Server-sent event stream, em_routine is its wi_sse */
+#define     EMF_WSOCK   0x0100         /* WebSocket endpoint, em_routine is its wi_wsfunc */
 
 extern   WI_FILE *   em_fopen(const char * name, const char * mode);
 extern   int         em_fread(char * buf, unsigned size1, unsigned size2, void * fd);
@@ -112,7 +119,7 @@ typedef struct em_open_s {
    wi_sess *   eo_sess;       /* session (for pass to code) */
 } EOFILE;
 
-extern   EOFILE * em_openlist;
+extern   WI_TLS EOFILE * em_openlist;
 
 #ifndef DDB_SIZE
 #define DDB_SIZE 1000         /* allocation for dynamic data (SSI) buffers */
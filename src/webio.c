@@ -26,25 +26,56 @@
 #include "websys.h"
 #include "webio.h"
 #include "webfs.h"
+#include "weburing.h"
 
 #include <stdlib.h>
 #include <string.h>
 
 #ifdef LINUX
 #include <unistd.h>
+#include <ifaddrs.h>
+#include <stddef.h>     /* offsetof() */
+#include <sys/stat.h>
 #endif
 
 /* This file contains the main entry points for the webio library */
 
 
-/* The web server "listen" socket */ 
-socktype wi_listen;
+/* The web server "listen" socket. Each reactor thread has its own. */ 
+WI_TLS socktype wi_listen;
 
-socktype wi_highsocket;
+WI_TLS socktype wi_highsocket;
 
 /* Port number on which to listen. May be changed prior to calling webinit */
 int   httpport = 8888;
 
+/* A bound, listening socket to serve instead of opening one on httpport,
+ * -1 if none. May be set prior to calling wi_init, else wi_init looks for
+ * one passed down by systemd socket activation (LISTEN_FDS) or in the
+ * WEBIO_LISTEN_FD environment variable. Processes which share the socket
+ * take turns accepting from it, so a new server can be started on it 
+ * before the old one calls wi_shutdown() with no gap between them.
+ */
+int   wi_listenfd = -1;
+
+#ifdef LINUX
+/* Unix domain listen sockets, added by wi_addunix() prior to wi_init.
+ * They are shared by every reactor, each accepts from all of them.
+ */
+#ifndef WI_MAXUNIX
+#define WI_MAXUNIX   4
+#endif
+static socktype   wi_unixsocks[WI_MAXUNIX];
+static int        wi_nunix = 0;
+static WI_TLS int wi_unixon = FALSE;   /* reactor is polling them */
+#endif   /* LINUX */
+
+/* Graceful shutdown, see wi_shutdown() */
+/* wi_shutdown() may be called from a signal handler */
+volatile sig_atomic_t wi_draining = FALSE;   /* TRUE once wi_shutdown() is called */
+volatile sig_atomic_t wi_draintmo = 30;      /* seconds to let replies finish */
+WI_TLS int  wi_drained = FALSE;  /* this reactor has no sessions left */
+
 int   wi_running = FALSE;  /* TRUE while server is running */
 
 char * wi_rootfile = "index.html";  /* File name to substitute for "/" */
@@ -53,24 +84,87 @@ char * wi_rootfile = "index.html";  /* File name to substitute for "/" */
 /* Flag to permit connections by the localhost only (security). */
 int   wi_localhost;
 
+/* Listen socket options. May be changed prior to calling wi_init */
+int   wi_backlog = 128;    /* listen() queue length */
+int   wi_deferaccept = 0;  /* TCP_DEFER_ACCEPT seconds, 0 to disable */
+int   wi_maxrequests = 100;   /* requests per persistent connection, 0 = no limit */
+int   wi_pipemax = 8;         /* pipelined replies sent in one batch */
+int   wi_pipebytes = 16384;   /* most reply bytes held for a batch */
+int   wi_chunkmark = 16384;   /* queued bytes to start chunked reply */
+#ifdef WI_USE_ZEROCOPY
+int   wi_zcthresh = WI_ZCTHRESH; /* MSG_ZEROCOPY sends of this size or more */
+#endif
+
+/* Admission control, see wi_admit(). May be changed at any time. */
+int   wi_maxsess = WI_MAXSESS;      /* live sessions per reactor, 0 = no limit */
+long  wi_maxtxbytes = WI_MAXTXBYTES;   /* txbuf memory per reactor, 0 = no limit */
+int   wi_shedtarget = 20;     /* msecs a poll pass may take, 0 = don't measure */
+int   wi_shedinterval = 500;  /* msecs passes run long before shedding */
+int   wi_retryafter = 2;      /* seconds for the 503's Retry-After */
+
+/* Slow request headers, see wi_timerupdate() and wi_hdrdone() */
+int   wi_hdrgrace = 2;        /* seconds before wi_hdrminrate applies */
+int   wi_hdrminrate = 64;     /* header bytes a second, 0 = no rule */
+int   wi_maxhalfopen = 32;    /* connections per client without a header */
+
+WI_TLS int     wi_overloaded = FALSE;
+WI_TLS u_long  wi_shedconns = 0;
+
+/* This host's IP addresses, gathered once by wi_init() for the 
+ * wi_localhost check. wi_nlocaladdrs is -1 if they are not known, in 
+ * which case each connection's local address is looked up instead.
+ */
+#define WI_MAXLOCALADDRS   16
+static u_long  wi_localaddrs[WI_MAXLOCALADDRS];
+static int     wi_nlocaladdrs = -1;
+
+static int wi_newconn(socktype newsock, struct sockaddr_in * sa, int unixsock);
+static void wi_loadcheck(void);
+static void wi_listenclose(void);
+
+#ifdef WI_USE_EPOLL
+
+#define WI_MAXEVENTS   64    /* events fetched per epoll_wait() */
+
+/* Listen sockets' events carry a small number in place of a session
+ * pointer, see wi_listenadd(). NULL is the TCP listener.
+ */
+#define WI_LISTENKEY(key)     ((void *)(u_long)(key))
+#define WI_ISLISTENKEY(ptr)   ((u_long)(ptr) <= WI_MAXUNIX)
+#define WI_WAKEKEY            WI_LISTENKEY(WI_MAXUNIX + 1)   /* wi_wakefd */
+
+WI_TLS int   wi_epfd = -1;     /* epoll descriptor for listen & session sockets */
+
+#endif   /* WI_USE_EPOLL */
+
+#ifdef WI_USE_REACTORS
+/* Number of reactor threads to run. May be changed prior to calling 
+ * wi_init. The thread calling wi_init is the first reactor, wi_init 
+ * starts the others. Each reactor has its own listen socket on 
+ * httpport (bound with SO_REUSEPORT), its own session list, and its 
+ * own object pools, so reactors share no locks.
+ */
+int   wi_reactors = 1;
+
+/* Reactors past the first which have exited, normally after wi_shutdown() */
+static int  wi_reactorsdone = 0;
+static pthread_mutex_t  wi_reactorlock = PTHREAD_MUTEX_INITIALIZER;
+#endif   /* WI_USE_REACTORS */
+
 #ifdef WI_USE_THREADS
 struct timeval   wi_seltmo = {5,0}; /* on thread, short block is OK */
 #else
 struct timeval   wi_seltmo = {0,0}; /* polled mode - no blocking */
 #endif
 
-/* webinit()
- * 
- * This should be the first call made to the web server. It initializes
- * the embedded file system starts a listen
- * 
- * Parameters:
- * int stdfiles - flag to use system "fopen" file calls as well as embedded FS
+#define WI_SELTMO_MS   ((wi_seltmo.tv_sec * 1000) + (wi_seltmo.tv_usec / 1000))
+
+/* wi_listenopen() - open, bind and start a listen socket on httpport
  * 
  * Returns 0 if OK, else negative error code.
  */
 
-int wi_init() {
+static int wi_listenopen(void) {
    struct sockaddr_in   wi_sin;
    int      error;
 
@@ -81,6 +175,23 @@ int wi_init() {
       return WI_E_SOCKET;
    }
 
+#ifdef WI_USE_REACTORS
+   /* Let every reactor bind its own socket to the same port. The
+    * kernel then spreads new connections across the listeners.
+    */
+   if (wi_reactors > 1) {
+      int   option = 1;
+
+      error = setsockopt(wi_listen, SOL_SOCKET, SO_REUSEPORT, 
+         (char*)&option, sizeof(option));
+      if (error) {
+         dprintf("Error %d setting SO_REUSEPORT\n", errno);
+         closesocket(wi_listen);
+         return WI_E_SOCKET;
+      }
+   }
+#endif   /* WI_USE_REACTORS */
+
    wi_sin.sin_family = AF_INET;
    wi_sin.sin_addr.s_addr = htonl(INADDR_ANY);
    wi_sin.sin_port = htons( (short)httpport);
@@ -91,310 +202,1607 @@ int wi_init() {
       return WI_E_SOCKET;
    }
 
-   error = listen(wi_listen, 15);
+   error = listen(wi_listen, wi_backlog);
    if (error) {
       dprintf("Error %d starting listen\n", error);
       return WI_E_SOCKET;
    }   
+   return 0;
+}
 
-   wi_running = TRUE;
+/* wi_listenadd()
+ *
+ * Add a listen socket to the calling reactor's poll set. "key" tells
+ * the listeners apart in epoll events: 0 for the TCP one, else one more
+ * than the index of the unix domain one.
+ *
+ * Returns 0 if OK, else negative error code.
+ */
+
+static int wi_listenadd(socktype lsock, int key) {
+#ifdef WI_USE_EPOLL
+   struct epoll_event ev;
+
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.ptr = WI_LISTENKEY(key);
+   if (epoll_ctl(wi_epfd, EPOLL_CTL_ADD, lsock, &ev) < 0) {
+      dprintf("Error %d adding listen to epoll set\n", errno);
+      return WI_E_SOCKET;
+   }
+#elif defined(WI_USE_URING)
+   (void)key;
+   return wu_accept(lsock);
+#else
+   (void)lsock;      /* select() version adds it every pass */
+   (void)key;
+#endif
    return 0;
 }
 
+#ifdef LINUX
 
-/* webpoll() - entry point for driving webio in a "polled" manner.
- * this checks for any work that needs to be done and returns. It
- * may be preempted, but is not re-entrant.
- * 
- * Returns negative code on error, else number of open sessions.
- * Return of 0 means no sessions and no error.
+/* wi_addunix()
+ *
+ * Listen on a unix domain stream socket as well as (or, with httpport
+ * 0, instead of) the TCP port, e.g. for a reverse proxy on the same
+ * host. "path" is a file system path, or a name in the abstract 
+ * namespace if it starts with '@'. A stale socket file left at "path"
+ * is removed first. This must be called prior to wi_init.
+ *
+ * Connections on it skip the wi_localhost check and the per client 
+ * limits, as they all come from this host.
+ *
+ * Returns 0 if OK, else negative error code.
  */
 
+int wi_addunix(const char * path) {
+   struct sockaddr_un   sun;
+   struct stat          st;
+   socklen_t   sunlen;
+   socktype    sock;
+   int         len;
 
-int wi_poll() {
-   wi_sess * sess;
-   wi_sess * next_sess;
-   int   sessions = 0;
-   int   recvs;
-   int   sends;
-   int   error;
-   fd_set sel_recv;
-   fd_set sel_send;
-   char * data;
+   len = (int)strlen(path);
+   if ((wi_nunix >= WI_MAXUNIX) || (len < 1) || (len >= (int)sizeof(sun.sun_path))) {
+      return WI_E_BADPARM;
+   }
+   memset(&sun, 0, sizeof(sun));
+   sun.sun_family = AF_UNIX;
+   if (path[0] == '@') {
+      memcpy(&sun.sun_path[1], path + 1, len - 1);    /* sun_path[0] stays 0 */
+   } else {
+      memcpy(sun.sun_path, path, len);
+      if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+         unlink(path);
+      }
+   }
+   sunlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
 
-   memset(&sel_recv, 0, sizeof(sel_recv));
-   memset(&sel_send, 0, sizeof(sel_send));
+   sock = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (sock == INVALID_SOCKET) {
+      return WI_E_SOCKET;
+   }
+   if ((bind(sock, (struct sockaddr *)&sun, sunlen) < 0) ||
+       (listen(sock, wi_backlog) < 0) ||
+       WI_NOBLOCKSOCK(sock)) {
+      dprintf("Error %d listening on %s\n", errno, path);
+      close(sock);
+      return WI_E_SOCKET;
+   }
+   wi_unixsocks[wi_nunix++] = sock;
+   return 0;
+}
 
-   /* add listen sock to select list */
-   FD_SET(wi_listen, &sel_recv);
-   wi_highsocket = wi_listen;
+/* wi_isunix() - see if "lsock" is one of the unix domain listeners */
 
-   /* loop through list of open sessions looking for work */
-   recvs = sends = 0;
-   for (sess = wi_sessions; sess; sess = sess->ws_next) {
-      if (sess->ws_socket == INVALID_SOCKET) {
-    	  continue;
+static int wi_isunix(socktype lsock) {
+   int   i;
+
+   for (i = 0; i < wi_nunix; i++) {
+      if (wi_unixsocks[i] == lsock) {
+         return TRUE;
       }
+   }
+   return FALSE;
+}
 
-      /* If socket is reading, load for a select */
-      if (sess->ws_state == WI_HEADER) {
-         recvs++;
-         FD_SET(sess->ws_socket, &sel_recv);
-         if (sess->ws_socket > wi_highsocket) {
-        	 wi_highsocket = sess->ws_socket;
-         }
+#else
+#define wi_isunix(lsock)   FALSE
+#endif   /* LINUX */
+
+/* wi_listeninit()
+ * 
+ * Set up the calling thread's listen socket, inherited or our own, and
+ * add it to the thread's poll set. This is done once per reactor, and
+ * again by wi_step() when a reactor restarts.
+ * 
+ * Returns 0 if OK, else negative error code.
+ */
+
+static int wi_listeninit(void) {
+   int      error;
+
+   wi_listen = INVALID_SOCKET;
+   if (wi_listenfd >= 0) {
+      wi_listen = (socktype)wi_listenfd;  /* every reactor shares it */
+   } else if (httpport > 0) {
+      error = wi_listenopen();
+      if (error) {
+         return error;
       }
+   }
 
-      if ((sess->ws_txbufs) || (sess->ws_flags & WF_BINARY)) {
-         sends++;
-         FD_SET(sess->ws_socket, &sel_send);
-         if (sess->ws_socket > wi_highsocket) {
-        	 wi_highsocket = sess->ws_socket;
+   if (wi_listen != INVALID_SOCKET) {
+      /* wi_sockaccept() accepts until the queue is empty, so the listen
+       * socket must not block.
+       */
+      error = WI_NOBLOCKSOCK(wi_listen);
+      if (error) {
+         dprintf("Error %d setting listen non-blocking\n", error);
+         return WI_E_SOCKET;
+      }
+
+#ifdef TCP_DEFER_ACCEPT
+      /* Don't wake us for connections until the request data arrives */
+      if (wi_deferaccept > 0) {
+         error = setsockopt(wi_listen, IPPROTO_TCP, TCP_DEFER_ACCEPT, 
+            (char*)&wi_deferaccept, sizeof(wi_deferaccept));
+         if (error) {
+            dprintf("Error %d setting TCP_DEFER_ACCEPT\n", errno);
          }
       }
+#endif   /* TCP_DEFER_ACCEPT */
    }
-   wi_highsocket++;     /* Select mumbo-jumbo */
 
-   /* See if any of the sockets have input or ready to send */
-   sessions = select( wi_highsocket, &sel_recv, &sel_send, NULL, &wi_seltmo);
-   if (sessions == SOCKET_ERROR) {
-      error = errno;
-      dprintf("select error %d\n", error );
-      return WI_E_SOCKET;
+#ifdef WI_USE_EPOLL
+   /* Create the epoll set on the first call */
+   if (wi_epfd < 0) {
+      wi_epfd = epoll_create1(0);
+      if (wi_epfd < 0) {
+         dprintf("Error %d creating epoll set\n", errno);
+         return WI_E_SOCKET;
+      }
    }
+#endif   /* WI_USE_EPOLL */
 
-   /* see if we have a new connection request */
-   if (FD_ISSET(wi_listen, &sel_recv)) {
-      error = wi_sockaccept();
+#ifdef WI_USE_URING
+   /* Create the ring on the first call */
+   error = wu_init();
+   if (error) {
+      return error;
+   }
+#endif   /* WI_USE_URING */
+
+   /* Set up push wakeups on the first call, see wi_pushwake() */
+   if (wi_wakefd < 0) {
+      error = wi_pushinit();
       if (error) {
-         dprintf("Socket accept error %d\n", error);
          return error;
       }
+#ifdef WI_USE_EPOLL
+      if (wi_wakefd >= 0) {
+         struct epoll_event ev;
+
+         memset(&ev, 0, sizeof(ev));
+         ev.events = EPOLLIN;
+         ev.data.ptr = WI_WAKEKEY;
+         if (epoll_ctl(wi_epfd, EPOLL_CTL_ADD, wi_wakefd, &ev) < 0) {
+            dprintf("Error %d adding wakeup to epoll set\n", errno);
+            return WI_E_SOCKET;
+         }
+      }
+#endif
+#ifdef WI_USE_URING
+      if (wi_wakefd >= 0) {
+         error = wu_pollwake(wi_wakefd);
+         if (error) {
+            return error;
+         }
+      }
+#endif
    }
 
-   sess = wi_sessions; 
-   while (sess) {
-      next_sess = sess->ws_next;
+   if (wi_listen != INVALID_SOCKET) {
+      error = wi_listenadd(wi_listen, 0);
+      if (error) {
+         return error;
+      }
+   }
 
-      /* jump to here to accelerate things if a session changes state */
-another_state:    
+#ifdef LINUX
+   /* The unix domain listeners are set up once, a restart keeps them */
+   if (!wi_unixon) {
+      int   i;
 
-      switch(sess->ws_state) {
-      case WI_HEADER:
-         /* See if there is data to read */
-         if (FD_ISSET(sess->ws_socket, &sel_recv)) {
-            error = recv(sess->ws_socket, 
-                    sess->ws_rxbuf + sess->ws_rxsize,
-                    sizeof(sess->ws_rxbuf) - sess->ws_rxsize, 0
-			);
-
-            if (error < 0) {
-               error = errno;
-               dprintf("sock recv error %d\n", error );
-               return WI_E_SOCKET;
-            }
-            sess->ws_rxsize += error;
-            sess->ws_last = wi_cticks;
-         }
-         if (sess->ws_rxsize) { /* unprocessed input http */
-            error = wi_parseheader( sess );  /* Make a best effort to process input */
-            sessions++;
-         }
-         /* If the logic above pushed session into POSTRX (waiting for POST 
-          * operation) jump to POSTRX logic, else break.
-          */
-         if (sess->ws_state != WI_HEADER) {
-        	 goto another_state;
+      for (i = 0; i < wi_nunix; i++) {
+         error = wi_listenadd(wi_unixsocks[i], i + 1);
+         if (error) {
+            return error;
          }
-         break;
+      }
+      wi_unixon = (wi_nunix > 0);
+   }
+   if (wi_unixon) {
+      return 0;
+   }
+#endif   /* LINUX */
 
-      case WI_POSTRX:
-         /* See if there is more to read */
-         error = recv(sess->ws_socket, 
-                 sess->ws_rxbuf + sess->ws_rxsize,
-                 sizeof(sess->ws_rxbuf) - sess->ws_rxsize, 0
-         );
+   if (wi_listen == INVALID_SOCKET) {
+      dprintf("No port or unix socket to listen on\n");
+      return WI_E_BADPARM;
+   }
+   return 0;
+}
 
-         if (error < 0) {
-            if (errno == EWOULDBLOCK) {
-            	error = 0;
-            } else {
-               error = errno;
-               dprintf("sock recv error %d\n", error );
-               return WI_E_SOCKET;
-            }
-         }
-         sess->ws_rxsize += error;
-         sess->ws_last = wi_cticks;
+#ifdef WI_USE_REACTORS
 
-         /* If we have all the content, parse the name/value pairs. 
-          * We check for ContentLength field or socket closed 
-          */
-         data = sess->ws_data;
-         if (data) {
-            int   contentRx;
-
-            contentRx = sess->ws_rxsize - (data - sess->ws_rxbuf);
-
-            if ((contentRx >= sess->ws_contentLength) || (error == ENOTCONN)) {
-               error = wi_buildform(sess, data);
-               if (error) {
-                  wi_senderr(sess, 400);  /* Bad request */
-                  break;
-               }
-               sess->ws_state = WI_CONTENT;
-               sess->ws_last = wi_cticks;
-            }
-         }
-         if (sess->ws_state != WI_POSTRX)
-            goto another_state;
+/* wi_reactor() - thread entry point for the 2nd through Nth reactors.
+ * It opens the thread's own listener and drives wi_step() until the 
+ * server is shut down.
+ */
 
-         break;
+static void * wi_reactor(void * arg) {
+   wi_sess *  sess;
+   wi_sess *  nextsess;
+   int   error;
 
-      case WI_CONTENT:
-         error = wi_readfile(sess);
-         if (error) {
-            sess->ws_state = WI_ENDING;
-         }
-         sessions++;
-         if (sess->ws_state != WI_CONTENT) {
-        	 goto another_state;
-         }
+   (void)arg;
+   wi_clocktick();      /* this thread's clock starts at 0 */
+   error = wi_listeninit();
+   if (error) {
+      dprintf("reactor listen error %d\n", error);
+      goto done;
+   }
 
-         break;
+   while (wi_running && !wi_drained) {
+      wi_step();
+   }
 
-      case WI_SENDDATA:
-         if ((sess->ws_txbufs || (sess->ws_flags & WF_BINARY)) && FD_ISSET(sess->ws_socket, &sel_send)) {
-            /* socket has data to write */
-            error = wi_sockwrite(sess);
-            if (error) {
-               sess->ws_state = WI_ENDING;
+done:
+   /* clean out everything this reactor owns, which after a failed
+    * start may be only part of it
+    */
+   wi_listenclose();
+   for (sess = wi_sessions; sess; sess = nextsess) {
+      nextsess = sess->ws_next;
+      wi_delsess(sess);
+   }
+   wi_pushcleanup();
+#ifdef WI_USE_URING
+   wu_cleanup();
+#endif
+   /* Count every exit, wi_thread() waits for them all on a shutdown */
+   pthread_mutex_lock(&wi_reactorlock);
+   wi_reactorsdone++;
+   pthread_mutex_unlock(&wi_reactorlock);
+   return NULL;
+}
+
+#endif   /* WI_USE_REACTORS */
+
+#ifdef LINUX
+
+/* wi_listenenv()
+ *
+ * Look for a listen socket passed down to us, if wi_listenfd isn't set.
+ * systemd socket activation passes it as descriptor 3 with LISTEN_PID
+ * set to our process ID; anything else can put its descriptor number
+ * in WEBIO_LISTEN_FD. The variables are cleared so child processes 
+ * don't take them as their own.
+ */
+
+static void wi_listenenv(void) {
+   char *      cp;
+   int         fd = -1;
+   int         opt = 0;
+   socklen_t   optlen = sizeof(opt);
+
+   if (wi_listenfd >= 0) {
+      return;
+   }
+   cp = getenv("LISTEN_PID");
+   if (cp && (atoi(cp) == (int)getpid())) {
+      cp = getenv("LISTEN_FDS");
+      if (cp && (atoi(cp) > 0)) {
+         fd = 3;     /* SD_LISTEN_FDS_START, we use the first */
+      }
+      unsetenv("LISTEN_PID");
+      unsetenv("LISTEN_FDS");
+      unsetenv("LISTEN_FDNAMES");
+   } else if ((cp = getenv("WEBIO_LISTEN_FD")) != NULL) {
+      fd = atoi(cp);
+      unsetenv("WEBIO_LISTEN_FD");
+   }
+   if (fd < 0) {
+      return;
+   }
+
+   /* Make sure it really is a listening socket */
+   if ((getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &opt, &optlen) < 0) || !opt) {
+      dprintf("inherited descriptor %d is not listening\n", fd);
+      return;
+   }
+   wi_listenfd = fd;
+}
+
+#endif   /* LINUX */
+
+/* webinit()
+ * 
+ * This should be the first call made to the web server. It initializes
+ * the embedded file system starts a listen
+ * 
+ * Parameters:
+ * int stdfiles - flag to use system "fopen" file calls as well as embedded FS
+ * 
+ * Returns 0 if OK, else negative error code.
+ */
+
+int wi_init() {
+   int      error;
+
+   wi_clocktick();
+
+#ifdef LINUX
+   /* Cache our own IP addresses for the localhost-only check */
+   if (wi_localhost) {
+      struct ifaddrs *  ifap;
+      struct ifaddrs *  ifa;
+
+      if (getifaddrs(&ifap) == 0) {
+         wi_nlocaladdrs = 0;
+         for (ifa = ifap; ifa; ifa = ifa->ifa_next) {
+            if ((ifa->ifa_addr == NULL) || (ifa->ifa_addr->sa_family != AF_INET)) {
+               continue;
             }
-            sessions++;
-         }
-         if (sess->ws_state != WI_SENDDATA) {
-        	 goto another_state;
+            if (wi_nlocaladdrs >= WI_MAXLOCALADDRS) {
+               wi_nlocaladdrs = -1;   /* too many, look them up instead */
+               break;
+            }
+            wi_localaddrs[wi_nlocaladdrs++] = 
+               ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr;
          }
-         break;
-      case WI_ENDING:
-         /* Don't delete session and break, else we'll get a fault
-          * in the sess->ws_last test below.
-          */
-         wi_delsess(sess);
-         sess = next_sess;
-         continue;
-      case WI_PUSHING:
-         sess = next_sess;
-         continue;
-      default:
-         dtrap();
-         break;
+         freeifaddrs(ifap);
       }
-      /* kill sessions with no recent activity */
-      if ((u_long)(sess->ws_last + (15 * TPS)) < wi_cticks) {
-         dtrap();
-         dprintf("killing stuck webio session\n");
-         wi_delsess(sess);
+   }
+#endif   /* LINUX */
+
+#ifdef LINUX
+   wi_listenenv();
+#endif
+
+   /* The calling thread is the first (or only) reactor */
+   error = wi_listeninit();
+   if (error) {
+      return error;
+   }
+
+   wi_running = TRUE;
+
+#ifdef WI_USE_REACTORS
+   /* Start the other reactors. They run until wi_running is cleared. */
+   {
+      pthread_t   tid;
+      int         i;
+
+      for (i = 1; i < wi_reactors; i++) {
+         error = pthread_create(&tid, NULL, wi_reactor, NULL);
+         if (error) {
+            dprintf("Error %d starting reactor %d\n", error, i);
+            wi_reactors = i;     /* only these will exit */
+            return WI_E_MEMORY;
+         }
+         pthread_detach(tid);
       }
+   }
+#endif   /* WI_USE_REACTORS */
+
+   return 0;
+}
+
+
+#ifndef WI_USE_URING
+
+/* wi_sessevents()
+ *
+ * Figure out what socket events a session is waiting for, based on
+ * its state. Sessions in WI_CONTENT are still generating data, so
+ * they ask for write events to get serviced again on the next pass.
+ *
+ * Returns: bitmask of WI_EV flags, 0 if the session needs no polling.
+ */
+
+static int wi_sessevents(wi_sess * sess) {
+   if (sess->ws_socket == INVALID_SOCKET) {
+      return 0;
+   }
+
+   switch(sess->ws_state) {
+   case WI_HEADER:
+   case WI_POSTRX:
+      return WI_EVREAD;
+   case WI_CONTENT:
+   case WI_SENDDATA:
+      return WI_EVWRITE;
+   case WI_PUSHING:
+      /* A push with a continuation watches for the client closing, and
+       * for room to send while it has output or more to make. Any
+       * other push routine does its own I/O.
+       */
+      if (sess->ws_pushfunc == NULL) {
+         return 0;
+      }
+      if ((sess->ws_txbufs && !sess->ws_castdue) ||
+          (sess->ws_pushmode == WI_PUSH_MORE)) {
+         return WI_EVREAD | WI_EVWRITE;
+      }
+      return WI_EVREAD;
+   case WI_WEBSOCKET:
+      /* A WebSocket reads its client's messages and writes while it
+       * has output. While the output is backed up, the messages are
+       * left in the socket.
+       */
+      if (sess->ws_txbufs == NULL) {
+         return WI_EVREAD;
+      }
+      if (wi_txqueued(sess) >= wi_chunkmark) {
+         return WI_EVWRITE;
+      }
+      return WI_EVREAD | WI_EVWRITE;
+   case WI_PARKED:
+      return 0;      /* nothing until wi_wake() or its deadline */
+   default:
+      return 0;
+   }
+}
+
+#endif   /* WI_USE_URING */
+
+#ifdef WI_USE_EPOLL
+
+/* wi_pollset()
+ *
+ * Bring the epoll registration of a session's socket in line with
+ * its state. This only makes a system call if the events the
+ * session waits for have changed since the last call.
+ *
+ * Returns: 0 if OK, else WI_E_SOCKET.
+ */
+
+static int wi_pollset(wi_sess * sess) {
+   struct epoll_event ev;
+   int   events;
+
+   events = wi_sessevents(sess);
+   if ((events == sess->ws_events) || (sess->ws_socket == INVALID_SOCKET)) {
+      return 0;
+   }
+
+   /* A legacy push routine owns the socket and waits for nothing.
+    * Take it out of the set, else a level triggered hangup or error
+    * would be reported on every pass and spin the reactor.
+    */
+   if ((events == 0) && (sess->ws_state == WI_PUSHING)) {
+      if (epoll_ctl(wi_epfd, EPOLL_CTL_DEL, sess->ws_socket, &ev) < 0) {
+         return wi_sockerr(sess, errno);
+      }
+      sess->ws_events = -1;   /* not registered */
+      return 0;
+   }
+
+   memset(&ev, 0, sizeof(ev));
+   if (events & WI_EVREAD) {
+      ev.events |= EPOLLIN;
+   }
+   if (events & WI_EVWRITE) {
+      ev.events |= EPOLLOUT;
+   }
+   ev.data.ptr = sess;
+   if (epoll_ctl(wi_epfd, (sess->ws_events < 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+      sess->ws_socket, &ev) < 0) {
+      return wi_sockerr(sess, errno);
+   }
+   sess->ws_events = events;
+   return 0;
+}
+
+#endif   /* WI_USE_EPOLL */
+
+/* wi_servesess()
+ *
+ * Run a session's state machine as far as it will go. "ready" is a
+ * bitmask of the WI_EV events which the poll backend found on the
+ * session's socket. The session may be deleted by this call.
+ *
+ * A socket error or the peer closing ends only this session, it is 
+ * counted by wi_sockerr().
+ *
+ * Returns 1 if the session did work or 0 if it did not.
+ */
+
+static int wi_servesess(wi_sess * sess, int ready) {
+   int   sessions = 0;
+   int   error;
+   char * data;
+
+#ifdef WI_USE_ZEROCOPY
+   if (sess->ws_zcpending > 0) {
+      wi_zcdrain(sess);    /* completions show up as read events */
+   }
+#endif
+   if (ready & WI_EVWRITE) {
+      sess->ws_flags &= ~WF_TXBLOCKED;    /* socket has room again */
+   }
+
+   /* jump to here to accelerate things if a session changes state */
+another_state:    
+
+   switch(sess->ws_state) {
+   case WI_HEADER:
+      /* See if there is data to read */
+      if (ready & WI_EVREAD) {
+         /* Attach a receive buffer when the first data shows up */
+         if ((sess->ws_rxbuf == NULL) && (wi_rxalloc(sess) == NULL)) {
+            dprintf("no rx buffer for session\n");
+            sess->ws_state = WI_ENDING;
+            goto another_state;
+         }
+         /* Leave room for a null, the header parser uses string calls */
+         error = recv(sess->ws_socket, 
+                 sess->ws_rxbuf + sess->ws_rxsize,
+                 (WI_RXBUFSIZE - 1) - sess->ws_rxsize, 0
+		);
+
+         if (error < 0) {
+            error = errno;
+            if ((error != EWOULDBLOCK) && (error != EINTR)) {
+               wi_sockerr(sess, error);
+               sess->ws_state = WI_ENDING;
+               goto another_state;
+            }
+         } else if (error == 0) {
+            /* Peer closed. Between requests on a persistent connection
+             * that is normal, in the middle of one it is counted.
+             */
+            if (sess->ws_rxsize) {
+               wi_sockerr(sess, 0);
+            }
+            sess->ws_state = WI_ENDING;
+            goto another_state;
+         } else {
+            if (sess->ws_rxsize == 0) {
+               sess->ws_reqstart = wi_cticks;   /* next request started */
+            }
+            sess->ws_rxsize += error;
+            sess->ws_rxbuf[sess->ws_rxsize] = 0;
+            sess->ws_last = wi_cticks;
+         }
+      }
+      if (sess->ws_rxsize) { /* unprocessed input http */
+         int   requests = sess->ws_requests;
+
+         error = wi_parseheader( sess );  /* Make a best effort to process input */
+         sessions++;
+
+         /* A request may be answered in one go. On a persistent
+          * connection, the next one may already be in rxbuf.
+          */
+         if ((sess->ws_state == WI_HEADER) && (sess->ws_rxsize) &&
+             (sess->ws_requests != requests)) {
+            goto another_state;
+         }
+      }
+      /* If the logic above pushed session into POSTRX (waiting for POST 
+       * operation) jump to POSTRX logic, else break.
+       */
+      if (sess->ws_state != WI_HEADER) {
+    	 goto another_state;
+      }
+      break;
+
+   case WI_POSTRX:
+#ifdef WI_USE_URING
+      error = 0;     /* ring receives have already filled rxbuf */
+#else
+      /* See if there is more to read */
+      error = recv(sess->ws_socket, 
+              sess->ws_rxbuf + sess->ws_rxsize,
+              (WI_RXBUFSIZE - 1) - sess->ws_rxsize, 0
+      );
+#endif
+
+#ifndef WI_USE_URING
+      if (error == 0) {
+         /* Peer closed before sending all the content */
+         wi_sockerr(sess, 0);
+         sess->ws_state = WI_ENDING;
+         goto another_state;
+      }
+#endif
+      if (error < 0) {
+         error = errno;
+         if ((error != EWOULDBLOCK) && (error != EINTR)) {
+            wi_sockerr(sess, error);
+            sess->ws_state = WI_ENDING;
+            goto another_state;
+         }
+         error = 0;
+      }
+      sess->ws_rxsize += error;
+      sess->ws_rxbuf[sess->ws_rxsize] = 0;
+      sess->ws_last = wi_cticks;
+
+      /* If we have all the content, parse the name/value pairs */
+      data = sess->ws_data;
+      if (data) {
+         int   contentRx;
+
+         contentRx = sess->ws_rxsize - (data - sess->ws_rxbuf);
+
+         if (contentRx >= sess->ws_contentLength) {
+            /* Null terminate the content. Anything after it belongs to
+             * the next request, keep the byte for wi_resetsess().
+             */
+            if (contentRx > sess->ws_contentLength) {
+               contentRx = sess->ws_contentLength;
+            }
+            sess->ws_reqlen = (data - sess->ws_rxbuf) + contentRx;
+            sess->ws_rxhold = sess->ws_rxbuf[sess->ws_reqlen];
+            sess->ws_rxbuf[sess->ws_reqlen] = 0;
+            error = wi_buildform(sess, data);
+            if (error) {
+               wi_senderr(sess, 400);  /* Bad request */
+            } else {
+               sess->ws_state = WI_CONTENT;
+            }
+            sess->ws_last = wi_cticks;
+         }
+      }
+      if (sess->ws_state != WI_POSTRX)
+         goto another_state;
+
+      break;
+
+   case WI_CONTENT:
+      error = wi_readfile(sess);
+      if (error && !(sess->ws_flags & WF_ERRREPLY)) {
+         sess->ws_state = WI_ENDING;
+      }
+      sessions++;
+      if (sess->ws_state != WI_CONTENT) {
+    	 goto another_state;
+      }
+#ifdef WI_USE_URING
+      /* A send's completion brings a streamed reply back, see
+       * wi_streamchunk(). Otherwise no event will, keep reading.
+       */
+      if (sess->ws_flags & WF_TXBUSY) {
+         break;
+      }
+      goto another_state;
+#else
+      break;
+#endif
+
+   case WI_SENDDATA:
+      /* Write until the socket is full, then wait for it to say it is
+       * writable again. A session only waits for write events then.
+       */
+      if ((sess->ws_txbufs || (sess->ws_flags & WF_BINARY)) &&
+          ((ready & WI_EVWRITE) || !(sess->ws_flags & WF_TXBLOCKED))) {
+         /* socket has data to write */
+         error = wi_sockwrite(sess);
+         if (error) {
+            sess->ws_state = WI_ENDING;
+         }
+         sessions++;
+      }
+      if (sess->ws_state != WI_SENDDATA) {
+    	 goto another_state;
+      }
+      break;
+   case WI_ENDING:
+      /* Don't delete session and break, else we'll get a fault
+       * in the sess->ws_last test below.
+       */
+      wi_delsess(sess);
+      return sessions;
+   case WI_PUSHING:
+      /* A push with a continuation runs here, see wi_pushstart() */
+      if (sess->ws_pushfunc) {
+         error = wi_pushserve(sess, ready);
+         if (error) {
+            sess->ws_state = WI_ENDING;
+         }
+         sessions++;
+         if (sess->ws_state != WI_PUSHING) {
+            goto another_state;
+         }
+      }
+      break;
+   case WI_WEBSOCKET:
+      error = wi_wsserve(sess, ready);
+      if (error) {
+         sess->ws_state = WI_ENDING;
+      }
+      sessions++;
+      if (sess->ws_state != WI_WEBSOCKET) {
+         goto another_state;
+      }
+      break;
+   case WI_PARKED:
+#ifdef WI_USE_EPOLL
+      /* A long poll has no poll interest, see wi_park(). All epoll
+       * can still report is an error or hangup, the client is gone.
+       */
+      if (ready && (sess->ws_events == 0)) {
+         sess->ws_state = WI_ENDING;
+         goto another_state;
+      }
+#endif
+      break;
+   default:
+      dtrap();
+      break;
+   }
+
+   /* Session survived, set the deadline for its new state */
+   wi_timerupdate(sess);
+
+#ifdef WI_USE_EPOLL
+   /* Session survived, update its poll interest for the new state. If
+    * that fails only this session is lost.
+    */
+   if (wi_pollset(sess)) {
+      wi_delsess(sess);
+   }
+#endif
+
+   return sessions;
+}
+
+
+/* wi_pushready()
+ *
+ * Run the push sessions which wi_pushcheck() or their timers put on
+ * the run list, see wi_pushstart().
+ *
+ * Returns: number of sessions which did work.
+ */
+
+static int wi_pushready(void) {
+   wi_sess *   sess;
+   int   sessions = 0;
+
+   while ((sess = wi_pushnext()) != NULL) {
+      sessions += wi_servesess(sess, 0);
+   }
+   return sessions;
+}
+
+
+/* webpoll() - entry point for driving webio in a "polled" manner.
+ * this checks for any work that needs to be done and returns. It
+ * may be preempted, but is not re-entrant.
+ * 
+ * Returns negative code on error, else number of open sessions.
+ * Return of 0 means no sessions and no error.
+ */
+
+#if defined(WI_USE_URING)
+
+/* io_uring version. Accepts, receives and sends are ring requests,
+ * this passes the requests queued since the last call to the kernel
+ * and handles the completions. Receives run the session's state
+ * machine, send and file read completions continue the reply.
+ */
+
+int wi_poll() {
+   wi_sess * sess;
+   u_long   udata;
+   unsigned flags;
+   int   sessions = 0;
+   int   res;
+   int   op;
+   int   error;
+
+   error = wu_wait(wi_timerwait(WI_SELTMO_MS));
+   if (error) {
+      return error;
+   }
+   wi_clocktick();
+
+   while (wu_getcqe(&udata, &res, &flags)) {
+      op = (int)(udata & WU_OPMASK);
+
+      /* see if we have a new connection */
+      if (op == WU_ACCEPT) {
+         socktype lsock = (socktype)(udata >> 3);
+
+         if (res >= 0) {
+            error = wi_newconn(res, NULL, wi_isunix(lsock));
+            if (error) {
+               dprintf("Socket accept error %d\n", error);
+               return error;
+            }
+         } else if ((res != -ECONNABORTED) && (res != -EINTR) &&
+                    (res != -ECANCELED)) {
+            dprintf("accept error %d\n", -res);
+         }
+         /* restart the accept if the kernel ended it */
+         if (((flags & IORING_CQE_F_MORE) == 0) &&
+             ((lsock == wi_listen) || (wi_unixon && wi_isunix(lsock)))) {
+            error = wu_accept(lsock);
+            if (error) {
+               return error;
+            }
+         }
+         continue;
+      }
+      if (op == WU_CANCEL) {
+         continue;      /* nothing to do, the cancelled request completes */
+      }
+      if (op == WU_WAKE) {
+         /* another thread woke a push */
+         wi_pushcheck();
+         if (((flags & IORING_CQE_F_MORE) == 0) && (wi_wakefd >= 0)) {
+            error = wu_pollwake(wi_wakefd);
+            if (error) {
+               return error;
+            }
+         }
+         continue;
+      }
+
+      sess = (wi_sess *)(udata & ~(u_long)WU_OPMASK);
+      if ((flags & IORING_CQE_F_MORE) == 0) {
+         sess->ws_ioinflight--;
+      }
+      if (op == WU_RECV) {
+         wu_rxdata(sess, res, flags);
+      } else {
+         wu_txcomplete(sess, op, res);
+      }
+
+      /* run the state machine, this also deletes ending sessions */
+      error = wi_servesess(sess, 0);
+      if (error < 0) {
+         return error;
+      }
+      sessions += error;
+   }
+
+   /* see how long the pass took, and time out the sessions whose
+    * deadlines have passed. Then run the pushes which were woken or
+    * whose timers went off.
+    */
+   wi_loadcheck();
+   wi_timercheck();
+   sessions += wi_pushready();
+
+   return sessions;
+}
+
+#elif defined(WI_USE_EPOLL)
+
+/* epoll version. Only sessions with socket events are serviced. 
+ * Sessions with no socket interest (e.g. server push) and idle ones
+ * are looked after by their timers.
+ */
+
+int wi_poll() {
+   struct epoll_event events[WI_MAXEVENTS];
+   wi_sess * sess;
+   int   sessions = 0;
+   int   nevents;
+   int   ready;
+   int   error;
+   int   i;
+
+   nevents = epoll_wait(wi_epfd, events, WI_MAXEVENTS,
+      (int)wi_timerwait(WI_SELTMO_MS));
+   if (nevents < 0) {
+      error = errno;
+      if (error == EINTR) {
+         return 0;
+      }
+      dprintf("epoll_wait error %d\n", error );
+      return WI_E_SOCKET;
+   }
+   wi_clocktick();
+
+   for (i = 0; i < nevents; i++) {
+      sess = (wi_sess *)events[i].data.ptr;
+
+      /* see if another thread woke a push */
+      if (sess == WI_WAKEKEY) {
+         wi_pushcheck();
+         continue;
+      }
+
+      /* see if we have a new connection request */
+      if (WI_ISLISTENKEY(sess)) {
+         error = wi_sockaccept(sess ? wi_unixsocks[(u_long)sess - 1] : wi_listen);
+         if (error) {
+            dprintf("Socket accept error %d\n", error);
+            return error;
+         }
+         continue;
+      }
+
+      ready = 0;
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+         ready |= WI_EVREAD;
+      }
+      if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+         ready |= WI_EVWRITE;
+      }
+      error = wi_servesess(sess, ready);
+      if (error < 0) {
+         return error;
+      }
+      sessions += error;
+   }
+
+   /* see how long the pass took, and time out the sessions whose
+    * deadlines have passed. Then run the pushes which were woken or
+    * whose timers went off.
+    */
+   wi_loadcheck();
+   wi_timercheck();
+   sessions += wi_pushready();
+
+   return sessions;
+}
+
+#else    /* select() version */
+
+int wi_poll() {
+   wi_sess * sess;
+   wi_sess * next_sess;
+   struct timeval seltmo;
+   long  waitms;
+   int   sessions = 0;
+   int   events;
+   int   ready;
+   int   error;
+   fd_set sel_recv;
+   fd_set sel_send;
+
+   memset(&sel_recv, 0, sizeof(sel_recv));
+   memset(&sel_send, 0, sizeof(sel_send));
+
+   /* add listen sock to select list */
+   wi_highsocket = 0;
+   if (wi_listen != INVALID_SOCKET) {     /* closed by wi_shutdown() */
+      FD_SET(wi_listen, &sel_recv);
+      wi_highsocket = wi_listen;
+   }
+#ifdef LINUX
+   if (wi_unixon) {
+      int   i;
+
+      for (i = 0; i < wi_nunix; i++) {
+         FD_SET(wi_unixsocks[i], &sel_recv);
+         if (wi_unixsocks[i] > wi_highsocket) {
+            wi_highsocket = wi_unixsocks[i];
+         }
+      }
+   }
+#endif
+
+   /* loop through list of open sessions looking for work */
+   for (sess = wi_sessions; sess; sess = sess->ws_next) {
+      events = wi_sessevents(sess);
+      if (events == 0) {
+    	  continue;
+      }
+
+      if (events & WI_EVREAD) {
+         FD_SET(sess->ws_socket, &sel_recv);
+      }
+      if (events & WI_EVWRITE) {
+         FD_SET(sess->ws_socket, &sel_send);
+      }
+      if (sess->ws_socket > wi_highsocket) {
+         wi_highsocket = sess->ws_socket;
+      }
+   }
+   if (wi_wakefd >= 0) {
+      FD_SET(wi_wakefd, &sel_recv);
+      if (wi_wakefd > wi_highsocket) {
+         wi_highsocket = wi_wakefd;
+      }
+   }
+   wi_highsocket++;     /* Select mumbo-jumbo */
+
+   /* See if any of the sockets have input or ready to send. Some 
+    * systems change the passed timeout, so pass a copy. Don't wait
+    * past the next session timer.
+    */
+   seltmo = wi_seltmo;
+   waitms = wi_timerwait(WI_SELTMO_MS);
+   if (waitms < WI_SELTMO_MS) {
+      seltmo.tv_sec = waitms / 1000;
+      seltmo.tv_usec = (waitms % 1000) * 1000;
+   }
+   sessions = select( wi_highsocket, &sel_recv, &sel_send, NULL, &seltmo);
+   if (sessions == SOCKET_ERROR) {
+      error = errno;
+      if (error == EINTR) {
+         return 0;      /* a signal, e.g. the SIGTERM of a shutdown */
+      }
+      dprintf("select error %d\n", error );
+      return WI_E_SOCKET;
+   }
+   wi_clocktick();
+
+   /* see if we have a new connection request */
+   if ((wi_listen != INVALID_SOCKET) && FD_ISSET(wi_listen, &sel_recv)) {
+      error = wi_sockaccept(wi_listen);
+      if (error) {
+         dprintf("Socket accept error %d\n", error);
+         return error;
+      }
+   }
+#ifdef LINUX
+   if (wi_unixon) {
+      int   i;
+
+      for (i = 0; i < wi_nunix; i++) {
+         if (FD_ISSET(wi_unixsocks[i], &sel_recv)) {
+            error = wi_sockaccept(wi_unixsocks[i]);
+            if (error) {
+               dprintf("Socket accept error %d\n", error);
+               return error;
+            }
+         }
+      }
+   }
+#endif
+
+   /* see if another thread woke a push. Without a wake descriptor, 
+    * look every pass.
+    */
+   if ((wi_wakefd < 0) || FD_ISSET(wi_wakefd, &sel_recv)) {
+      wi_pushcheck();
+   }
+
+   sessions = 0;
+   sess = wi_sessions; 
+   while (sess) {
+      next_sess = sess->ws_next;
+
+      ready = 0;
+      if (sess->ws_socket != INVALID_SOCKET) {
+         if (FD_ISSET(sess->ws_socket, &sel_recv)) {
+            ready |= WI_EVREAD;
+         }
+         if (FD_ISSET(sess->ws_socket, &sel_send)) {
+            ready |= WI_EVWRITE;
+         }
+      }
+      error = wi_servesess(sess, ready);
+      if (error < 0) {
+         return error;
+      }
+      sessions += error;
+
+      sess = next_sess;
+   }
+
+   /* see how long the pass took, and time out the sessions whose
+    * deadlines have passed. Then run the pushes which were woken or
+    * whose timers went off.
+    */
+   wi_loadcheck();
+   wi_timercheck();
+   sessions += wi_pushready();
+
+   return sessions;
+}
+
+#endif   /* WI_USE_URING, WI_USE_EPOLL */
+
+/* wi_listenclose()
+ *
+ * Stop accepting on the calling reactor's listen sockets and close its
+ * TCP one. An inherited socket is only closed, not shut down, since
+ * other processes may still be accepting from it.
+ */
+
+static void wi_listenclose(void) {
+#ifdef LINUX
+   /* The reactors share the unix domain listeners, each just stops
+    * polling them. The process exiting closes them.
+    */
+   if (wi_unixon) {
+      int   i;
+
+      for (i = 0; i < wi_nunix; i++) {
+#ifdef WI_USE_EPOLL
+         epoll_ctl(wi_epfd, EPOLL_CTL_DEL, wi_unixsocks[i], NULL);
+#endif
+#ifdef WI_USE_URING
+         wu_cancel(wi_unixsocks[i]);
+#endif
+      }
+      wi_unixon = FALSE;
+   }
+#endif   /* LINUX */
+
+   if (wi_listen == INVALID_SOCKET) {
+      return;
+   }
+#ifdef WI_USE_EPOLL
+   /* The socket lives on if it is shared, and so would its events */
+   epoll_ctl(wi_epfd, EPOLL_CTL_DEL, wi_listen, NULL);
+#endif
+#ifdef WI_USE_URING
+   wu_cancel(wi_listen);
+#endif
+#ifdef LINUX
+   if (wi_listenfd >= 0) {
+      close((int)wi_listen);
+   } else
+#endif
+   {
+      closesocket(wi_listen);
+   }
+   wi_listen = INVALID_SOCKET;
+}
+
+/* wi_shutdown()
+ *
+ * Shut the server down gracefully. Each reactor stops accepting and 
+ * closes its listen socket, ends its idle persistent connections, and
+ * lets the replies it is sending finish; wi_thread() returns once they
+ * have. Sessions still open after "secs" seconds are dropped. This 
+ * only sets flags, so it may be called from a signal handler.
+ */
+
+void wi_shutdown(int secs) {
+   wi_draintmo = secs;
+   wi_draining = TRUE;
+}
+
+/* wi_drain()
+ *
+ * Do the calling reactor's part of a shutdown, once per poll pass.
+ *
+ * Returns: TRUE once the reactor has no sessions left.
+ */
+
+static WI_TLS int     wi_drainstart = FALSE;
+static WI_TLS u_long  wi_drainend;     /* wi_cticks to drop sessions at */
+
+static int wi_drain(void) {
+   wi_sess *  sess;
+   wi_sess *  nextsess;
+   int   late;
+
+   if (!wi_drainstart) {
+      wi_drainstart = TRUE;
+      wi_drainend = wi_cticks + (wi_draintmo * TPS);
+
+      /* Closing a listen socket of our own resets its accept queue, so
+       * take what is waiting first. Connections which arrive between
+       * this and the close are still lost; only an inherited socket
+       * (wi_listenfd) hands over to a new process without a gap.
+       */
+      if ((wi_listen != INVALID_SOCKET) && (wi_listenfd < 0)) {
+         wi_sockaccept(wi_listen);
+      }
+      wi_listenclose();
+   }
+   late = ((long)(wi_cticks - wi_drainend) >= 0);
+
+   for (sess = wi_sessions; sess; sess = nextsess) {
+      nextsess = sess->ws_next;
+      if (sess->ws_state == WI_ENDING) {
+         continue;      /* on its way out */
+      }
+      sess->ws_flags &= ~WF_PERSIST;  /* close after the current reply */
+
+      /* A push with a continuation is told to wrap up */
+      if (sess->ws_state == WI_PUSHING) {
+         wi_pushstop(sess);
+      }
+
+      /* A WebSocket client is told the server is going away */
+      if (sess->ws_state == WI_WEBSOCKET) {
+         wi_wsclose(sess, 1001);
+      }
+
+      /* A long poll is answered now */
+      wi_parkexpire(sess);
+
+      /* A connection waiting for its next request can go. One which
+       * hasn't sent its first may have been accepted just now.
+       */
+      if (late || ((sess->ws_state == WI_HEADER) && (sess->ws_rxsize == 0) &&
+                   (sess->ws_requests > 0))) {
+         wi_delsess(sess);
+      }
+   }
+   return (wi_sessions == NULL);
+}
+
+int wi_step() {
+	int ret;
+
+	if (wi_draining && !wi_drained) {
+	   wi_drained = wi_drain();
+	   if (wi_drained) {
+	      return 0;
+	   }
+	}
+	ret = wi_poll();
+	if ( ret < 0 ) {
+    	   wi_sess *  sess;
+    	   wi_sess *  nextsess;
+           dtrap(); /* restart the server */
+           /* clean out everything */
+           for (sess = wi_sessions; sess; sess = nextsess) {
+               nextsess = sess->ws_next;
+               wi_delsess(sess);
+           }
+           /* An inherited listen socket can't be opened again, keep it */
+           if (wi_listenfd < 0) {
+              if (wi_listen != INVALID_SOCKET) {
+                 closesocket(wi_listen);
+              }
+              TH_SLEEP(TPS);	/* give sockets time to close */
+              wi_listeninit();     /* restart */
+           }
+	}
+	return ret;
+}
+
+#ifdef WI_USE_THREADS
+
+/* wi_thread() - entry point for driving webio from a single thread.  It
+ * is essentially an infinite loop which drives wi_poll.
+ *
+ * This should never return unless the web server is shut down.
+ *
+ * Returns: 0 if normal shutdown, else negative error code.
+ */
+
+int wi_thread() {
+	int ret = 0;
+	while (wi_running && !wi_drained) {
+		ret = wi_step();
+	}
+#ifdef WI_USE_REACTORS
+	/* After a shutdown, wait for the other reactors to drain too */
+	while (wi_drained && (wi_reactorsdone < (wi_reactors - 1))) {
+		TH_SLEEP(1);
+	}
+#endif
+	return ret;
+}
+
+#endif /* WI_USE_THREADS */
+
+/* wi_islocal()
+ *
+ * See if a connecting host is this machine. This is called for the 
+ * wi_localhost option.
+ *
+ * Returns TRUE if the host is local, else FALSE.
+ */
+
+static int wi_islocal(socktype sock, struct sockaddr_in * sa) {
+   struct sockaddr_in local;
+   socklen_t slen;
+   int   i;
+
+   /* see if remote host is 127.0.0.1 or other version of self */
+   if (htonl(sa->sin_addr.s_addr) == 0x7F000001) {
+      return TRUE;
+   }
+
+   /* wasn't loopback, check our cached local IPs */
+   if (wi_nlocaladdrs >= 0) {
+      for (i = 0; i < wi_nlocaladdrs; i++) {
+         if (sa->sin_addr.s_addr == wi_localaddrs[i]) {
+            return TRUE;
+         }
+      }
+      return FALSE;
+   }
+
+   /* No cache, get socket's local IP */
+   memset(&local, 0, sizeof(local));
+   slen = sizeof(local);
+   if ( getsockname(sock, (struct sockaddr *)&local, &slen) < 0) {
+      return FALSE;
+   }
+   return (sa->sin_addr.s_addr == local.sin_addr.s_addr);
+}
+
+/* wi_sockaccept()
+ *
+ * Accept all the connections waiting on listen socket "lsock" and make
+ * a session for each. This is called when the listen socket is readable.
+ * "lsock" may be the TCP socket or a unix domain one.
+ *
+ * Returns 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_sockaccept(socktype lsock) {
+   struct sockaddr_in sa;
+   socktype    newsock;
+   socklen_t   sasize;
+   int         unixsock = wi_isunix(lsock);
+   int         error;
+
+   for (;;) {
+      sasize = sizeof(struct sockaddr_in);
+#ifdef LINUX
+      /* Get the new socket already in non-blocking mode. Unix domain
+       * peers have no address worth keeping.
+       */
+      if (unixsock) {
+         newsock = accept4(lsock, NULL, NULL, SOCK_NONBLOCK);
+      } else {
+         newsock = accept4(lsock, (struct sockaddr * )&sa, &sasize, SOCK_NONBLOCK);
+      }
+#else
+      newsock = accept(lsock, (struct sockaddr * )&sa, &sasize);
+#endif
+      if (newsock == INVALID_SOCKET) {
+         error = errno;
+         if ((error == EWOULDBLOCK) || (error == EAGAIN)) {
+            return 0;      /* accept queue is empty */
+         }
+         if ((error == ECONNABORTED) || (error == EINTR)) {
+            continue;      /* this connection went away, try next */
+         }
+         dprintf("accept error %d\n", error);
+         return 0;         /* e.g. out of descriptors, retry next poll */
+      }
+      if (!unixsock && (sasize != sizeof(struct sockaddr_in))) {
+         dtrap();
+         closesocket(newsock);
+         return WI_E_SOCKET;
+      }
+
+#ifndef LINUX
+      /* Set every socket to non-blocking. */
+      error = WI_NOBLOCKSOCK(newsock);
+      if (error) {
+         dtrap();
+         wi_panic("blocking socket");
+      }
+#endif
+
+      error = wi_newconn(newsock, unixsock ? NULL : &sa, unixsock);
+      if (error) {
+         return error;
+      }
+   }
+}
+
+/* wi_loadcheck()
+ *
+ * Time the poll pass which is ending, for wi_admit(). An event which
+ * came in as the pass started waited this long to be served, so this
+ * is the reactor's queueing delay. As with CoDel, a few long passes
+ * are a burst and are let go: the reactor is overloaded once every
+ * pass for wi_shedinterval has taken over wi_shedtarget, and stops
+ * being overloaded with the first pass which doesn't.
+ */
+
+static WI_TLS u_long wi_latesince;  /* wi_cmsecs when passes started running long, 0 if they aren't */
+
+static void wi_loadcheck(void) {
+   u_long   start = wi_cmsecs;
+
+   if (wi_shedtarget <= 0) {
+      wi_overloaded = FALSE;
+      return;
+   }
+   wi_clocktick();
+   if ((long)(wi_cmsecs - start) < wi_shedtarget) {
+      wi_latesince = 0;
+      wi_overloaded = FALSE;
+      return;
+   }
+   if (wi_latesince == 0) {
+      wi_latesince = start;
+   } else if ((long)(wi_cmsecs - wi_latesince) >= wi_shedinterval) {
+      if (!wi_overloaded) {
+         dprintf("overloaded, shedding new connections\n");
+      }
+      wi_overloaded = TRUE;
+   }
+}
+
+/* wi_admit()
+ *
+ * See if this reactor can take on another connection. It can't if it
+ * has wi_maxsess sessions, if it has wi_maxtxbytes of replies waiting
+ * to be sent, or if its poll passes are running late. Another session
+ * would only slow down the ones it already has.
+ *
+ * Returns TRUE if a session may be made for the connection.
+ */
+
+static int wi_admit(void) {
+   if ((wi_maxsess > 0) && (wi_nsess >= wi_maxsess)) {
+      return FALSE;
+   }
+   if ((wi_maxtxbytes > 0) && 
+       (((long)wi_ntxbufs * (long)sizeof(txbuf)) >= wi_maxtxbytes)) {
+      return FALSE;
+   }
+   return !wi_overloaded;
+}
+
+/* wi_shed()
+ *
+ * Turn away a connection wi_admit() refused, or one there was no 
+ * session for. It gets a canned 503 reply, made once, and is closed. 
+ * The reply is tried once only, if the socket won't take it the client
+ * just sees the connection close. Any request which already came in 
+ * is read off first, so the close doesn't reset the connection and 
+ * lose the reply.
+ */
+
+static WI_TLS char   wi_shedreply[128];
+static WI_TLS int    wi_shedlen;
+static WI_TLS int    wi_shedretry = -1;   /* wi_retryafter wi_shedreply was made for */
 
-      sess = next_sess;
-   }
+static void wi_shed(socktype sock) {
+   char  junk[512];
 
-   return sessions;
+   if (wi_shedretry != wi_retryafter) {
+      wi_shedlen = sprintf(wi_shedreply, "HTTP/1.1 503 Service Unavailable\r\n"
+         "Retry-After: %d\r\nConnection: close\r\nContent-Length: 0\r\n\r\n",
+         wi_retryafter);
+      wi_shedretry = wi_retryafter;
+   }
+   recv(sock, junk, sizeof(junk), 0);
+   send(sock, wi_shedreply, wi_shedlen, MSG_NOSIGNAL);
+   closesocket(sock);
+   wi_shedconns++;
 }
 
-int wi_step() {
-	int ret = wi_poll();
-	if ( ret < 0 ) {
-    	   wi_sess *  sess;
-    	   wi_sess *  nextsess;
-           dtrap(); /* restart the server */
-           /* clean out everything */
-           closesocket(wi_listen);
-           for (sess = wi_sessions; sess; sess = nextsess) {
-               nextsess = sess->ws_next;
-               wi_delsess(sess);
-           }
-           TH_SLEEP(TPS);	/* give sockets time to close */
-           wi_init();     /* restart */
-	}
-	return ret;
-}
+/* Connections without a whole header yet, per client. Clients are
+ * hashed into WI_HALFOPENHASH counters. A counter shared by two clients
+ * may refuse one of them early, but never lets one past the limit.
+ */
 
-#ifdef WI_USE_THREADS
+#ifndef WI_HALFOPENHASH
+#define WI_HALFOPENHASH    1024     /* power of 2 */
+#endif
 
-/* wi_thread() - entry point for driving webio from a single thread.  It
- * is essentially an infinite loop which drives wi_poll.
- *
- * This should never return unless the web server is shut down.
+static WI_TLS u_short wi_halfopen[WI_HALFOPENHASH];
+
+#define WI_IPHASH(addr) \
+   ((int)(((addr) * 2654435761UL) >> 16) & (WI_HALFOPENHASH - 1))
+
+/* wi_hdrdone()
  *
- * Returns: 0 if normal shutdown, else negative error code.
+ * Take a session off its client's count of half open connections. 
+ * This is called when the first request header is in, and when the
+ * session is deleted.
  */
 
-int wi_thread() {
-	int ret = 0;
-	while (wi_running) {
-		ret = wi_step();
-	}
-	return ret;
+void wi_hdrdone(wi_sess * sess) {
+   int   slot;
+
+   if (sess->ws_flags & WF_HALFOPEN) {
+      sess->ws_flags &= ~WF_HALFOPEN;
+      slot = WI_IPHASH(sess->ws_peeraddr);
+      if (wi_halfopen[slot] > 0) {
+         wi_halfopen[slot]--;
+      }
+   }
 }
 
-#endif /* WI_USE_THREADS */
+/* wi_newconn()
+ *
+ * Make a session for a newly accepted, non-blocking socket and hand
+ * the socket to the poll backend. "sa" is the peer's address, or NULL
+ * if the caller doesn't have it. "unixsock" is TRUE for a connection
+ * on a unix domain listener; those are local by definition, so the
+ * localhost and per-client checks don't apply.
+ *
+ * Returns 0 if OK (a refused host or a connection turned away for
+ * load is not an error), else negative WI_E_ error code.
+ */
 
-int wi_sockaccept() {
-   struct sockaddr_in sa;
-   socktype    newsock;
-   wi_sess *   newsess;
+static int wi_newconn(socktype newsock, struct sockaddr_in * sa, int unixsock) {
+   struct sockaddr_in peer;
    socklen_t   sasize;
-   int         error;
+   wi_sess *   newsess;
+   int         halfopen = (wi_maxhalfopen > 0) && !unixsock;
 
-   sasize = sizeof(struct sockaddr_in);
-   newsock = accept(wi_listen, (struct sockaddr * )&sa, &sasize);
-   if (sasize != sizeof(struct sockaddr_in)) {
-      dtrap();
-      return WI_E_SOCKET;
+   if (!unixsock && (sa == NULL) && (wi_localhost || halfopen)) {
+      memset(&peer, 0, sizeof(peer));
+      sasize = sizeof(peer);
+      if (getpeername(newsock, (struct sockaddr *)&peer, &sasize) < 0) {
+         closesocket(newsock);
+         return 0;
+      }
+      sa = &peer;
    }
 
    /* If the localhost-only flag is set, reject all other hosts */
-   if (wi_localhost) {
-      /* see if remote host is 127.0.0.1 or other version of self */
-      if (htonl(sa.sin_addr.s_addr) != 0x7F000001) {
-         struct sockaddr_in local;
-         socklen_t slen;
-
-         /* wasn't loopback, check for local IP.
-   	    * First get socket's local IP
-          */
-         memset(&local, 0, sizeof(local));
-         slen = sizeof(local);
-         if ( getsockname(newsock, (struct sockaddr *)&local, &slen) < 0) {
-             closesocket(newsock);
-             return -1;
-         }
-
-         if (sa.sin_addr.s_addr != local.sin_addr.s_addr) {
-            closesocket(newsock);
-            return 0;   /* not an error */
-         }
+   if (wi_localhost && !unixsock) {
+      if (!wi_islocal(newsock, sa)) {
+         closesocket(newsock);
+         return 0;   /* not an error */
       }
    }
 
-   /* Set every socket to non-blocking. */
-   error = WI_NOBLOCKSOCK(newsock);
-   if (error) {
-      dtrap();
-      wi_panic("blocking socket");
+   /* now that we have a new socket connection, make a session 
+    * object for it. The session's receive buffer is attached later, 
+    * when the request data arrives.
+    */
+   if (!wi_admit()) {
+      wi_shed(newsock);
+      return 0;
    }
 
-   /* now that we have a new socket connection, make a session 
-    * object for it 
+   /* A client holding wi_maxhalfopen connections open without sending
+    * a request is not worth a reply.
     */
+   if (halfopen && 
+       (wi_halfopen[WI_IPHASH(sa->sin_addr.s_addr)] >= wi_maxhalfopen)) {
+      closesocket(newsock);
+      wi_shedconns++;
+      return 0;
+   }
    newsess = wi_newsess();
    if (!newsess) {
-	   return WI_E_MEMORY;
+      wi_shed(newsock);
+      return 0;      /* out of memory for now, not fatal to the server */
    }
    newsess->ws_socket = newsock;
-      
+   if (sa) {
+      newsess->ws_peeraddr = sa->sin_addr.s_addr;
+   }
+   if (unixsock) {
+      newsess->ws_flags |= WF_UNIX;
+   } else if (halfopen) {
+      wi_halfopen[WI_IPHASH(newsess->ws_peeraddr)]++;
+      newsess->ws_flags |= WF_HALFOPEN;
+   }
+   wi_socktune(newsess, WI_TUNE_ACCEPT, 0);
+
+   /* The header must arrive within wi_hdrtmo */
+   wi_timerupdate(newsess);
+
+#ifdef WI_USE_EPOLL
+   /* Register the socket once; wi_pollset() only modifies it later */
+   {
+      struct epoll_event ev;
+
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = newsess;
+      if (epoll_ctl(wi_epfd, EPOLL_CTL_ADD, newsock, &ev) < 0) {
+         dprintf("epoll_ctl add error %d\n", errno);
+         wi_delsess(newsess);
+         return 0;   /* not fatal to the server */
+      }
+      newsess->ws_events = WI_EVREAD;
+   }
+#endif   /* WI_USE_EPOLL */
+
+#ifdef WI_USE_URING
+   /* Start receiving; the data shows up as ring completions */
+   if (wu_recv(newsess)) {
+      wi_delsess(newsess);
+      return 0;      /* not fatal to the server */
+   }
+#endif   /* WI_USE_URING */
+
    return 0;
 }
 
@@ -417,21 +1825,36 @@ int wi_parseheader( wi_sess * sess ) {
    char *   rxend;
    char *   pairs;
    u_long   cmd;
+   int      persist;
+   int      upgrade;    /* Connection: lists "upgrade" */
 
    char *   uri;
    char *   referer;
    char *   auth;
    char *   host;
+   char *   wskey;
 
    int      error;
 
-   /* First find end of HTTP header */
-   rxend = strstr(sess->ws_rxbuf, "\r\n\r\n" );
+   /* First find end of HTTP header. Only the data which came in since
+    * the last look is searched, plus 3 bytes in case the end straddles.
+    */
+   rxend = strstr(sess->ws_rxbuf + sess->ws_hdrscan, "\r\n\r\n" );
    if (!rxend) {
+      if (sess->ws_rxsize >= (WI_RXBUFSIZE - 1)) {
+         wi_senderr(sess, 431);  /* rxbuf is full, header won't fit */
+         return WI_E_CLIENT;
+      }
+      sess->ws_hdrscan = (sess->ws_rxsize > 3) ? (sess->ws_rxsize - 3) : 0;
 	   return 0; /* no header yet - wait some more */
    }
+   sess->ws_hdrscan = 0;
+   wi_hdrdone(sess);
 
    sess->ws_data = rxend + 4;
+   sess->ws_reqlen = sess->ws_data - sess->ws_rxbuf;
+   sess->ws_rxhold = *sess->ws_data;
+   sess->ws_flags &= ~WF_PERSIST;
 
    /* extract the basic http comand */
    cmd = sess->ws_rxbuf[0];
@@ -457,7 +1880,6 @@ int wi_parseheader( wi_sess * sess ) {
       /* unsupported command - send eror and clean up */
       wi_senderr(sess, 501);
       sess->ws_flags &= ~WF_READINGCMDS;
-      sess->ws_state = WI_ENDING;
       return -1;
    }
 
@@ -478,17 +1900,75 @@ int wi_parseheader( wi_sess * sess ) {
 	   uri = cp;
    }
 
+   /* HTTP/1.1 connections are persistent unless the client says
+    * "Connection: close", HTTP/1.0 ones only if it asks for keep-alive.
+    */
+   persist = FALSE;
+   cl = wi_nextarg(cp);
+   if (cl && (strncmp(cl, "HTTP/1.", 7) == 0)) {
+      persist = (cl[7] >= '1');
+      if (persist) {
+         sess->ws_flags |= WF_HTTP11;
+      }
+   }
+   upgrade = wi_hastoken("Connection:", "upgrade", cp);
+   cl = wi_getline("Connection:", cp);
+   if (cl) {
+      if (strnicmp(cl, "close", 5) == 0) {
+         persist = FALSE;
+      } else if (strnicmp(cl, "keep-alive", 10) == 0) {
+         persist = TRUE;
+      }
+   }
+   if ((wi_maxrequests > 0) && (sess->ws_requests + 1 >= wi_maxrequests)) {
+      persist = FALSE;     /* last request on this connection */
+   }
+   if (wi_draining) {
+      persist = FALSE;     /* shutting down, tell the client now */
+   }
+   if (persist) {
+      sess->ws_flags |= WF_PERSIST;
+   }
+
    /* Extract other useful fields from header  */
    auth = wi_getline("Authorization:", cp);
    referer = wi_getline("Referer:", cp);
    host = wi_getline("Host:", cp);
 
+   /* An event stream client coming back says what it saw last */
+   cl = wi_getline("Last-Event-ID:", cp);
+   sess->ws_lastevent = cl ? strtoul(cl, NULL, 10) : 0;
+
+   /* A WebSocket client asks to switch protocols. wi_wsaccept() checks
+    * the handshake, this just notes what was asked for.
+    */
+   wskey = NULL;
+   sess->ws_wsver = -1;
+   cl = wi_getline("Upgrade:", cp);
+   if (cl && (strnicmp(cl, "websocket", 9) == 0)) {
+      sess->ws_wsver = 0;     /* malformed, unless... */
+      cl = wi_getline("Sec-WebSocket-Version:", cp);
+      if (upgrade && cl && (atoi(cl) > 0)) {
+         sess->ws_wsver = atoi(cl);
+      }
+      wskey = wi_getline("Sec-WebSocket-Key:", cp);
+   }
+
    cl = wi_getline("Content-Length:", cp);
    if (cl) {
 	   sess->ws_contentLength = atoi(cl);
    } else {
 	   sess->ws_contentLength = 0;  /* unset */
    }
+   if (sess->ws_contentLength < 0) {
+      wi_senderr(sess, 400);  /* Bad request */
+      return WI_E_CLIENT;
+   }
+   /* The body is read into rxbuf behind the header, it must fit */
+   if (sess->ws_contentLength > ((WI_RXBUFSIZE - 1) - sess->ws_reqlen)) {
+      wi_senderr(sess, 413);  /* Content too large */
+      return WI_E_CLIENT;
+   }
 
    /* Check for name/value pairs and build form if found */
    if (cmd == H_GET) {
@@ -530,6 +2010,11 @@ int wi_parseheader( wi_sess * sess ) {
    }
    sess->ws_host = host;
 
+   if ((wskey > sess->ws_rxbuf) && (wskey < rxend)) {
+	   wi_argterm(wskey);
+   }
+   sess->ws_wskey = wskey;
+
    /* Find and open file to return, */
    error = wi_fopen(sess, sess->ws_uri, "rb");
    if (error) {
@@ -606,6 +2091,91 @@ void wi_badform(wi_sess * sess, char * errmsg) {
 }
 
 
+/* wi_streamchunk()
+ *
+ * Called by wi_readfile() as it builds a text reply. Once wi_chunkmark
+ * bytes are queued for an HTTP/1.1 request, they are sent as a chunk
+ * (see wi_chunk()), so the client gets the start of a big page while
+ * the rest is built. After that the page is built no faster than the
+ * socket takes it, and the session holds about wi_chunkmark bytes.
+ * Output from a body generator is streamed to HTTP/1.0 clients too.
+ * With io_uring the chunk goes in a ring send, and the session waits
+ * for it to complete, see wu_txcomplete().
+ *
+ * Returns: 0 to go on building the reply, 1 to wait until the socket
+ * is writable, else negative WI_E_ error code.
+ */
+
+static int wi_streamchunk(wi_sess * sess) {
+   int      error;
+
+   if ((wi_chunkmark <= 0) ||
+       (((sess->ws_flags & WF_HTTP11) == 0) && !sess->ws_generator) ||
+       (sess->ws_flags & (WF_BINARY | WF_SVRPUSH))) {
+      return 0;
+   }
+   if (wi_txqueued(sess) < wi_chunkmark) {
+      return 0;
+   }
+
+#ifdef WI_USE_URING
+   if (sess->ws_flags & WF_TXBUSY) {
+      return 1;      /* the send's completion brings us back */
+   }
+   error = wi_chunk(sess, FALSE);
+   if (error == 0) {
+      error = wu_sockwrite(sess);
+   }
+   return error ? error : 1;
+#else
+   error = wi_chunk(sess, FALSE);
+   if (error == 0) {
+      error = wi_txflush(sess);
+   }
+   if (error) {
+      return error;
+   }
+   return (wi_txqueued(sess) >= wi_chunkmark) ? 1 : 0;
+#endif   /* WI_USE_URING */
+}
+
+/* wi_generate()
+ *
+ * Call a session's body generator (see wi_setgenerator()) for more
+ * output until it is done. Its output is streamed as it piles up, and
+ * while the socket is behind the generator is left until it catches
+ * up. One which has nothing yet is parked, see wi_genpark().
+ *
+ * Returns: 0 when the generator is done, 1 to come back later, else
+ * negative WI_E_ error code.
+ */
+
+static int wi_generate(wi_sess * sess) {
+   int   queued;
+   int   more;
+   int   error;
+
+   while (sess->ws_generator) {
+      error = wi_streamchunk(sess);
+      if (error) {
+         return error;
+      }
+      queued = wi_txqueued(sess);
+      more = sess->ws_generator(sess, sess->ws_genctx);
+      if (more <= 0) {
+         sess->ws_generator = NULL;
+         wi_genstop(sess);
+         return more;
+      }
+      if (wi_txqueued(sess) == queued) {
+         /* Nothing yet, sleep until it is woken or the next tick */
+         wi_genpark(sess);
+         return 1;
+      }
+   }
+   return 0;
+}
+
 /* wi_readfile()
  *
  * Read file from disk or script into txbufs. Allocate txbufs as we go 
@@ -624,12 +2194,34 @@ void wi_badform(wi_sess * sess, char * errmsg) {
 int wi_readfile(struct wi_sess_s * sess) {
    int         error;
    int         len;
-   int         toread;
    wi_file *   fi;     /* info about current file */
 
    /* start loading file to return. */
    fi = sess->ws_filelist;
 
+   /* A chunked reply waits here while the socket is behind */
+   if (sess->ws_flags & WF_CHUNKED) {
+      error = wi_streamchunk(sess);
+      if (error) {
+         return (error < 0) ? error : 0;
+      }
+   }
+
+   /* A form or SSI routine may have left a generator to make its
+    * output. Once it is done, go on with the file it came from.
+    */
+generate:
+   if (sess->ws_generator) {
+      error = wi_generate(sess);
+      if (error) {
+         return (error < 0) ? error : 0;
+      }
+      fi = sess->ws_filelist;
+      if (fi == NULL) {
+         goto readdone;
+      }
+   }
+
    /* Check for embedded form & server-side push handlers */
    if (fi->wf_routines == &emfs) {
       EOFILE * eofile;
@@ -652,39 +2244,107 @@ int wi_readfile(struct wi_sess_s * sess) {
             wi_badform(sess, errmsg);
             return WI_E_BADPARM;
          }
+         if (sess->ws_state == WI_PARKED) {
+            return 0;      /* run again by wi_wake() or its deadline */
+         }
+         if (sess->ws_generator) {
+            wi_fclose(fi);    /* the generator makes the reply */
+            goto generate;
+         }
          if (sess->ws_filelist == NULL) { /* done with request */
             return 0;
          } else {
         	 fi = sess->ws_filelist; /* re-set local variable */
          }
+         /* A handler which made the reply itself, with wi_printf(),
+          * leaves the form file. There is nothing to read from it.
+          */
+         if ((fi->wf_routines == &emfs) &&
+             (((EOFILE *)fi->wf_fd)->eo_emfile->em_flags & EMF_FORM)) {
+            wi_fclose(fi);
+            if (sess->ws_filelist) {
+               return 0;
+            }
+            goto readdone;
+         }
       } else if (emf->em_flags & EMF_PUSH) { /* handle server push */
-         char * (*pushhandler)(wi_sess*);
+         PUSH_ROUTINE * pushhandler;
 
          /* This is a server-side push file. We pass this session to a 
           * user-defined routine. This routine should write data to
           * the session for as long as it needs to (perhaps hours)
           * Then dispose of the session by setting sess->ws_state
           * to WI_ENDING. The webio core will clean up the sesison 
-          * from there.
+          * from there. Or it may hand the session back to us with
+          * wi_pushstart() and return, to be called when there is
+          * something to do.
           */
 
          pushhandler = emf->em_routine;
+         sess->ws_flags &= ~WF_PERSIST;   /* push owns the connection */
          sess->ws_state = WI_PUSHING;
          if (pushhandler == NULL) {
         	 return WI_E_BADFILE;
          }
+         wi_socktune(sess, WI_TUNE_PUSH, 0);
 
          dprintf("Server push call...\n");
-         pushhandler(sess);
-         /* The session now belongs to the push code. */
+         error = pushhandler(sess, eofile);
+         if (error < 0) {
+            return error;
+         }
+         /* The session now belongs to the push code, or the
+          * continuation it left runs from wi_servesess().
+          */
          return 0;
+      } else if (emf->em_flags & EMF_SSE) { /* server-sent event stream */
+         sess->ws_flags &= ~WF_PERSIST;
+         sess->ws_state = WI_PUSHING;
+         wi_socktune(sess, WI_TUNE_PUSH, 0);
+         return wi_ssestart(sess, (wi_sse *)emf->em_routine);
+      } else if (emf->em_flags & EMF_WSOCK) { /* WebSocket endpoint */
+         return wi_wsaccept(sess, (wi_wsfunc)emf->em_routine);
+      }
+   }
+
+   /* Embedded data with no SSIs in it is sent straight from em_data,
+    * by reference in a txbuf, rather than copied through wf_data and
+    * the txbuf data. This works for SSI includes too.
+    */
+   if (fi->wf_routines == &emfs) {
+      EOFILE *    eofile = (EOFILE *)fi->wf_fd;
+      em_file *   emf = eofile->eo_emfile;
+
+      if ((emf->em_data != NULL) &&
+          ((emf->em_flags & (EMF_SSI|EMF_FORM|EMF_PUSH|EMF_SSE|EMF_WSOCK|EMF_CEXP)) == 0) &&
+          ((emf->em_flags & EMF_DATA) || (sess->ws_flags & WF_BINARY))) {
+         error = wi_sendext(sess,
+                  (const char *)emf->em_data + eofile->eo_position,
+                  emf->em_size - (int)eofile->eo_position);
+         if (error) {
+            return error;
+         }
+         wi_fclose(fi);
+
+         if (sess->ws_filelist) {
+            return 0;      /* was an SSI, go back to the outer file */
+         }
+         sess->ws_flags &= ~WF_BINARY;    /* reply is in the txbufs now */
+         goto readdone;
       }
    }
 
 
 readmore:
-   toread = sizeof(fi->wf_data) - fi->wf_inbuf;
-   len = wi_fread( &fi->wf_data[fi->wf_inbuf], 1, toread, fi );
+   /* If an SSI broke off the copy below, finish the data left in the
+    * read buffer before reading more.
+    */
+   if (fi->wf_nextbuf < fi->wf_inbuf) {
+      goto copydata;
+   }
+   fi->wf_nextbuf = 0;
+   fi->wf_inbuf = 0;
+   len = wi_fread( fi->wf_data, 1, sizeof(fi->wf_data), fi );
 
    if (len <= 0) {
       wi_fclose(fi);
@@ -709,6 +2369,7 @@ readmore:
 	   goto readdone;
    }
 
+copydata:
    /* Copy the file into a send buffer while searching for SSI strings */
    for (len = fi->wf_nextbuf; len < fi->wf_inbuf; len++) {
       if ((fi->wf_data[len + 4] == '#') && (fi->wf_data[len + 1] == '!')) {
@@ -733,19 +2394,23 @@ readmore:
             /* Save location where SSI ends */
             len += ssi_len;
 
-            /* break if SSI changed the current file. */
-            if (sess->ws_filelist != fi) {
+            /* break if SSI changed the current file or left a
+             * generator to run.
+             */
+            if ((sess->ws_filelist != fi) || sess->ws_generator) {
                fi->wf_nextbuf = len;
                return 0;
             }
-            fi->wf_nextbuf = 0;  /* force jump to readmore */
+            fi->wf_nextbuf = 0;
          } else { /* end not found - SSI text may end in next block */
             dtrap();
          }
       }
 
-      /* Make sure we have space for char in txbuf */
-      if ((sess->ws_txbufs == NULL) || (sess->ws_txtail->tb_total >= WI_TXBUFSIZE)) {
+      /* Make sure we have space for char in txbuf of this reply */
+      if ((sess->ws_txtail == NULL) || (sess->ws_txtail == sess->ws_txmark) ||
+          (sess->ws_txtail->tb_ext) ||
+          (sess->ws_txtail->tb_total >= WI_TXBUFSIZE)) {
          if (wi_txalloc(sess) == NULL) {
         	 return WI_E_MEMORY;
          }
@@ -753,13 +2418,26 @@ readmore:
       sess->ws_txtail->tb_data[sess->ws_txtail->tb_total++] = fi->wf_data[len];
    }
 
-   /* See if we need to do more reading */
-   if ((fi->wf_nextbuf == 0) && (len > 0)) {
+   /* Read buffer is used up, see if we need to do more reading */
+   if (len > 0) {
+      fi->wf_nextbuf = 0;
       fi->wf_inbuf = 0;    /* no unread data in read buffer */
+
+      /* Start sending a big page before it is all built */
+      error = wi_streamchunk(sess);
+      if (error) {
+         return (error < 0) ? error : 0;  /* 1 is wait for socket */
+      }
       goto readmore;
    }
 
 readdone:
+   if (sess->ws_flags & WF_CHUNKED) {
+      error = wi_chunk(sess, TRUE);    /* the rest, and end of reply */
+      if (error) {
+         return error;
+      }
+   }
 
    /* Done with loading data, begin send process */
    sess->ws_state = WI_SENDDATA;
@@ -779,9 +2457,12 @@ readdone:
 int wi_sockwrite(wi_sess * sess) {
    txbuf *  txbuf;
    int      error;
-   int      tosend;
    int      contentlen = 0;
 
+#ifdef WI_USE_URING
+   return wu_sockwrite(sess);
+#endif
+
    if (sess->ws_flags & WF_BINARY) {
       error = wi_movebinary(sess, sess->ws_filelist);
       return error;
@@ -789,40 +2470,252 @@ int wi_sockwrite(wi_sess * sess) {
 
    if ((sess->ws_flags & WF_HEADERSENT) == 0) { /* header sent yet? */
       /* Build and prepend OK header - first calculate length. */
-      for (txbuf = sess->ws_txbufs; txbuf; txbuf = txbuf->tb_next)
+      txbuf = sess->ws_txmark ? sess->ws_txmark->tb_next : sess->ws_txbufs;
+      for ( ; txbuf; txbuf = txbuf->tb_next)
          contentlen += txbuf->tb_total;
 
-      error = wi_replyhdr(sess, contentlen);
+      error = wi_queuehdr(sess, contentlen);
       if (error) {
-    	  return WI_E_SOCKET;
+    	  return error;
+      }
+
+      /* Reply is complete, hold it if another request is waiting */
+      if (wi_pipehold(sess)) {
+         return 0;
+      }
+   }
+
+   error = wi_txflush(sess);
+   if (error || sess->ws_txbufs) {
+      return error;
+   }
+
+   /* fall to here when all txbufs are sent. */
+   error = wi_txdone(sess);
+
+   return error;
+}
+
+#ifdef WI_USE_ZEROCOPY
+
+/* wi_zcsplit()
+ *
+ * Look through the buffers of a gather write, as filled in by
+ * wi_txiov(), for one to send with MSG_ZEROCOPY. Only by-reference
+ * txbufs qualify, since the kernel reads the data after sendmsg()
+ * returns and other txbufs are freed as soon as they are sent. That
+ * leaves out broadcast frames too: the txbuf's hold on the frame goes
+ * when it is sent, and the last subscriber to send frees it. The
+ * first time one is found, SO_ZEROCOPY is turned on for the socket.
+ * Connections from this host are left alone: the kernel copies
+ * loopback sends anyway, and zero copy buffers on loopback can shrink
+ * a small receive window to a crawl.
+ *
+ * Returns: iov index of the buffer, or -1 if there is none.
+ */
+
+static WI_TLS int wi_zcnone = FALSE;  /* SO_ZEROCOPY failed, don't try again */
+
+static int wi_zcsplit(wi_sess * sess, int iovs) {
+   txbuf *  tb;
+   int      i = 0;
+   int      one = 1;
+
+   if ((wi_zcthresh <= 0) || wi_zcnone || (sess->ws_flags & WF_ZCCOPIED)) {
+      return -1;
+   }
+   for (tb = sess->ws_txbufs; tb && (i < iovs); tb = tb->tb_next) {
+      if (tb->tb_total <= tb->tb_done) {
+         continue;      /* wi_txiov() skipped it */
+      }
+      if (tb->tb_ext && (tb->tb_frame == NULL) &&
+          ((tb->tb_total - tb->tb_done) >= wi_zcthresh)) {
+         break;
+      }
+      i++;
+   }
+   if ((tb == NULL) || (i >= iovs)) {
+      return -1;
+   }
+
+   if ((sess->ws_flags & WF_ZEROCOPY) == 0) {
+      struct sockaddr_in peer;
+      socklen_t   sasize = sizeof(peer);
+
+      memset(&peer, 0, sizeof(peer));
+      if ((getpeername(sess->ws_socket, (struct sockaddr *)&peer, &sasize) < 0) ||
+          (peer.sin_family != AF_INET) ||
+          wi_islocal(sess->ws_socket, &peer)) {
+         sess->ws_flags |= WF_ZCCOPIED;
+         return -1;
+      }
+      if (setsockopt(sess->ws_socket, SOL_SOCKET, SO_ZEROCOPY,
+                     &one, sizeof(one)) < 0) {
+         dprintf("SO_ZEROCOPY not supported, %s\n", strerror(errno));
+         wi_zcnone = TRUE;
+         return -1;
+      }
+      sess->ws_flags |= WF_ZEROCOPY;
+   }
+   return i;
+}
+
+/* wi_zcdrain()
+ *
+ * Read the completions of a session's MSG_ZEROCOPY sends from the
+ * socket error queue. A pending completion makes the socket show as
+ * readable (EPOLLERR to epoll), so the poll loop calls this when it
+ * runs the session. The data is never freed, so the completions only
+ * have to be taken off the queue to keep it from filling up.
+ */
+
+void wi_zcdrain(wi_sess * sess) {
+   char     control[128];
+   struct msghdr  msg;
+   struct cmsghdr * cm;
+   struct sock_extended_err * ee;
+
+   while (sess->ws_zcpending > 0) {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      if (recvmsg(sess->ws_socket, &msg, MSG_ERRQUEUE) < 0) {
+         break;      /* EWOULDBLOCK, no more completions yet */
+      }
+      for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+         if (!((cm->cmsg_level == SOL_IP) && (cm->cmsg_type == IP_RECVERR)) &&
+             !((cm->cmsg_level == SOL_IPV6) && (cm->cmsg_type == IPV6_RECVERR))) {
+            continue;
+         }
+         ee = (struct sock_extended_err *)CMSG_DATA(cm);
+         if ((ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY) && (ee->ee_errno == 0)) {
+            /* ee_info to ee_data is the range of sends completed */
+            sess->ws_zcpending -= (int)(ee->ee_data - ee->ee_info + 1);
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+               /* e.g. loopback, zero copy only costs us here */
+               sess->ws_flags |= WF_ZCCOPIED;
+            }
+         }
+      }
+   }
+}
+#endif   /* WI_USE_ZEROCOPY */
+
+/* wi_txflush()
+ *
+ * Send as much of the session's txbuf chain as the socket will take.
+ * On Linux the header and data buffers go out in gather writes of up
+ * to WI_MAXIOV buffers, so a page built in many txbufs costs a few
+ * system calls rather than one per buffer. MSG_MORE is set while more
+ * of the chain follows so the stack can pack it into full segments.
+ * With WI_USE_ZEROCOPY, a large by-reference buffer is sent by itself
+ * with MSG_ZEROCOPY; the buffers in front of it go in the write before.
+ * When the socket takes only part of a write, the txbufs record how
+ * far it got and the next call carries on from there.
+ *
+ * Returns: 0 if no error, else negative WI_E_ error code. Data which
+ * did not fit is left in ws_txbufs.
+ */
+
+int wi_txflush(wi_sess * sess) {
+#ifdef LINUX
+   struct iovec   iov[WI_MAXIOV];
+   struct msghdr  msg;
+   int      iovs;
+   int      flags;
+   int      tosend;
+   int      sent;
+   int      i;
+
+   while (sess->ws_txbufs) {
+      iovs = wi_txiov(sess, iov, WI_MAXIOV);
+      if (iovs == 0) {
+         break;      /* only empty buffers left */
+      }
+      flags = MSG_NOSIGNAL | ((iovs == WI_MAXIOV) ? MSG_MORE : 0);
+#ifdef WI_USE_ZEROCOPY
+      i = wi_zcsplit(sess, iovs);
+      if (i == 0) {
+         iovs = 1;      /* send the big one by itself */
+         flags = MSG_NOSIGNAL | MSG_ZEROCOPY;
+      } else if (i > 0) {
+         iovs = i;      /* send what is in front of it first */
+         flags = MSG_NOSIGNAL | MSG_MORE;
+      }
+#endif   /* WI_USE_ZEROCOPY */
+      tosend = 0;
+      for (i = 0; i < iovs; i++) {
+         tosend += (int)iov[i].iov_len;
+      }
+
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovs;
+      sent = sendmsg(sess->ws_socket, &msg, flags);
+#ifdef WI_USE_ZEROCOPY
+      if (flags & MSG_ZEROCOPY) {
+         if ((sent < 0) && (errno == ENOBUFS)) {
+            /* no room to track another completion, copy this one */
+            wi_zcdrain(sess);
+            sent = sendmsg(sess->ws_socket, &msg, MSG_NOSIGNAL);
+         } else if (sent >= 0) {
+            sess->ws_zcpending++;
+         }
+      }
+#endif   /* WI_USE_ZEROCOPY */
+      if (sent < 0) {
+         if (errno == EWOULDBLOCK) {
+            wi_txblocked(sess, 0);
+            return 0;
+         }
+         return wi_sockerr(sess, errno);
+      }
+      wi_txsent(sess, sent);
+      sess->ws_last = wi_cticks;
+      if (sent < tosend) {
+         wi_txblocked(sess, sent);
+         return 0;      /* socket is full, send the rest later */
       }
    }
 
+   /* Drop any empty buffers left at the end of the chain */
+   while (sess->ws_txbufs) {
+      wi_txfree(sess->ws_txbufs);
+   }
+   return 0;
+#else    /* no gather writes, send a buffer at a time */
+   txbuf *  txbuf;
+   int      tosend;
+   int      sent;
+
    while (sess->ws_txbufs) {
       txbuf = sess->ws_txbufs;
       tosend = txbuf->tb_total - txbuf->tb_done;
-      error = send(sess->ws_socket, &txbuf->tb_data[txbuf->tb_done], tosend, 0);
-      if (error != tosend) {
-         error = errno;
-         if (error == EWOULDBLOCK) {
-            txbuf->tb_done = 0;
+      if (tosend > 0) {
+         sent = send(sess->ws_socket, TB_DATA(txbuf) + txbuf->tb_done, tosend,
+                     txbuf->tb_next ? MSG_MORE : 0);
+         if (sent < 0) {
+            if (errno == EWOULDBLOCK) {
+               wi_txblocked(sess, 0);
+               return 0;
+            }
+            return wi_sockerr(sess, errno);
+         }
+         sess->ws_last = wi_cticks;
+         if (sent < tosend) {
+            /* Keep our place in the txbuf, send the rest later */
+            txbuf->tb_done += sent;
+            wi_txblocked(sess, sent);
             return 0;
          }
-         dprintf("Socket write error %s\n", strerror(errno));
-         dtrap(); 
-         return WI_E_SOCKET;
       }
       /* Fall to here if we sent the whole txbuf. Unlink & free it */
       sess->ws_txbufs = txbuf->tb_next;
       txbuf->tb_next = NULL;
       wi_txfree(txbuf);
-      sess->ws_last = wi_cticks;
    }
-
-   /* fall to here when all txbufs are sent. */
-   error = wi_txdone(sess);
-
-   return error;
+   return 0;
+#endif   /* LINUX */
 }
 
 /* wi_redirect()
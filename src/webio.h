@@ -27,9 +27,77 @@
 
 struct wi_sess_s;    /* predecl */
 
-/* Port number on which to listen. May be changed prior to calling wi_init */
+/* Port number on which to listen. May be changed prior to calling 
+ * wi_init, 0 for no TCP listener (e.g. with only wi_addunix() ones)
+ */
 extern   int   httpport;
 
+#ifdef WI_USE_REACTORS
+/* Number of reactor threads. May be changed prior to calling wi_init */
+extern   int   wi_reactors;
+#endif
+
+/* Inherited listen socket, -1 for none, see wi_init() */
+extern   int   wi_listenfd;
+
+/* Graceful shutdown, see wi_shutdown() */
+extern   volatile sig_atomic_t wi_draining;   /* wi_shutdown() was called */
+extern   volatile sig_atomic_t wi_draintmo;   /* seconds to let replies finish */
+
+/* Listen socket options. May be changed prior to calling wi_init */
+extern   int   wi_backlog;          /* listen() queue length */
+extern   int   wi_deferaccept;      /* seconds for TCP_DEFER_ACCEPT, 0 = off */
+
+/* Connection TCP options, see wi_socktune() */
+extern   int   wi_nodelay;          /* TCP_NODELAY on connections */
+extern   int   wi_sndbufmax;        /* largest file to size SO_SNDBUF for, 0 = off */
+extern   int   wi_pushlowat;        /* TCP_NOTSENT_LOWAT for push, 0 = off */
+
+/* Most requests to answer on one persistent connection, 0 = no limit */
+extern   int   wi_maxrequests;
+
+/* Limits on replies to pipelined requests held back to be sent together */
+extern   int   wi_pipemax;          /* replies in one batch */
+extern   int   wi_pipebytes;        /* bytes held before the batch is sent */
+
+/* Text replies to HTTP/1.1 requests are sent with chunked encoding once
+ * this many bytes are queued, and reading waits while this many are
+ * unsent. 0 = always build the whole reply and send Content-Length.
+ */
+extern   int   wi_chunkmark;
+
+#ifdef WI_USE_ZEROCOPY
+/* Send by-reference txbufs of at least this many bytes with
+ * MSG_ZEROCOPY, 0 = never
+ */
+extern   int   wi_zcthresh;
+#endif
+
+/* Admission control, see wi_admit(). New connections past these limits
+ * are sent a canned 503 reply and closed. Each is per reactor, 0 = off.
+ */
+extern   int   wi_maxsess;          /* live sessions */
+extern   long  wi_maxtxbytes;       /* txbuf memory queued for sending */
+extern   int   wi_shedtarget;       /* msecs poll pass may take ... */
+extern   int   wi_shedinterval;     /* ... for this many msecs before shedding */
+extern   int   wi_retryafter;       /* seconds for the 503's Retry-After */
+
+/* Session timeouts in seconds, see webtimer.c */
+extern   int   wi_hdrtmo;           /* receive a complete request header */
+extern   int   wi_idletmo;          /* no progress reading POST or making reply */
+extern   int   wi_sendtmo;          /* no progress sending reply */
+extern   int   wi_persisttmo;       /* idle persistent connection */
+extern   int   wi_pingtmo;          /* idle WebSocket is pinged, and must answer */
+
+/* Slow request headers. After wi_hdrgrace seconds a header must keep
+ * arriving at wi_hdrminrate bytes a second (0 = no rule), and no client
+ * may have more than wi_maxhalfopen connections which have not sent a
+ * whole header yet (0 = no limit).
+ */
+extern   int   wi_hdrgrace;
+extern   int   wi_hdrminrate;
+extern   int   wi_maxhalfopen;
+
 typedef enum httpcmd {
    H_INITIAL = 0,
    H_GET = 0x47455420,
@@ -45,9 +113,14 @@ typedef struct txbuf_s {
    struct   wi_sess_s * tb_session;    /* backpointer to session */
    int      tb_total;                  /* Size of data in tb_data */
    int      tb_done;                   /* amount of tb_data already sent */
+   const char * tb_ext;                /* if set, data is here, not in tb_data */
+   struct wi_frame_s * tb_frame;       /* broadcast frame tb_ext is in, if any */
    char     tb_data[WI_TXBUFSIZE];     /* Data buffer for this segment */
 } txbuf;
 
+/* Start of a txbuf's data */
+#define  TB_DATA(tb)    ((tb)->tb_ext ? (tb)->tb_ext : (tb)->tb_data)
+
 
 /* A list of filectl objects is keptfor every session that is reading 
  * any kinf of file, The "Active" file (the one currently being read) 
@@ -59,8 +132,36 @@ typedef struct txbuf_s {
 
 struct wi_file_s;    /* predecl */
 
+#ifndef WI_MAXIOV
+#define WI_MAXIOV    16    /* txbufs per gather write */
+#endif
+
+#ifndef WI_MAXSESS
+#define WI_MAXSESS      1024           /* default wi_maxsess */
+#endif
+
+#ifndef WI_MAXTXBYTES
+#define WI_MAXTXBYTES   (32L * 1024 * 1024)  /* default wi_maxtxbytes */
+#endif
+
+#ifndef WI_ZCTHRESH
+#define WI_ZCTHRESH     (128 * 1024)  /* default wi_zcthresh */
+#endif
+
+#ifndef WI_SENDFILEMAX
+#define WI_SENDFILEMAX  (64 * 1024)   /* bytes per sendfile(), so other sessions get a turn */
+#endif
+
 typedef long   wi_sec;     /* A number of seconds, for timeouts */
 
+/* Session timer, kept in a timer wheel by webtimer.c */
+typedef struct wi_timer_s {
+   struct wi_timer_s * tm_next;     /* slot list links, NULL if not set */
+   struct wi_timer_s * tm_prev;
+   struct wi_sess_s *  tm_sess;     /* session which owns the timer */
+   u_long   tm_expires;             /* wi_cticks value at which it goes off */
+} wi_timer;
+
 /* States of a sesison */
 typedef enum wistates { 
    WI_HEADER,        /* Getting HTTP header form socket */
@@ -68,6 +169,8 @@ typedef enum wistates {
    WI_CONTENT,       /* reading file from disk or script */
    WI_SENDDATA,      /* Sending file/data into socket */
    WI_PUSHING,       /* session is owned by a server push routine */
+   WI_WEBSOCKET,     /* session was upgraded to a WebSocket */
+   WI_PARKED,        /* form handler is waiting for wi_wake() */
    WI_ENDING         /* Sessions done,cleaning up for deletion */
 } wistate;
 
@@ -77,19 +180,64 @@ typedef struct wi_sess_s {
    socktype ws_socket;
    wistate  ws_state;
 
-   char     ws_rxbuf[WI_RXBUFSIZE]; /* input from browser */
+   char *   ws_rxbuf;               /* input from browser, WI_RXBUFSIZE */
    int      ws_rxsize;              /* size of valid data in rxbuf */
    int      ws_contentLength;       /* size of current sess data */
    char *   ws_data;                /* start of contetnt */
+   int      ws_reqlen;              /* rxbuf bytes used by current request */
+   int      ws_hdrscan;             /* rxbuf offset to look for header end from */
+   char     ws_rxhold;              /* rxbuf byte replaced by end of POST data */
+   int      ws_requests;            /* requests answered on this connection */
 
    txbuf *  ws_txbufs;              /* list of output buffers ready to send */
    txbuf *  ws_txtail;              /* last entry in ws_txbufs list */
+   txbuf *  ws_txmark;              /* last txbuf of replies held for pipelining */
+   int      ws_pipelined;           /* replies held in ws_txbufs */
 
    const char * ws_uri;             /* URI from request (often inside rxbuf) */
    const char * ws_referer;         /* Referrer Information */
    const char * ws_auth;
    const char * ws_host;
 
+   /* Body generator, see wi_setgenerator() */
+   int       (*ws_generator)(struct wi_sess_s *, void * ctx);
+   void *   ws_genctx;
+
+   /* Push continuation, see wi_pushstart() */
+   int       (*ws_pushfunc)(struct wi_sess_s *, void * ctx, int event);
+   void *   ws_pushctx;
+   u_long   ws_pushid;              /* handle for wi_pushwake() */
+   u_long   ws_pushdue;             /* wi_cticks of push timer, 0 if none */
+   int      ws_pushmode;            /* last WI_PUSH_ return of ws_pushfunc */
+   int      ws_pushevents;          /* events waiting to be delivered */
+   struct wi_sess_s * ws_pushnext;  /* push session hash chain */
+   struct wi_sess_s * ws_pushrun;   /* list of push sessions to run */
+
+   /* Broadcast subscription, see wi_subscribe() */
+   struct wi_chan_s * ws_chan;      /* channel subscribed to, if any */
+   struct wi_sess_s * ws_subnext;   /* channel's subscriber list */
+   int      ws_castq;               /* frames queued in ws_txbufs */
+   u_long   ws_castid;              /* id of the last frame it was given */
+   u_long   ws_castdue;             /* wi_cticks held frames go, see wi_chanhold() */
+   struct wi_frame_s * ws_castpend; /* latest frame held back, see WI_CAST_COALESCE */
+   u_long   ws_lastevent;           /* request's Last-Event-ID, 0 if none */
+
+   /* WebSocket connection, see wi_wsaccept() */
+   int       (*ws_wsfunc)(struct wi_sess_s *, int event, char * msg, int len);
+   void *   ws_wsctx;               /* the handler's own, free it on WI_WS_CLOSE */
+   int      ws_wsmsg;               /* message bytes gathered at the front of rxbuf */
+   int      ws_wsop;                /* opcode of the message being gathered, 0 if none */
+   int      ws_wsflags;             /* WSK_ bits, see websock.c */
+   u_long   ws_wsping;              /* wi_cticks of next ping, or answer due; 0 if none */
+   const char * ws_wskey;           /* request's Sec-WebSocket-Key, if it asks to upgrade */
+   int      ws_wsver;               /* its Sec-WebSocket-Version, 0 if bad, -1 if no upgrade */
+
+   /* Long poll, see wi_park() */
+   u_long   ws_parkkey;             /* key it is parked on, 0 if none */
+   u_long   ws_parkdue;             /* wi_cticks of its deadline */
+   int      ws_parkevent;           /* why the form handler is run again, WI_PARK_ */
+   struct wi_sess_s * ws_parknext;  /* parked session hash chain */
+
    struct wi_form_s * ws_formlist;  /* attached forms (once parsed) */
    struct wi_file_s * ws_filelist;  /* local files associated with session */
 
@@ -97,6 +245,19 @@ typedef struct wi_sess_s {
    int          ws_flags;
    const char * ws_ftype;           /* Mime type (best guess) */
    wi_sec       ws_last;            /* timetick of last activity */
+   wi_sec       ws_reqstart;        /* timetick current request began */
+   wi_timer     ws_timer;           /* deadline for the current state */
+   int          ws_events;          /* socket events poll backend waits for */
+   long         ws_fileoff;         /* offset of next binary file read */
+   u_long       ws_peeraddr;        /* client's IPv4 address, if known */
+#ifdef WI_USE_ZEROCOPY
+   int          ws_zcpending;       /* zero copy sends not yet completed */
+#endif
+#ifdef WI_USE_URING
+   int          ws_ioinflight;      /* io_uring requests not yet completed */
+   struct msghdr ws_msg;            /* io_uring send of txbuf chain */
+   struct iovec ws_iov[WI_MAXIOV];
+#endif
 } wi_sess;   
 
 
@@ -115,7 +276,33 @@ typedef struct wi_form_s {
 #endif
 } wi_form;
 
-extern   wi_sess * wi_sessions;
+extern   WI_TLS wi_sess * wi_sessions;
+
+/* Heap statistics, kept per reactor thread */
+extern   WI_TLS u_long  wi_blocks;
+extern   WI_TLS u_long  wi_bytes;
+extern   WI_TLS u_long  wi_maxbytes;
+extern   WI_TLS u_long  wi_totalblocks;
+
+/* Socket write statistics, kept per reactor thread. A lot of these
+ * means clients or the network can't keep up.
+ */
+extern   WI_TLS u_long  wi_shortwrites;   /* socket took part of a write */
+extern   WI_TLS u_long  wi_wouldblocks;   /* socket took none of a write */
+
+/* Session error statistics, kept per reactor thread. Each of these
+ * ends just the one session.
+ */
+extern   WI_TLS u_long  wi_peereofs;      /* peer closed in mid request */
+extern   WI_TLS u_long  wi_peerresets;    /* peer reset the connection */
+extern   WI_TLS u_long  wi_sockerrors;    /* other socket errors */
+extern   WI_TLS u_long  wi_timeouts;      /* sessions timed out */
+
+/* Load statistics, kept per reactor thread, see wi_admit() */
+extern   WI_TLS int     wi_nsess;         /* live sessions */
+extern   WI_TLS int     wi_ntxbufs;       /* txbufs allocated */
+extern   WI_TLS int     wi_overloaded;    /* poll passes are running late */
+extern   WI_TLS u_long  wi_shedconns;     /* connections turned away */
 
 #define WF_READINGCMDS     0x0001      /* Still reading socket for commands from browser */
 #define WF_SSL             0x0004      /* Socket is SSL socket */
@@ -123,6 +310,28 @@ extern   wi_sess * wi_sessions;
 #define WF_BINARY          0x0010      /* current file is binary (no SSIs) */
 #define WF_PERSIST         0x0020      /* connection is persistent */
 #define WF_SVRPUSH         0x0040      /* current file is custom server push */
+#define WF_TXBUSY          0x0080      /* io_uring send or file read in progress */
+#define WF_ZEROCOPY        0x0100      /* SO_ZEROCOPY is set on socket */
+#define WF_ZCCOPIED        0x0200      /* zero copy is no use on socket, copy */
+#define WF_CORKED          0x0400      /* TCP_CORK is set on socket */
+#define WF_TXBLOCKED       0x0800      /* socket is full, wait until writable */
+#define WF_HTTP11          0x1000      /* request is HTTP/1.1 or later */
+#define WF_CHUNKED         0x2000      /* reply uses chunked encoding */
+#define WF_HALFOPEN        0x4000      /* first request header not in yet */
+#define WF_UNIX            0x8000      /* connection came in on a unix domain socket */
+#define WF_ERRREPLY        0x10000     /* error reply queued, close once sent */
+
+/* Poll interest bits for a session's socket. These map onto the
+ * select() fd_sets or onto EPOLLIN/EPOLLOUT, depending on the build.
+ */
+#define WI_EVREAD          0x01
+#define WI_EVWRITE         0x02
+
+/* wi_socktune() profiles */
+#define WI_TUNE_ACCEPT     1     /* new connection */
+#define WI_TUNE_BINARY     2     /* start of a file reply */
+#define WI_TUNE_DONE       3     /* reply finished */
+#define WI_TUNE_PUSH       4     /* session handed to server push */
 
 
 #ifndef FALSE
@@ -169,12 +378,13 @@ extern   wi_sess * wi_sessions;
 
 
 #define HDRBUFSIZE   1000
-extern char hdrbuf[HDRBUFSIZE];   /* For building HTTP headers */
+extern WI_TLS char hdrbuf[HDRBUFSIZE];   /* For building HTTP headers */
 
 extern   char * wi_servername;
 
 extern   int         wi_init(void);
 extern   int         wi_poll(void);
+extern   void        wi_shutdown(int secs);
 
 #ifdef WI_USE_MALLOC
 extern   char *      wi_alloc(int bufsize);
@@ -182,27 +392,153 @@ extern   void        wi_free(void *);
 #endif
 
 extern   txbuf *     wi_txalloc( wi_sess *);
+extern   txbuf *     wi_txpush( wi_sess *);
 extern   void        wi_txfree( txbuf *);
+extern   void        wi_txsent( wi_sess *, int sent);
+extern   void        wi_txblocked( wi_sess *, int sent);
+extern   int         wi_sockerr( wi_sess *, int error);
+extern   int         wi_txqueued( wi_sess *);
+#ifdef LINUX
+extern   int         wi_txiov( wi_sess *, struct iovec * iov, int maxiov);
+#endif
 
 extern   wi_sess *   wi_newsess(void);
 extern   void        wi_delsess( wi_sess *);
+extern   void        wi_resetsess( wi_sess *);
+
+extern   char *      wi_rxalloc( wi_sess *);
+extern   void        wi_rxfree( wi_sess *);
 
 extern   void        wi_printf(wi_sess * sess, char * fmt, ...);
+extern   int         wi_sendext(wi_sess * sess, const char * data, int len);
+
+typedef  int (*wi_genfunc)(wi_sess * sess, void * ctx);
+extern   int         wi_setgenerator(wi_sess * sess, wi_genfunc gen, void * ctx);
+extern   void        wi_genstart(wi_sess * sess);
+extern   int         wi_genpark(wi_sess * sess);
+extern   void        wi_genstop(wi_sess * sess);
+
+/* Push continuations, see wi_pushstart(). ws_pushfunc is called with
+ * one of the events and returns one of the modes, or a negative WI_E_
+ * code to drop the connection.
+ */
+#define  WI_PUSH_WRITE  1     /* event: the socket can take more output */
+#define  WI_PUSH_WAKE   2     /* event: wi_pushwake() was called */
+#define  WI_PUSH_TIMER  3     /* event: timer from wi_pushtimer() is up */
+#define  WI_PUSH_END    4     /* event: session is ending, free ctx */
+
+#define  WI_PUSH_DONE   0     /* mode: end of the reply */
+#define  WI_PUSH_MORE   1     /* mode: call again when the socket has room */
+#define  WI_PUSH_WAIT   2     /* mode: call again on a wakeup or the timer */
+
+typedef  int (*wi_pushfunc)(wi_sess * sess, void * ctx, int event);
+extern   int         wi_pushstart(wi_sess * sess, wi_pushfunc func, void * ctx);
+extern   int         wi_pushwake(u_long pushid);
+extern   void        wi_pushtimer(wi_sess * sess, long msecs);
+extern   int         wi_pushinit(void);
+extern   void        wi_pushcleanup(void);
+extern   void        wi_pushcheck(void);
+extern   wi_sess *   wi_pushnext(void);
+extern   int         wi_pushserve(wi_sess * sess, int ready);
+extern   int         wi_pushexpire(wi_sess * sess);
+extern   void        wi_pushstop(wi_sess * sess);
+extern   void        wi_pushend(wi_sess * sess);
+extern   void        wi_pushqueue(wi_sess * sess);
+
+/* Long polls, see wi_park(). A form handler which is run again finds
+ * the reason in ws_parkevent.
+ */
+#define  WI_PARK_WAKE      1  /* wi_wake() was called with its key */
+#define  WI_PARK_TIMEOUT   2  /* its deadline came, or the server is shutting down */
+
+extern   int         wi_park(wi_sess * sess, u_long key, long msecs);
+extern   int         wi_wake(u_long key);
+extern   void        wi_parkexpire(wi_sess * sess);
+extern   WI_TLS int  wi_wakefd;       /* descriptor which wakes the reactor, -1 if none */
+
+/* Broadcast channels, see wi_publish(). What a subscriber whose queue
+ * is past the channel's mark does with new frames:
+ */
+#define  WI_CAST_DROP      0  /* misses them */
+#define  WI_CAST_COALESCE  1  /* gets only the latest, once it catches up */
+#define  WI_CAST_CLOSE     2  /* has its reply ended, to come back for them */
+
+typedef  struct wi_chan_s wi_chan;
+extern   wi_chan *   wi_chancreate(int policy, int mark);
+extern   void        wi_chanfree(wi_chan * chan);
+extern   int         wi_chanreplay(wi_chan * chan, int frames);
+extern   void        wi_chanhold(wi_chan * chan, int msecs);
+extern   int         wi_subscribe(wi_sess * sess, wi_chan * chan);
+extern   int         wi_subscribefrom(wi_sess * sess, wi_chan * chan, u_long lastid);
+extern   void        wi_unsubscribe(wi_sess * sess);
+extern   int         wi_publish(wi_chan * chan, const char * data, int len);
+extern   int         wi_publishid(wi_chan * chan, u_long id, const char * data, int len);
+extern   void        wi_framefree(struct wi_frame_s * frame);
+extern   WI_TLS u_long  wi_castdrops;    /* frames not queued to slow subscribers */
+
+/* A server-sent event stream, an EMF_SSE file (fsbuilder's -v option).
+ * The settings may be left 0 for the defaults, -1 turns one off. See
+ * wi_ssesend().
+ */
+typedef struct wi_sse_s {
+   int      se_ring;          /* events kept for Last-Event-ID */
+   int      se_heartbeat;     /* seconds idle before a comment is sent */
+   int      se_hold;          /* msecs small events wait to go together */
+   int      se_retry;         /* msecs clients wait to reconnect, 0 = theirs */
+   wi_chan * se_chan;         /* made on first use */
+   u_long   se_lastid;        /* id of the last event */
+} wi_sse;
+
+extern   int         wi_ssestart(wi_sess * sess, wi_sse * stream);
+extern   int         wi_ssesend(wi_sse * stream, const char * event, const char * data);
+
+/* WebSocket handlers, EMF_WSOCK files (fsbuilder's -u option). The
+ * handler is called with one of these events, and returns 0 or a
+ * negative WI_E_ code to drop the connection. Its messages are sent
+ * with wi_wssend(), the type is WI_WS_TEXT or WI_WS_BINARY.
+ */
+#define  WI_WS_OPEN     1     /* event: the upgrade is done, msg is NULL */
+#define  WI_WS_TEXT     2     /* event: a text message came in */
+#define  WI_WS_BINARY   3     /* event: a binary message came in */
+#define  WI_WS_CLOSE    4     /* event: session is ending, free ctx. The return is ignored */
+
+typedef  int (*wi_wsfunc)(wi_sess * sess, int event, char * msg, int len);
+extern   int         wi_wsaccept(wi_sess * sess, wi_wsfunc func);
+extern   int         wi_wssend(wi_sess * sess, int type, const char * data, int len);
+extern   int         wi_wsclose(wi_sess * sess, int code);
+extern   int         wi_wsserve(wi_sess * sess, int ready);
+extern   int         wi_wsrecv(wi_sess * sess, const char * data, int len);
+extern   int         wi_wsexpire(wi_sess * sess);
+extern   void        wi_wsend(wi_sess * sess);
 extern   int         wi_readfile(struct wi_sess_s * sess);
 extern   int         wi_sockwrite(struct wi_sess_s * sess);
-extern   int         wi_sockaccept(void);
+extern   int         wi_txflush(wi_sess * sess);
+#ifdef WI_USE_ZEROCOPY
+extern   void        wi_zcdrain(wi_sess * sess);
+#endif
+extern   int         wi_sockaccept(socktype lsock);
+#ifdef LINUX
+extern   int         wi_addunix(const char * path);
+#endif
+extern   int         wi_socktune(wi_sess * sess, int profile, long size);
 extern   int         wi_parseheader( wi_sess * sess );
+extern   void        wi_hdrdone( wi_sess * sess );
 extern   int         wi_putfile( wi_sess * sess);
 extern   int         wi_senderr(wi_sess * sess, int htmlcode );
 extern   char *      wi_getline( char * linetype, char * httphdr );
+extern   int         wi_hastoken( char * linetype, char * token, char * httphdr );
 extern   char *      wi_nextarg( char * argbuf );
 extern   int         wi_argncpy(char * buf, char * arg, int size);
 extern   int         wi_buildform(wi_sess * sess, char * cp);
 extern   char *      wi_argterm( char * arg );
 extern   int         wi_setftype(wi_sess * sess);
 extern   char *      wi_getdate(wi_sess * sess);
+extern   int         wi_buildhdr(wi_sess * sess, int contentLen);
 extern   int         wi_replyhdr(wi_sess * sess, int contentLen);
 extern   int         wi_txdone(wi_sess * sess);
+extern   int         wi_queuehdr(wi_sess * sess, int contentLen);
+extern   int         wi_chunk(wi_sess * sess, int last);
+extern   int         wi_pipehold(wi_sess * sess);
 extern   int         wi_ssi(wi_sess * sess);
 extern   int         wi_exec(wi_sess * sess);
 extern   int         wi_putlong(wi_sess * sess, u_long value);
@@ -218,6 +554,12 @@ extern   int         wi_formbool(wi_sess * sess, char * name);
 
 extern   int         wi_step();
 
+extern   void        wi_timerset(wi_sess * sess, u_long expires);
+extern   void        wi_timerclear(wi_sess * sess);
+extern   void        wi_timerupdate(wi_sess * sess);
+extern   int         wi_timercheck(void);
+extern   long        wi_timerwait(long msecs);
+
 #ifdef WI_USE_THREADS
 /* Entry point for main (or only) thread in demo */
 extern   int         wi_thread(void);
@@ -38,12 +38,22 @@
  * checking.
  */
 
-wi_sess * wi_sessions;     /* Master list of sessions */
+WI_TLS wi_sess * wi_sessions;     /* Master list of sessions */
 
-u_long   wi_blocks = 0;
-u_long   wi_bytes = 0;
-u_long   wi_maxbytes = 0;
-u_long   wi_totalblocks = 0;
+WI_TLS u_long   wi_blocks = 0;
+WI_TLS u_long   wi_bytes = 0;
+WI_TLS u_long   wi_maxbytes = 0;
+WI_TLS u_long   wi_totalblocks = 0;
+
+WI_TLS u_long   wi_shortwrites = 0;
+WI_TLS u_long   wi_wouldblocks = 0;
+
+WI_TLS u_long   wi_peereofs = 0;
+WI_TLS u_long   wi_peerresets = 0;
+WI_TLS u_long   wi_sockerrors = 0;
+
+WI_TLS int      wi_nsess = 0;
+WI_TLS int      wi_ntxbufs = 0;
 
 
 /* Webio's heap system allocates a bit more memory from the system
@@ -119,8 +129,8 @@ void wi_free(void * buff) {
 /* txbuf constructor */
 
 #ifndef WI_USE_MALLOC
-static txbuf wi_txbuf_slot[MAX_TXBUF_SLOTS];
-static u_char wi_txbuf_slot_used[MAX_TXBUF_SLOTS];
+static WI_TLS txbuf wi_txbuf_slot[MAX_TXBUF_SLOTS];
+static WI_TLS u_char wi_txbuf_slot_used[MAX_TXBUF_SLOTS];
 
 txbuf * wi_get_txbuf_slot(void) {
 	int i;
@@ -161,6 +171,7 @@ txbuf * wi_txalloc(wi_sess * websess) {
    if (!newtx) {
 	   return NULL;
    }
+   wi_ntxbufs++;
 
    /* Install new TX buffer at end of session chain */
    if (websess->ws_txtail) {
@@ -179,6 +190,46 @@ txbuf * wi_txalloc(wi_sess * websess) {
    return newtx;
 }
 
+/* wi_txpush()
+ *
+ * Like wi_txalloc(), but puts the new buffer at the front of the
+ * current reply, e.g. for a header built after the data. This is the
+ * front of the session's chain unless replies to earlier pipelined
+ * requests are held in it.
+ *
+ * Returns: new txbuf, or NULL if out of memory.
+ */
+
+txbuf * wi_txpush(wi_sess * websess) {
+   txbuf * newtx;
+
+#ifdef WI_USE_MALLOC
+   newtx = (txbuf*)wi_alloc( sizeof(txbuf) );
+#else
+   newtx = wi_get_txbuf_slot();
+#endif
+
+   if (!newtx) {
+	   return NULL;
+   }
+   wi_ntxbufs++;
+
+   if (websess->ws_txmark) {
+      newtx->tb_next = websess->ws_txmark->tb_next;
+      websess->ws_txmark->tb_next = newtx;
+   } else {
+      newtx->tb_next = websess->ws_txbufs;
+      websess->ws_txbufs = newtx;
+   }
+   if (newtx->tb_next == NULL) {
+	   websess->ws_txtail = newtx;
+   }
+
+   newtx->tb_session = websess;     /* backpointer to session */
+
+   return newtx;
+}
+
 /* txbuf destructor */
 
 void wi_txfree(txbuf * oldtx) {
@@ -198,10 +249,31 @@ void wi_txfree(txbuf * oldtx) {
          } else {
         	 websess->ws_txbufs = oldtx->tb_next;
          }
+         if (websess->ws_txtail == oldtx) {
+            websess->ws_txtail = last;
+         }
          break;
       }
+      last = tmptx;
+   }
+
+   /* Buffers go in order, so the held replies have been sent once
+    * the last one goes.
+    */
+   if (websess->ws_txmark == oldtx) {
+      websess->ws_txmark = NULL;
+   }
+   if (websess->ws_txbufs == NULL) {
+      websess->ws_txtail = NULL;
+      websess->ws_txmark = NULL;
+      websess->ws_pipelined = 0;
+   }
+   if (oldtx->tb_frame) {     /* from wi_publish() */
+      websess->ws_castq--;
+      wi_framefree(oldtx->tb_frame);
    }
 
+   wi_ntxbufs--;
 #ifdef WI_USE_MALLOC
    wi_free(oldtx);
 #else
@@ -211,11 +283,121 @@ void wi_txfree(txbuf * oldtx) {
 }
 
 
+/* wi_txiov()
+ *
+ * Describe the unsent part of a session's txbuf chain (header and data,
+ * including any replies held for pipelining) in an iovec array, for a
+ * gather write.
+ *
+ * Returns: number of entries filled in, at most "maxiov".
+ */
+
+#ifdef LINUX
+int wi_txiov(wi_sess * sess, struct iovec * iov, int maxiov) {
+   txbuf *  tb;
+   int      iovs = 0;
+
+   for (tb = sess->ws_txbufs; tb && (iovs < maxiov); tb = tb->tb_next) {
+      if (tb->tb_total <= tb->tb_done) {
+         continue;
+      }
+      iov[iovs].iov_base = (void *)(TB_DATA(tb) + tb->tb_done);
+      iov[iovs].iov_len = tb->tb_total - tb->tb_done;
+      iovs++;
+   }
+   return iovs;
+}
+#endif   /* LINUX */
+
+/* wi_txsent()
+ *
+ * Account for "sent" bytes of a gather write from the front of the
+ * session's txbuf chain. The txbufs which were sent are freed; the
+ * progress in a partly sent one is kept in its tb_done.
+ */
+
+void wi_txsent(wi_sess * sess, int sent) {
+   txbuf *  tb;
+   int      left;
+
+   while ((sent > 0) && sess->ws_txbufs) {
+      tb = sess->ws_txbufs;
+      left = tb->tb_total - tb->tb_done;
+      if (sent < left) {
+         tb->tb_done += sent;
+         break;
+      }
+      sent -= left;
+      sess->ws_txbufs = tb->tb_next;
+      tb->tb_next = NULL;
+      wi_txfree(tb);
+   }
+}
+
+/* wi_txqueued()
+ *
+ * Returns: number of bytes in the session's txbufs not yet sent.
+ */
+
+int wi_txqueued(wi_sess * sess) {
+   txbuf *  tb;
+   int      queued = 0;
+
+   for (tb = sess->ws_txbufs; tb; tb = tb->tb_next) {
+      queued += tb->tb_total - tb->tb_done;
+   }
+   return queued;
+}
+
+/* wi_txblocked()
+ *
+ * Note that the socket took only "sent" bytes (maybe none) of a write.
+ * The session then waits for the socket to become writable rather
+ * than trying again on the next pass.
+ */
+
+void wi_txblocked(wi_sess * sess, int sent) {
+   if (sent > 0) {
+      wi_shortwrites++;
+   } else {
+      wi_wouldblocks++;
+   }
+   sess->ws_flags |= WF_TXBLOCKED;
+}
+
+/* wi_sockerr()
+ *
+ * Count a failed socket call on a session. "error" is the errno, or 0
+ * if the peer closed the connection in the middle of a request. This 
+ * only hurts the one session, the caller ends it.
+ *
+ * Returns: WI_E_SOCKET, for the caller to pass on.
+ */
+
+int wi_sockerr(wi_sess * sess, int error) {
+   switch (error) {
+   case 0:
+      wi_peereofs++;
+      break;
+   case ECONNRESET:
+   case ECONNABORTED:
+   case EPIPE:
+      wi_peerresets++;
+      break;
+   default:
+      wi_sockerrors++;
+      dprintf("session socket %ld error %d\n", (long)sess->ws_socket, error);
+      break;
+   }
+   return WI_E_SOCKET;
+}
+
+
 /* wi_sess constructor */
 
 #ifndef WI_USE_MALLOC
-static wi_sess wi_sess_slot[MAX_SESS_SLOTS];
-static u_char wi_sess_slot_used[MAX_SESS_SLOTS];
+static WI_TLS wi_sess wi_sess_slot[MAX_SESS_SLOTS];
+static WI_TLS u_char wi_sess_slot_used[MAX_SESS_SLOTS];
 
 wi_sess * wi_get_sess_slot(void) {
 	int i;
@@ -245,8 +427,8 @@ void wi_free_sess_slot(wi_sess * oldsess) {
 #endif
 
 #ifndef WI_USE_MALLOC
-static wi_form wi_form_slot[MAX_FORM_SLOTS];
-static u_char wi_form_slot_used[MAX_FORM_SLOTS];
+static WI_TLS wi_form wi_form_slot[MAX_FORM_SLOTS];
+static WI_TLS u_char wi_form_slot_used[MAX_FORM_SLOTS];
 
 wi_form * wi_get_form_slot(void) {
 	int i;
@@ -288,9 +470,11 @@ wi_sess * wi_newsess(void) {
       dprintf("wi_newsess: out of memory.\n");
       return NULL;
    }
+   wi_nsess++;
    newsess->ws_socket = INVALID_SOCKET;
    newsess->ws_state = WI_HEADER;
    newsess->ws_last = wi_cticks;
+   newsess->ws_reqstart = wi_cticks;
 
    /* Add new session to master list */
    newsess->ws_next = wi_sessions;
@@ -303,17 +487,62 @@ wi_sess * wi_newsess(void) {
 }
 
 
+/* wi_freeforms() - free the forms attached to a session */
+
+static void wi_freeforms(wi_sess * sess) {
+   /* Fix submitted by PB     09/11/2009 18.39.29 */
+   if (sess->ws_formlist) {
+       struct wi_form_s * nextform;
+       while (sess->ws_formlist) {
+           nextform = sess->ws_formlist->next;
+#ifdef WI_USE_MALLOC
+           wi_free(sess->ws_formlist);
+#else
+           wi_free_form_slot(sess->ws_formlist);
+#endif
+           if (nextform) {
+               dtrap(); // check double-form first time through...
+           }
+           sess->ws_formlist = nextform;
+       }
+   }  
+   /*     PB     09/11/2009 18.39.29 */
+}
+
 /* wi_sess destructor */
 
 void wi_delsess(wi_sess * oldsess) {
    wi_sess * tmpsess;
    wi_sess * lastsess;
 
+   wi_timerclear(oldsess);
+   wi_hdrdone(oldsess);
+
    if (oldsess->ws_socket != INVALID_SOCKET) {
       closesocket(oldsess->ws_socket);
-      oldsess->ws_socket = 0;
+      oldsess->ws_socket = INVALID_SOCKET;
    }
 
+#ifdef WI_USE_URING
+   /* Ring requests may still be using the session's buffers. Closing
+    * the socket (above) ends them; the poll loop calls us again when
+    * the last one has completed.
+    */
+   if (oldsess->ws_ioinflight) {
+      oldsess->ws_state = WI_ENDING;
+      return;
+   }
+#endif
+
+   /* Let an unfinished body generator free its context */
+   if (oldsess->ws_generator) {
+      oldsess->ws_state = WI_ENDING;
+      oldsess->ws_generator(oldsess, oldsess->ws_genctx);
+      oldsess->ws_generator = NULL;
+   }
+   wi_pushend(oldsess);    /* same for a push continuation */
+   wi_wsend(oldsess);      /* and a WebSocket handler */
+
    /* Unlink from master session list */
    lastsess = NULL;
    for (tmpsess = wi_sessions; tmpsess; tmpsess = tmpsess->ws_next) {
@@ -339,24 +568,12 @@ void wi_delsess(wi_sess * oldsess) {
          wi_fclose( oldsess->ws_filelist);
       }
    }
-   /* Fix submitted by PB     09/11/2009 18.39.29 */
-   if (oldsess->ws_formlist) {
-       struct wi_form_s * nextform;
-       while (oldsess->ws_formlist) {
-           nextform = oldsess->ws_formlist->next;
-#ifdef WI_USE_MALLOC
-           wi_free(oldsess->ws_formlist);
-#else
-           wi_free_form_slot(oldsess->ws_formlist);
-#endif
-           if (nextform) {
-               dtrap(); // check double-form first time through...
-           }
-           oldsess->ws_formlist = nextform;
-       }
-   }  
-   /*     PB     09/11/2009 18.39.29 */
+   if (oldsess->ws_rxbuf) {
+      wi_rxfree(oldsess);
+   }
+   wi_freeforms(oldsess);
 
+   wi_nsess--;
 #ifdef WI_USE_MALLOC
    wi_free(oldsess);
 #else
@@ -366,11 +583,130 @@ void wi_delsess(wi_sess * oldsess) {
    return;
 }
 
+/* wi_resetsess()
+ *
+ * Get a persistent connection's session ready for the next request,
+ * once the reply to the current one has been sent or queued. Everything
+ * left over from the request is freed, and any data in rxbuf past the
+ * end of the request (i.e. the start of the next one) is moved to the
+ * front. An empty rxbuf is freed while the connection is idle. Replies
+ * held by wi_pipehold() stay in the txbuf chain.
+ */
+
+void wi_resetsess(wi_sess * sess) {
+   int   used;
+
+   while (sess->ws_filelist) {
+      wi_fclose(sess->ws_filelist);
+   }
+   wi_freeforms(sess);
+
+   if (sess->ws_rxbuf) {
+      used = sess->ws_reqlen;
+      if ((used <= 0) || (used > sess->ws_rxsize)) {
+         used = sess->ws_rxsize;
+      }
+      if (used < sess->ws_rxsize) {
+         sess->ws_rxbuf[used] = sess->ws_rxhold;   /* undo end of POST data */
+         memmove(sess->ws_rxbuf, sess->ws_rxbuf + used, sess->ws_rxsize - used);
+         sess->ws_rxsize -= used;
+         sess->ws_rxbuf[sess->ws_rxsize] = 0;
+      } else {
+         wi_rxfree(sess);
+      }
+   }
+
+   sess->ws_data = NULL;
+   sess->ws_reqlen = 0;
+   sess->ws_hdrscan = 0;
+   sess->ws_rxhold = 0;
+   sess->ws_contentLength = 0;
+   sess->ws_uri = NULL;
+   sess->ws_referer = NULL;
+   sess->ws_auth = NULL;
+   sess->ws_host = NULL;
+   sess->ws_wskey = NULL;
+   sess->ws_parkevent = 0;
+   sess->ws_cmd = H_INITIAL;
+   sess->ws_ftype = NULL;
+   sess->ws_fileoff = 0;
+   sess->ws_flags &= ~(WF_HEADERSENT | WF_BINARY | WF_SVRPUSH | WF_TXBLOCKED |
+                       WF_HTTP11 | WF_CHUNKED);
+   sess->ws_flags |= WF_READINGCMDS;
+
+   sess->ws_requests++;
+   sess->ws_state = WI_HEADER;
+   sess->ws_last = wi_cticks;
+   sess->ws_reqstart = wi_cticks;
+}
+
+/* rx buffer constructor. The receive buffer is not part of wi_sess; 
+ * it is attached when data first arrives on the session's socket, so 
+ * connections which have not sent anything yet stay small.
+ */
+
+#ifndef WI_USE_MALLOC
+#ifndef MAX_RXBUF_SLOTS
+#define MAX_RXBUF_SLOTS MAX_SESS_SLOTS
+#endif
+static WI_TLS char wi_rxbuf_slot[MAX_RXBUF_SLOTS][WI_RXBUFSIZE];
+static WI_TLS u_char wi_rxbuf_slot_used[MAX_RXBUF_SLOTS];
+
+char * wi_get_rxbuf_slot(void) {
+	int i;
+	char * newrxbuf = NULL;
+	for (i = 0; i < MAX_RXBUF_SLOTS; ++i) {
+		if (wi_rxbuf_slot_used[i] == 0) {
+			wi_rxbuf_slot_used[i] = 1;
+			newrxbuf = wi_rxbuf_slot[i];
+			memset(newrxbuf,0,WI_RXBUFSIZE);
+			//dprintf("Acq RxBuf[%u]\n", (unsigned int)i);
+			break;
+		}
+	}
+	return newrxbuf;
+}
+
+void wi_free_rxbuf_slot(char * oldrxbuf) {
+	int i;
+	for (i = 0; i < MAX_RXBUF_SLOTS; ++i) {
+		if ((oldrxbuf == wi_rxbuf_slot[i]) && (wi_rxbuf_slot_used[i] != 0)) {
+			wi_rxbuf_slot_used[i] = 0;
+			//dprintf("Free RxBuf[%u]\n", (unsigned int)i);
+			break;
+		}
+	}
+}
+#endif
+
+char * wi_rxalloc(wi_sess * sess) {
+#ifdef WI_USE_MALLOC
+   sess->ws_rxbuf = wi_alloc(WI_RXBUFSIZE);
+#else
+   sess->ws_rxbuf = wi_get_rxbuf_slot();
+#endif
+   sess->ws_rxsize = 0;
+   return sess->ws_rxbuf;
+}
+
+/* rx buffer destructor */
+
+void wi_rxfree(wi_sess * sess) {
+#ifdef WI_USE_MALLOC
+   wi_free(sess->ws_rxbuf);
+#else
+   wi_free_rxbuf_slot(sess->ws_rxbuf);
+#endif
+   sess->ws_rxbuf = NULL;
+   sess->ws_rxsize = 0;
+   sess->ws_hdrscan = 0;
+}
+
 /* wi_file constructor */
 
 #ifndef WI_USE_MALLOC
-static wi_file wi_file_slot[MAX_FILE_SLOTS];
-static u_char wi_file_slot_used[MAX_FILE_SLOTS];
+static WI_TLS wi_file wi_file_slot[MAX_FILE_SLOTS];
+static WI_TLS u_char wi_file_slot_used[MAX_FILE_SLOTS];
 
 wi_file * wi_get_file_slot(void) {
 	int i;
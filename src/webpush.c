@@ -0,0 +1,1298 @@
+/* webpush.c
+ *
+ * Part of the Webio Open Source lightweight web server.
+ *
+ * Copyright (c) 2007 by John Bartas
+ * All rights reserved.
+ *
+ * Use license: Modified from standard BSD license.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation, advertising
+ * materials, Web server pages, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by John Bartas. The name "John Bartas" may not be used to
+ * endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "websys.h"
+#include "webio.h"
+
+#include <string.h>
+
+#ifdef LINUX
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
+
+/* This file contains the event driven server push API. Rather than
+ * keeping the session and writing to it for as long as it likes, an
+ * EMF_PUSH routine may call wi_pushstart() and return. The poll loop
+ * then calls the continuation it was given whenever there is something
+ * for it to do: the socket has room for more output, the application
+ * called wi_pushwake(), or the push's timer went off. A push costs no
+ * thread, and is subject to the send timeout like any other reply.
+ *
+ * wi_pushwake() may be called from any thread. Each reactor has a
+ * queue of the push IDs to wake, and on Linux an eventfd in its poll
+ * set which brings it out of its wait. Elsewhere the queue is looked
+ * at on every pass.
+ *
+ * Push sessions may also subscribe to a broadcast channel. A frame
+ * published to it is copied once, into a reference counted buffer
+ * which is queued by reference to every subscriber; each one costs a
+ * txbuf pointing into the frame, not a copy. Frames are handed to the
+ * reactors which have subscribers through the same queues as wakeups.
+ *
+ * The same queues carry long poll wakeups. A form handler which has
+ * nothing to answer yet parks its session with wi_park(); it then has
+ * no poll interest and costs nothing until wi_wake() is called with
+ * its key or its deadline comes, when the handler is run again.
+ */
+
+#ifndef WI_MAXREACTORS
+#define WI_MAXREACTORS  64    /* reactors which can take wakeups */
+#endif
+
+#define WP_WAKEQ        256   /* wakeups queued per reactor */
+#define WP_HASHSIZE     64    /* push session hash, power of 2 */
+#define WP_MAXCALLS     16    /* continuation calls per session per pass */
+#define WP_FRAMEQ       64    /* broadcast frames queued per reactor */
+#define WP_CASTMARK     32    /* default frames queued per subscriber */
+
+/* A push ID is a count kept by the reactor which owns the session
+ * times WI_MAXREACTORS, plus the reactor's waker number.
+ */
+#define WP_HASH(id)     (((id) / WI_MAXREACTORS) & (WP_HASHSIZE - 1))
+
+/* Park keys are the application's, e.g. pointers or small counts */
+#define WP_PARKHASH(key)   (((key) ^ ((key) >> 6) ^ ((key) >> 12)) & (WP_HASHSIZE - 1))
+
+/* ws_pushevents bits */
+#define WP_EV(event)    (1 << (event))
+#define WP_STOP         0x0100      /* end the push, see wi_pushstop() */
+#define WP_QUEUED       0x0200      /* on the reactor's run list */
+
+/* A broadcast frame. The data is followed by the chunk size line and
+ * CRLF, so HTTP/1.1 subscribers can send it as is.
+ */
+typedef struct wi_frame_s {
+   int      fr_refs;          /* txbufs and queues holding it */
+   u_long   fr_id;            /* order on its channel, from 1 */
+   int      fr_len;           /* published data */
+   int      fr_hdr;           /* chunk size line */
+   wi_chan * fr_chan;
+   char     fr_data[1];       /* size line, data, CRLF */
+} wi_frame;
+
+struct wi_chan_s {
+   int      ch_policy;        /* WI_CAST_ */
+   int      ch_mark;          /* frames queued per subscriber */
+   int      ch_hold;          /* ticks small frames may wait, see wi_chanhold() */
+   u_long   ch_lastid;        /* fr_id of the last frame published */
+   u_long   ch_published;     /* frames published */
+   u_long   ch_lost;          /* times a reactor's queue was full */
+   wi_frame ** ch_ring;       /* last frames published, see wi_chanreplay() */
+   int      ch_ringsize;
+   int      ch_ringnext;      /* slot for the next one */
+   int      ch_nsubs[WI_MAXREACTORS];     /* subscribers on each reactor */
+   wi_sess * ch_subs[WI_MAXREACTORS];     /* each reactor's own list */
+};
+
+typedef struct wp_waker_s {
+   int      wk_live;          /* reactor is running */
+   int      wk_fd;            /* eventfd the reactor polls, -1 if none */
+   int      wk_kicked;        /* wk_fd written since the reactor looked */
+   int      wk_count;         /* push IDs in wk_ids */
+   int      wk_overflow;      /* some were lost, wake every push */
+   u_long   wk_ids[WP_WAKEQ];
+   int      wk_nframes;       /* broadcast frames in wk_frames */
+   wi_frame * wk_frames[WP_FRAMEQ];
+   int      wk_nkeys;         /* park keys in wk_keys */
+   int      wk_keyoverflow;   /* some were lost, wake every parked session */
+   u_long   wk_keys[WP_WAKEQ];
+} wp_waker;
+
+static wp_waker   wp_wakers[WI_MAXREACTORS];
+static int        wp_nwakers = 0;
+
+#ifdef LINUX
+static pthread_mutex_t  wp_lock = PTHREAD_MUTEX_INITIALIZER;
+#define WP_LOCK()       pthread_mutex_lock(&wp_lock)
+#define WP_UNLOCK()     pthread_mutex_unlock(&wp_lock)
+/* Frames are let go by whichever reactor sends them last */
+#define WP_HOLD(fr)     __sync_add_and_fetch(&(fr)->fr_refs, 1)
+#define WP_RELEASE(fr)  __sync_sub_and_fetch(&(fr)->fr_refs, 1)
+#else
+#define WP_LOCK()
+#define WP_UNLOCK()
+#define WP_HOLD(fr)     (++(fr)->fr_refs)
+#define WP_RELEASE(fr)  (--(fr)->fr_refs)
+#endif
+
+/* Frames are sized to what is published, and may be freed on another
+ * thread, so they come from the system heap rather than wi_alloc().
+ * A build without one has no broadcast channels.
+ */
+#ifdef WI_USE_MALLOC
+#define WP_ALLOC(size)  WI_MALLOC(size)
+#define WP_FREE(ptr)    WI_FREE(ptr)
+#else
+#define WP_ALLOC(size)  NULL
+#define WP_FREE(ptr)
+#endif
+
+WI_TLS u_long  wi_castdrops = 0;
+
+WI_TLS int  wi_wakefd = -1;
+
+static WI_TLS int       wp_slot = -1;     /* this reactor's waker */
+static WI_TLS u_long    wp_seq;
+static WI_TLS wi_sess * wp_hash[WP_HASHSIZE];
+static WI_TLS wi_sess * wp_runhead;       /* push sessions with events */
+static WI_TLS wi_sess * wp_runtail;
+static WI_TLS wi_sess * wp_parked[WP_HASHSIZE];    /* by ws_parkkey */
+
+/* wi_pushinit()
+ *
+ * Set up the calling reactor's wakeup queue and descriptor. This does
+ * nothing if they are already set up. A reactor which is started again
+ * gets back the waker it had before.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_pushinit(void) {
+   wp_waker *  wk;
+
+   if ((wp_slot >= 0) && wp_wakers[wp_slot].wk_live) {
+      return 0;
+   }
+   WP_LOCK();
+   if ((wp_slot < 0) && (wp_nwakers >= WI_MAXREACTORS)) {
+      WP_UNLOCK();
+      dprintf("too many reactors for push wakeups\n");
+      return WI_E_BADPARM;
+   }
+   wk = &wp_wakers[(wp_slot >= 0) ? wp_slot : wp_nwakers];
+   wk->wk_fd = -1;
+#ifdef LINUX
+   wk->wk_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (wk->wk_fd < 0) {
+      WP_UNLOCK();
+      dprintf("eventfd error %d\n", errno);
+      return WI_E_SOCKET;
+   }
+#endif
+   wk->wk_kicked = FALSE;
+   wk->wk_count = 0;
+   wk->wk_overflow = FALSE;
+   wk->wk_nframes = 0;
+   wk->wk_nkeys = 0;
+   wk->wk_keyoverflow = FALSE;
+   wk->wk_live = TRUE;
+   if (wp_slot < 0) {
+      wp_slot = wp_nwakers++;
+   }
+   WP_UNLOCK();
+
+   wi_wakefd = wk->wk_fd;
+   return 0;
+}
+
+/* wi_pushcleanup() - stop taking wakeups for the calling reactor */
+
+void wi_pushcleanup(void) {
+   wi_frame *  frames[WP_FRAMEQ];
+   wp_waker *  wk;
+   int   nframes;
+   int   i;
+
+   if (wp_slot < 0) {
+      return;
+   }
+   wk = &wp_wakers[wp_slot];
+   WP_LOCK();
+   wk->wk_live = FALSE;
+#ifdef LINUX
+   if (wk->wk_fd >= 0) {
+      close(wk->wk_fd);
+   }
+#endif
+   wk->wk_fd = -1;
+   nframes = wk->wk_nframes;
+   memcpy(frames, wk->wk_frames, nframes * sizeof(wi_frame *));
+   wk->wk_nframes = 0;
+   WP_UNLOCK();
+   wi_wakefd = -1;
+
+   for (i = 0; i < nframes; i++) {
+      wi_framefree(frames[i]);
+   }
+}
+
+/* wp_kick()
+ *
+ * Bring a reactor out of its wait to look at its queues, unless it has
+ * been told already. Called with WP_LOCK held.
+ */
+
+static void wp_kick(wp_waker * wk) {
+#ifdef LINUX
+   if (!wk->wk_kicked) {
+      uint64_t one = 1;
+
+      if (write(wk->wk_fd, &one, sizeof(one)) < 0) {
+         dtrap();    /* counter full, the reactor is awake anyway */
+      }
+   }
+#endif
+   wk->wk_kicked = TRUE;
+}
+
+/* wp_queue() - note events for a push session, and put it on the run list */
+
+static void wp_queue(wi_sess * sess, int events) {
+   sess->ws_pushevents |= events;
+   if (sess->ws_pushevents & WP_QUEUED) {
+      return;
+   }
+   sess->ws_pushevents |= WP_QUEUED;
+   sess->ws_pushrun = NULL;
+   if (wp_runtail) {
+      wp_runtail->ws_pushrun = sess;
+   } else {
+      wp_runhead = sess;
+   }
+   wp_runtail = sess;
+}
+
+/* wp_parkunlink() - take a session out of the parked hash */
+
+static void wp_parkunlink(wi_sess * sess) {
+   wi_sess **  link;
+
+   if (sess->ws_parkkey == 0) {
+      return;
+   }
+   for (link = &wp_parked[WP_PARKHASH(sess->ws_parkkey)]; *link;
+        link = &(*link)->ws_parknext) {
+      if (*link == sess) {
+         *link = sess->ws_parknext;
+         break;
+      }
+   }
+   sess->ws_parkkey = 0;
+   sess->ws_parknext = NULL;
+}
+
+/* wp_unlink() - take a session out of the push hash and the run list */
+
+static void wp_unlink(wi_sess * sess) {
+   wi_sess **  link;
+   wi_sess *   prev;
+
+   if (sess->ws_pushid) {
+      for (link = &wp_hash[WP_HASH(sess->ws_pushid)]; *link;
+           link = &(*link)->ws_pushnext) {
+         if (*link == sess) {
+            *link = sess->ws_pushnext;
+            break;
+         }
+      }
+      sess->ws_pushid = 0;
+   }
+   if (sess->ws_pushevents & WP_QUEUED) {
+      prev = NULL;
+      for (link = &wp_runhead; *link; link = &(*link)->ws_pushrun) {
+         if (*link == sess) {
+            *link = sess->ws_pushrun;
+            if (wp_runtail == sess) {
+               wp_runtail = prev;
+            }
+            break;
+         }
+         prev = *link;
+      }
+   }
+   sess->ws_pushevents = 0;
+   sess->ws_castdue = 0;
+   wi_unsubscribe(sess);
+   wp_parkunlink(sess);
+}
+
+/* wp_hashin() - give a session a push ID, and put it in the push hash */
+
+static void wp_hashin(wi_sess * sess) {
+   wi_sess **  bucket;
+
+   sess->ws_pushid = (++wp_seq * WI_MAXREACTORS) + wp_slot;
+   bucket = &wp_hash[WP_HASH(sess->ws_pushid)];
+   sess->ws_pushnext = *bucket;
+   *bucket = sess;
+}
+
+/* wi_pushstart()
+ *
+ * Have a push routine's session run by the poll loop. This is called
+ * from an EMF_PUSH routine, which then returns. From then on the poll
+ * loop calls func(sess, ctx, event) with one of these events:
+ *
+ * WI_PUSH_WRITE - the socket can take more. This is the first call.
+ * WI_PUSH_WAKE - wi_pushwake() was called with ws_pushid.
+ * WI_PUSH_TIMER - the time set with wi_pushtimer() is up.
+ * WI_PUSH_END - the session is ending, free ctx. The return is ignored.
+ *
+ * func adds output with wi_printf() or wi_sendext(), and returns
+ * WI_PUSH_MORE to be called again when the socket has room (returning
+ * it without adding output counts as WI_PUSH_WAIT), WI_PUSH_WAIT to
+ * sleep until a wakeup or the timer, WI_PUSH_DONE at the end of the
+ * reply, or a negative WI_E_ code to drop the connection. It is not
+ * called while wi_chunkmark bytes are unsent; wakeups which come in
+ * then are held. The output is sent chunked to HTTP/1.1 clients, the
+ * reply header goes out after the first call.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_pushstart(wi_sess * sess, wi_pushfunc func, void * ctx) {
+   if ((func == NULL) || sess->ws_pushfunc ||
+       (sess->ws_state != WI_PUSHING) || (wp_slot < 0)) {
+      return WI_E_BADPARM;
+   }
+   sess->ws_pushfunc = func;
+   sess->ws_pushctx = ctx;
+   sess->ws_pushmode = WI_PUSH_MORE;
+   sess->ws_pushevents = 0;
+   sess->ws_pushdue = 0;
+   wp_hashin(sess);
+   return 0;
+}
+
+/* wi_pushwake()
+ *
+ * Have the push with ID "pushid" (its session's ws_pushid) called
+ * with WI_PUSH_WAKE, or a parked body generator called again (see
+ * wi_genpark()). This may be called from any thread. Wakeups which
+ * come in before the push is called again are delivered as one. A
+ * push which has ended is ignored.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_pushwake(u_long pushid) {
+   wp_waker *  wk;
+
+   if (pushid == 0) {
+      return WI_E_BADPARM;
+   }
+   wk = &wp_wakers[pushid % WI_MAXREACTORS];
+   WP_LOCK();
+   if (!wk->wk_live) {
+      WP_UNLOCK();
+      return WI_E_BADPARM;
+   }
+   wp_kick(wk);
+   if (wk->wk_count < WP_WAKEQ) {
+      wk->wk_ids[wk->wk_count++] = pushid;
+   } else {
+      wk->wk_overflow = TRUE;
+   }
+   WP_UNLOCK();
+   return 0;
+}
+
+/* wp_attach()
+ *
+ * Queue a frame to a subscriber, by reference. HTTP/1.1 clients get
+ * it as a chunk, with the size line built into the frame.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wp_attach(wi_sess * sess, wi_frame * frame) {
+   txbuf *  tb;
+   int      error;
+
+   /* Frame the push's own output ahead of it, and on the first output
+    * put the reply header in.
+    */
+   error = wi_chunk(sess, FALSE);
+   if (error) {
+      return error;
+   }
+   tb = wi_txalloc(sess);
+   if (tb == NULL) {
+      return WI_E_MEMORY;
+   }
+   WP_HOLD(frame);
+   tb->tb_frame = frame;
+   if (sess->ws_flags & WF_HTTP11) {
+      tb->tb_ext = frame->fr_data;
+      tb->tb_total = frame->fr_hdr + frame->fr_len + 2;
+   } else {
+      tb->tb_ext = frame->fr_data + frame->fr_hdr;
+      tb->tb_total = frame->fr_len;
+   }
+   sess->ws_castq++;
+   sess->ws_castid = frame->fr_id;
+   sess->ws_txmark = sess->ws_txtail;  /* framed already */
+   return 0;
+}
+
+/* wi_framefree() - let go of a hold on a broadcast frame */
+
+void wi_framefree(wi_frame * frame) {
+   if (WP_RELEASE(frame) == 0) {
+      WP_FREE(frame);
+   }
+}
+
+/* wi_chancreate()
+ *
+ * Make a broadcast channel. "policy" is the WI_CAST_ rule for
+ * subscribers with "mark" frames unsent (0 for the default). A
+ * channel lasts as long as the server.
+ *
+ * Returns: the channel, or NULL if out of memory or built without
+ * WI_USE_MALLOC.
+ */
+
+wi_chan * wi_chancreate(int policy, int mark) {
+   wi_chan *   chan;
+
+   chan = (wi_chan *)WP_ALLOC(sizeof(wi_chan));
+   if (chan == NULL) {
+      return NULL;
+   }
+   memset(chan, 0, sizeof(wi_chan));
+   chan->ch_policy = policy;
+   chan->ch_mark = (mark > 0) ? mark : WP_CASTMARK;
+   return chan;
+}
+
+/* wi_chanfree()
+ *
+ * Free a channel which was never used, e.g. when setting it up went
+ * wrong. One which has had subscribers or frames must be kept.
+ */
+
+void wi_chanfree(wi_chan * chan) {
+   if (chan->ch_ring) {
+      WP_FREE(chan->ch_ring);
+   }
+   WP_FREE(chan);
+}
+
+/* wi_chanreplay()
+ *
+ * Keep the last "frames" frames published to a channel, to be sent
+ * again to subscribers which missed them (see wi_subscribefrom()).
+ * This is done before anything is published.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_chanreplay(wi_chan * chan, int frames) {
+   wi_frame ** ring;
+
+   if ((frames <= 0) || chan->ch_ring) {
+      return WI_E_BADPARM;
+   }
+   ring = (wi_frame **)WP_ALLOC(frames * sizeof(wi_frame *));
+   if (ring == NULL) {
+      return WI_E_MEMORY;
+   }
+   memset(ring, 0, frames * sizeof(wi_frame *));
+   WP_LOCK();
+   chan->ch_ring = ring;
+   chan->ch_ringsize = frames;
+   chan->ch_ringnext = 0;
+   WP_UNLOCK();
+   return 0;
+}
+
+/* wi_chanhold()
+ *
+ * Let small frames wait up to "msecs" (to the next clock tick) for
+ * others, so a burst of them goes to each subscriber in one write.
+ * A subscriber's frames go as soon as a segment's worth is queued.
+ * 0 sends every frame at once, the default.
+ */
+
+void wi_chanhold(wi_chan * chan, int msecs) {
+   chan->ch_hold = 0;
+   if (msecs > 0) {
+      chan->ch_hold = ((msecs * TPS) + 999) / 1000;
+   }
+}
+
+/* wi_subscribe()
+ *
+ * Have the frames published to "chan" sent on a push session, which
+ * must have a continuation (see wi_pushstart()). They are sent between
+ * its own output, so it is best done from the continuation once any
+ * preamble is out. A session has at most one channel; it leaves it
+ * when the push ends.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_subscribe(wi_sess * sess, wi_chan * chan) {
+   return wi_subscribefrom(sess, chan, 0);
+}
+
+/* wi_subscribefrom()
+ *
+ * wi_subscribe(), but first send the frames in the channel's replay
+ * ring which came after frame "lastid", e.g. from an event stream's
+ * Last-Event-ID. 0 is for none.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_subscribefrom(wi_sess * sess, wi_chan * chan, u_long lastid) {
+   wi_frame *  replay[WP_FRAMEQ];
+   wi_frame *  frame;
+   int   nreplay = 0;
+   int   error = 0;
+   int   i;
+
+   if ((chan == NULL) || (sess->ws_pushfunc == NULL) || sess->ws_chan) {
+      return WI_E_BADPARM;
+   }
+   sess->ws_chan = chan;
+   sess->ws_subnext = chan->ch_subs[wp_slot];
+   chan->ch_subs[wp_slot] = sess;
+
+   /* Frames published from here on come to the session, and the older
+    * ones it wants are in the ring. Frames on their way here in the
+    * reactor's queue are skipped, by id.
+    */
+   WP_LOCK();
+   chan->ch_nsubs[wp_slot]++;
+   sess->ws_castid = chan->ch_lastid;
+   if (lastid && chan->ch_ring) {
+      for (i = 0; i < chan->ch_ringsize; i++) {
+         frame = chan->ch_ring[(chan->ch_ringnext + i) % chan->ch_ringsize];
+         if (frame && (frame->fr_id > lastid) && (nreplay < WP_FRAMEQ)) {
+            WP_HOLD(frame);
+            replay[nreplay++] = frame;
+         }
+      }
+   }
+   WP_UNLOCK();
+
+   for (i = 0; i < nreplay; i++) {
+      if (error == 0) {
+         error = wp_attach(sess, replay[i]);
+      }
+      wi_framefree(replay[i]);
+   }
+   if (nreplay) {
+      wp_queue(sess, 0);      /* to send them */
+   }
+   return error;
+}
+
+/* wi_unsubscribe()
+ *
+ * Take a session off its channel. Frames already queued to it are
+ * still sent.
+ */
+
+void wi_unsubscribe(wi_sess * sess) {
+   wi_chan *   chan = sess->ws_chan;
+   wi_sess **  link;
+
+   if (chan == NULL) {
+      return;
+   }
+   for (link = &chan->ch_subs[wp_slot]; *link; link = &(*link)->ws_subnext) {
+      if (*link == sess) {
+         *link = sess->ws_subnext;
+         break;
+      }
+   }
+   WP_LOCK();
+   chan->ch_nsubs[wp_slot]--;
+   WP_UNLOCK();
+   if (sess->ws_castpend) {
+      wi_framefree(sess->ws_castpend);
+      sess->ws_castpend = NULL;
+   }
+   sess->ws_chan = NULL;
+   sess->ws_subnext = NULL;
+}
+
+/* wi_publish()
+ *
+ * Send "len" bytes at "data" to every subscriber of "chan". The data
+ * is copied once, and may be reused when this returns. This may be
+ * called from any thread; the frame reaches the subscribers when
+ * their reactors next look at their queues, in the order published.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_publish(wi_chan * chan, const char * data, int len) {
+   return wi_publishid(chan, 0, data, len);
+}
+
+/* wi_publishid()
+ *
+ * wi_publish() with the frame's id, for a publisher which has put it
+ * in the data. It must be higher than the last one; 0 takes the next.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_publishid(wi_chan * chan, u_long id, const char * data, int len) {
+   wi_frame *  frame;
+   wi_frame *  old = NULL;
+   wp_waker *  wk;
+   char  sizeline[16];
+   int   hdr;
+   int   i;
+
+   if ((chan == NULL) || (data == NULL) || (len <= 0)) {
+      return WI_E_BADPARM;    /* a 0 length chunk would end the reply */
+   }
+   hdr = sprintf(sizeline, "%x\r\n", len);
+   frame = (wi_frame *)WP_ALLOC(sizeof(wi_frame) + hdr + len + 2);
+   if (frame == NULL) {
+      return WI_E_MEMORY;
+   }
+   frame->fr_refs = 1;        /* ours, until it is queued */
+   frame->fr_len = len;
+   frame->fr_hdr = hdr;
+   frame->fr_chan = chan;
+   memcpy(frame->fr_data, sizeline, hdr);
+   memcpy(frame->fr_data + hdr, data, len);
+   memcpy(frame->fr_data + hdr + len, "\r\n", 2);
+
+   WP_LOCK();
+   if (id == 0) {
+      id = chan->ch_lastid + 1;
+   } else if (id <= chan->ch_lastid) {
+      WP_UNLOCK();
+      WP_FREE(frame);
+      return WI_E_BADPARM;
+   }
+   frame->fr_id = chan->ch_lastid = id;
+   chan->ch_published++;
+   if (chan->ch_ring) {
+      old = chan->ch_ring[chan->ch_ringnext];
+      WP_HOLD(frame);
+      chan->ch_ring[chan->ch_ringnext] = frame;
+      chan->ch_ringnext = (chan->ch_ringnext + 1) % chan->ch_ringsize;
+   }
+   for (i = 0; i < wp_nwakers; i++) {
+      wk = &wp_wakers[i];
+      if (!wk->wk_live || (chan->ch_nsubs[i] == 0)) {
+         continue;
+      }
+      if (wk->wk_nframes >= WP_FRAMEQ) {
+         chan->ch_lost++;     /* the reactor is far behind */
+         continue;
+      }
+      WP_HOLD(frame);
+      wk->wk_frames[wk->wk_nframes++] = frame;
+      wp_kick(wk);
+   }
+   WP_UNLOCK();
+
+   if (old) {
+      wi_framefree(old);      /* dropped off the ring */
+   }
+   wi_framefree(frame);
+   return 0;
+}
+
+/* wp_deliver()
+ *
+ * Give a new frame to a subscriber, unless it is past its channel's
+ * mark. Then, as its policy says, the frame is dropped, held back in
+ * place of the last one held, or the subscriber's reply is ended.
+ */
+
+static void wp_deliver(wi_sess * sess, wi_frame * frame) {
+   wi_chan *   chan = frame->fr_chan;
+
+   if (frame->fr_id <= sess->ws_castid) {
+      return;     /* it had this one from the replay ring */
+   }
+   if (sess->ws_castq >= chan->ch_mark) {
+      wi_castdrops++;
+      sess->ws_castid = frame->fr_id;
+      if (chan->ch_policy == WI_CAST_COALESCE) {
+         if (sess->ws_castpend) {
+            wi_framefree(sess->ws_castpend);
+         }
+         WP_HOLD(frame);
+         sess->ws_castpend = frame;
+      } else if (chan->ch_policy == WI_CAST_CLOSE) {
+         wi_pushstop(sess);
+      }
+      return;
+   }
+   if (wp_attach(sess, frame)) {
+      wi_castdrops++;
+      return;
+   }
+
+   /* With a hold on the channel, small frames wait a little for more */
+   if (chan->ch_hold > 0) {
+      if (sess->ws_castdue == 0) {
+         sess->ws_castdue = wi_cticks + chan->ch_hold;
+         if (sess->ws_castdue == 0) {
+            sess->ws_castdue = 1;      /* 0 means not held */
+         }
+         wi_timerupdate(sess);
+      }
+      if (wi_txqueued(sess) < WI_TXBUFSIZE) {
+         return;
+      }
+      sess->ws_castdue = 0;
+   }
+   wp_queue(sess, 0);      /* to send it */
+}
+
+/* wi_park()
+ *
+ * Hold a request until there is something to answer it with. This is
+ * called from a form handler, which then returns NULL without making
+ * a reply. The session has no poll interest and is not run until
+ * wi_wake() is called with "key" (not 0), or "msecs" go by. Then the
+ * handler is run again, with ws_parkevent set to WI_PARK_WAKE or
+ * WI_PARK_TIMEOUT, and the request's form values as they were. It
+ * answers, or parks again; on WI_PARK_TIMEOUT it should answer. One
+ * which parks again after a wakeup keeps its first deadline, so a busy
+ * key can't hold a request forever.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_park(wi_sess * sess, u_long key, long msecs) {
+   wi_sess **  bucket;
+
+   if ((key == 0) || (msecs <= 0) || (wp_slot < 0) ||
+       (sess->ws_state != WI_CONTENT) || (sess->ws_filelist == NULL)) {
+      return WI_E_BADPARM;
+   }
+   wp_parkunlink(sess);    /* in case it was called twice */
+   sess->ws_state = WI_PARKED;
+   sess->ws_parkkey = key;
+   if (sess->ws_parkevent != WI_PARK_WAKE) {
+      sess->ws_parkdue = wi_cticks + (((msecs * TPS) + 999) / 1000);
+   }
+
+   bucket = &wp_parked[WP_PARKHASH(key)];
+   sess->ws_parknext = *bucket;
+   *bucket = sess;
+   return 0;
+}
+
+/* wi_wake()
+ *
+ * Run the form handlers of all the sessions parked on "key" again.
+ * This may be called from any thread. The key is queued to every
+ * reactor, so a wakeup which comes between a handler looking at its
+ * data and parking is not lost. Wakeups for a key which come in
+ * before the reactor looks are delivered as one.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_wake(u_long key) {
+   wp_waker *  wk;
+   int   i;
+   int   j;
+
+   if (key == 0) {
+      return WI_E_BADPARM;
+   }
+   WP_LOCK();
+   for (i = 0; i < wp_nwakers; i++) {
+      wk = &wp_wakers[i];
+      if (!wk->wk_live || wk->wk_keyoverflow) {
+         continue;
+      }
+      for (j = 0; j < wk->wk_nkeys; j++) {
+         if (wk->wk_keys[j] == key) {
+            break;
+         }
+      }
+      if (j < wk->wk_nkeys) {
+         continue;      /* already queued */
+      }
+      wp_kick(wk);
+      if (wk->wk_nkeys < WP_WAKEQ) {
+         wk->wk_keys[wk->wk_nkeys++] = key;
+      } else {
+         wk->wk_keyoverflow = TRUE;
+      }
+   }
+   WP_UNLOCK();
+   return 0;
+}
+
+/* wp_unpark() - have a parked session's form handler run on this pass */
+
+static void wp_unpark(wi_sess * sess, int event) {
+   wp_parkunlink(sess);
+   wi_timerclear(sess);    /* the deadline, WI_CONTENT sets its own */
+   sess->ws_parkevent = event;
+   sess->ws_state = WI_CONTENT;
+   sess->ws_last = wi_cticks;
+   wp_queue(sess, 0);
+}
+
+/* wp_wakeparked() - unpark the sessions parked on "key", or all for 0 */
+
+static void wp_wakeparked(u_long key) {
+   wi_sess **  link;
+   wi_sess *   sess;
+   int   first = 0;
+   int   last = WP_HASHSIZE - 1;
+   int   i;
+
+   if (key) {
+      first = last = (int)WP_PARKHASH(key);
+   }
+   for (i = first; i <= last; i++) {
+      link = &wp_parked[i];
+      while ((sess = *link) != NULL) {
+         if (key && (sess->ws_parkkey != key)) {
+            link = &sess->ws_parknext;
+            continue;
+         }
+         *link = sess->ws_parknext;    /* quicker than wp_parkunlink() */
+         sess->ws_parkkey = 0;
+         sess->ws_parknext = NULL;
+         wp_unpark(sess, WI_PARK_WAKE);
+      }
+   }
+}
+
+/* wi_parkexpire()
+ *
+ * Run a parked session's form handler with WI_PARK_TIMEOUT. Called
+ * when its deadline comes, or to answer it now for a shutdown.
+ */
+
+void wi_parkexpire(wi_sess * sess) {
+   if (sess->ws_state == WI_PARKED) {
+      wp_unpark(sess, WI_PARK_TIMEOUT);
+   }
+}
+
+/* wi_genstart()
+ *
+ * Give a session with a body generator a ws_pushid, so it can be
+ * woken with wi_pushwake() when it has been parked, see wi_genpark().
+ * Called by wi_setgenerator().
+ */
+
+void wi_genstart(wi_sess * sess) {
+   if ((wp_slot >= 0) && (sess->ws_pushid == 0)) {
+      wp_hashin(sess);
+   }
+}
+
+/* wi_genpark()
+ *
+ * Park a session whose body generator returned 1 without adding any
+ * output, rather than calling it again on every pass. It is called
+ * again when wi_pushwake() is called with the session's ws_pushid,
+ * or on the next clock tick, for a generator which just polls.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_genpark(wi_sess * sess) {
+   if (sess->ws_state != WI_CONTENT) {
+      return WI_E_BADPARM;
+   }
+   sess->ws_state = WI_PARKED;
+   sess->ws_parkdue = wi_cticks + 1;
+   return 0;
+}
+
+/* wi_genstop() - the body generator is done, drop its ws_pushid */
+
+void wi_genstop(wi_sess * sess) {
+   wp_unlink(sess);
+}
+
+/* wp_wakeid() - deliver a wi_pushwake() to its session */
+
+static void wp_wakeid(wi_sess * sess) {
+   if (sess->ws_pushfunc) {
+      wp_queue(sess, WP_EV(WI_PUSH_WAKE));
+   } else if (sess->ws_state == WI_PARKED) {
+      wp_unpark(sess, WI_PARK_WAKE);   /* a generator, see wi_genpark() */
+   } else {
+      wp_queue(sess, 0);
+   }
+}
+
+/* wi_pushcheck()
+ *
+ * Take the calling reactor's queued wakeups and broadcast frames, and
+ * put the push sessions and parked sessions they are for on the run
+ * list. This is called when wi_wakefd is readable, or on every pass
+ * if there is no wi_wakefd.
+ */
+
+void wi_pushcheck(void) {
+   u_long      ids[WP_WAKEQ];
+   u_long      keys[WP_WAKEQ];
+   wi_frame *  frames[WP_FRAMEQ];
+   wp_waker *  wk;
+   wi_sess *   sess;
+   int   count;
+   int   overflow;
+   int   nframes;
+   int   nkeys;
+   int   keyoverflow;
+   int   i;
+
+   if (wp_slot < 0) {
+      return;
+   }
+   wk = &wp_wakers[wp_slot];
+#ifdef LINUX
+   {
+      uint64_t value;
+
+      if (read(wi_wakefd, &value, sizeof(value)) < 0) {
+         value = 0;     /* EWOULDBLOCK, nothing new */
+      }
+   }
+#endif
+   WP_LOCK();
+   count = wk->wk_count;
+   overflow = wk->wk_overflow;
+   memcpy(ids, wk->wk_ids, count * sizeof(u_long));
+   wk->wk_count = 0;
+   wk->wk_overflow = FALSE;
+   nframes = wk->wk_nframes;
+   memcpy(frames, wk->wk_frames, nframes * sizeof(wi_frame *));
+   wk->wk_nframes = 0;
+   nkeys = wk->wk_nkeys;
+   keyoverflow = wk->wk_keyoverflow;
+   memcpy(keys, wk->wk_keys, nkeys * sizeof(u_long));
+   wk->wk_nkeys = 0;
+   wk->wk_keyoverflow = FALSE;
+   wk->wk_kicked = FALSE;
+   WP_UNLOCK();
+
+   if (keyoverflow) {
+      wp_wakeparked(0);    /* don't know which, wake them all */
+   } else {
+      for (i = 0; i < nkeys; i++) {
+         wp_wakeparked(keys[i]);
+      }
+   }
+
+   for (i = 0; i < nframes; i++) {
+      for (sess = frames[i]->fr_chan->ch_subs[wp_slot]; sess;
+           sess = sess->ws_subnext) {
+         wp_deliver(sess, frames[i]);
+      }
+      wi_framefree(frames[i]);     /* the queue's hold */
+   }
+
+   if (overflow) {
+      /* Don't know which, wake them all */
+      for (i = 0; i < WP_HASHSIZE; i++) {
+         for (sess = wp_hash[i]; sess; sess = sess->ws_pushnext) {
+            wp_wakeid(sess);
+         }
+      }
+      return;
+   }
+   for (i = 0; i < count; i++) {
+      for (sess = wp_hash[WP_HASH(ids[i])]; sess; sess = sess->ws_pushnext) {
+         if (sess->ws_pushid == ids[i]) {
+            wp_wakeid(sess);
+            break;
+         }
+      }
+   }
+}
+
+/* wi_pushnext()
+ *
+ * Returns: the next push session on the run list, or NULL if there
+ * are none. The caller runs its state machine.
+ */
+
+wi_sess * wi_pushnext(void) {
+   wi_sess *   sess;
+
+   sess = wp_runhead;
+   if (sess) {
+      wp_runhead = sess->ws_pushrun;
+      if (wp_runhead == NULL) {
+         wp_runtail = NULL;
+      }
+      sess->ws_pushrun = NULL;
+      sess->ws_pushevents &= ~WP_QUEUED;
+   }
+   return sess;
+}
+
+/* wi_pushtimer()
+ *
+ * Have the push called with WI_PUSH_TIMER in "msecs" milliseconds,
+ * to the next clock tick. This replaces any earlier setting; 0 just
+ * clears it. It goes off once, the push sets it again if it wants
+ * to be called periodically.
+ */
+
+void wi_pushtimer(wi_sess * sess, long msecs) {
+   sess->ws_pushevents &= ~WP_EV(WI_PUSH_TIMER);
+   sess->ws_pushdue = 0;
+   if (msecs > 0) {
+      sess->ws_pushdue = wi_cticks + (((msecs * TPS) + 999) / 1000);
+      if (sess->ws_pushdue == 0) {
+         sess->ws_pushdue = 1;      /* 0 means no timer */
+      }
+   }
+   wi_timerupdate(sess);
+}
+
+/* wi_pushexpire()
+ *
+ * Called when the session timer of a push with a continuation goes
+ * off. While the push has nothing unsent, that is its own timer, and
+ * while it has broadcast frames held it is the end of the hold.
+ *
+ * Returns: TRUE if the push will be run for its timer, FALSE if the
+ * session timed out sending.
+ */
+
+int wi_pushexpire(wi_sess * sess) {
+   if (sess->ws_castdue) {
+      sess->ws_castdue = 0;
+      wp_queue(sess, 0);      /* to send the held frames */
+      return TRUE;
+   }
+   if (sess->ws_txbufs || (sess->ws_pushdue == 0) ||
+       ((long)(wi_cticks - sess->ws_pushdue) < 0)) {
+      return FALSE;
+   }
+   sess->ws_pushdue = 0;
+   wp_queue(sess, WP_EV(WI_PUSH_TIMER));
+   return TRUE;
+}
+
+/* wi_pushstop()
+ *
+ * End a push with a continuation on this pass, e.g. for a shutdown.
+ * It is called with WI_PUSH_END, then its reply is ended and sent.
+ */
+
+void wi_pushstop(wi_sess * sess) {
+   if (sess->ws_pushfunc) {
+      wp_queue(sess, WP_STOP);
+   }
+}
+
+/* wi_pushqueue()
+ *
+ * Have a session's state machine run on this pass by the poll loop,
+ * for work no socket event will bring, e.g. output queued to a
+ * WebSocket from outside its handler. It need not be a push.
+ */
+
+void wi_pushqueue(wi_sess * sess) {
+   wp_queue(sess, 0);
+}
+
+/* wi_pushend()
+ *
+ * Let a push's continuation free its context when its session is
+ * deleted. Called by wi_delsess().
+ */
+
+void wi_pushend(wi_sess * sess) {
+   wp_unlink(sess);
+   if (sess->ws_pushfunc) {
+      sess->ws_state = WI_ENDING;
+      sess->ws_pushfunc(sess, sess->ws_pushctx, WI_PUSH_END);
+      sess->ws_pushfunc = NULL;
+   }
+}
+
+/* wp_input()
+ *
+ * Read from a push session's socket. The client has nothing to say
+ * once its request is in, the input is just to see it close.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wp_input(wi_sess * sess) {
+#ifdef WI_USE_URING
+   (void)sess;    /* wu_rxdata() does this */
+#else
+   char  junk[256];
+   int   len;
+   int   i;
+
+   for (i = 0; i < 16; i++) {
+      len = recv(sess->ws_socket, junk, sizeof(junk), 0);
+      if (len < 0) {
+         if ((errno == EWOULDBLOCK) || (errno == EINTR)) {
+            break;
+         }
+         return wi_sockerr(sess, errno);
+      }
+      if (len == 0) {
+         sess->ws_state = WI_ENDING;   /* the usual end of a push */
+         break;
+      }
+   }
+#endif
+   return 0;
+}
+
+/* wp_flush() - send a push session's queued output */
+
+static int wp_flush(wi_sess * sess) {
+   if ((sess->ws_txbufs == NULL) || sess->ws_castdue) {
+      return 0;      /* nothing, or frames are held, see wi_chanhold() */
+   }
+#ifdef WI_USE_URING
+   return wi_sockwrite(sess);    /* starts a send unless one is running */
+#else
+   if (sess->ws_flags & WF_TXBLOCKED) {
+      return 0;      /* wait until the socket is writable */
+   }
+   return wi_txflush(sess);
+#endif
+}
+
+/* wp_finish()
+ *
+ * End a push's reply. The session sends what is left and closes.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wp_finish(wi_sess * sess) {
+   int   error;
+
+   sess->ws_pushfunc = NULL;
+   wp_unlink(sess);
+   error = wi_chunk(sess, TRUE);
+   if (error) {
+      return error;
+   }
+   sess->ws_state = WI_SENDDATA;
+   return wi_sockwrite(sess);
+}
+
+/* wp_event()
+ *
+ * Returns: the event to call a push with next, or 0 if none.
+ */
+
+static int wp_event(wi_sess * sess) {
+   if (sess->ws_pushevents & WP_EV(WI_PUSH_WAKE)) {
+      sess->ws_pushevents &= ~WP_EV(WI_PUSH_WAKE);
+      return WI_PUSH_WAKE;
+   }
+   if (sess->ws_pushevents & WP_EV(WI_PUSH_TIMER)) {
+      sess->ws_pushevents &= ~WP_EV(WI_PUSH_TIMER);
+      return WI_PUSH_TIMER;
+   }
+   if (sess->ws_pushmode == WI_PUSH_MORE) {
+      return WI_PUSH_WRITE;
+   }
+   return 0;
+}
+
+/* wi_pushserve()
+ *
+ * Run a push with a continuation. "ready" is the WI_EV events on its
+ * socket. Its output is sent, and it is called for each event waiting
+ * while the socket keeps up with it.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_pushserve(wi_sess * sess, int ready) {
+   int   calls;
+   int   queued;
+   int   event;
+   int   mode;
+   int   error;
+
+   if (ready & WI_EVREAD) {
+      error = wp_input(sess);
+      if (error || (sess->ws_state != WI_PUSHING)) {
+         return error;
+      }
+   }
+   if (sess->ws_pushevents & WP_STOP) {
+      sess->ws_pushfunc(sess, sess->ws_pushctx, WI_PUSH_END);
+      return wp_finish(sess);
+   }
+
+   for (calls = 0; ; calls++) {
+      error = wp_flush(sess);
+      if (error) {
+         return error;
+      }
+      /* A subscriber which has caught up gets the frame it missed */
+      if (sess->ws_castpend && (sess->ws_castq < sess->ws_chan->ch_mark)) {
+         error = wp_attach(sess, sess->ws_castpend);
+         wi_framefree(sess->ws_castpend);
+         sess->ws_castpend = NULL;
+         if (error) {
+            return error;
+         }
+         continue;
+      }
+      /* Hold off while the socket is behind, or to let others run */
+      if ((wi_txqueued(sess) >= ((wi_chunkmark > 0) ? wi_chunkmark : 1)) ||
+          (calls >= WP_MAXCALLS)) {
+         return 0;
+      }
+      event = wp_event(sess);
+      if (event == 0) {
+         return 0;
+      }
+
+      queued = wi_txqueued(sess);
+      mode = sess->ws_pushfunc(sess, sess->ws_pushctx, event);
+      if (mode < 0) {
+         return mode;
+      }
+      if (mode == WI_PUSH_DONE) {
+         return wp_finish(sess);
+      }
+      if ((mode != WI_PUSH_MORE) || (wi_txqueued(sess) == queued)) {
+         mode = WI_PUSH_WAIT;    /* nothing came, don't spin on it */
+      }
+      sess->ws_pushmode = mode;
+
+      error = wi_chunk(sess, FALSE);
+      if (error) {
+         return error;
+      }
+   }
+}
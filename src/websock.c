@@ -0,0 +1,755 @@
+/* websock.c
+ *
+ * Part of the Webio Open Source lightweight web server.
+ *
+ * Copyright (c) 2007 by John Bartas
+ * All rights reserved.
+ *
+ * Use license: Modified from standard BSD license.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation, advertising
+ * materials, Web server pages, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by John Bartas. The name "John Bartas" may not be used to
+ * endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "websys.h"
+#include "webio.h"
+
+#include <string.h>
+
+/* This file contains the WebSocket (RFC 6455) connections. A GET of
+ * an EMF_WSOCK file which asks to upgrade is answered "101 Switching
+ * Protocols", and from then on the session is in WI_WEBSOCKET: the
+ * poll loop hands each message the client sends to the file's
+ * handler, which answers with wi_wssend(). There is no request to
+ * parse, file to open or header to build per message.
+ *
+ * Frames are parsed as they come in, into the session's rxbuf. The
+ * payload of each is unmasked in place and moved down behind the
+ * ones before it, so a fragmented message ends up whole at the front
+ * of rxbuf and is handed over from there. The largest message is
+ * thus a little under WI_RXBUFSIZE; a client which sends a bigger
+ * one has its connection closed (1009). Text is not checked for
+ * UTF-8, that is up to the handler.
+ *
+ * A connection which has been quiet for wi_pingtmo is pinged, and
+ * dropped if it doesn't answer in as long again. Any input counts as
+ * an answer.
+ */
+
+#define WSK_MAXKEY      64    /* longest Sec-WebSocket-Key taken */
+
+/* frame opcodes */
+#define WSK_OPCONT      0x0
+#define WSK_OPTEXT      0x1
+#define WSK_OPBINARY    0x2
+#define WSK_OPCLOSE     0x8
+#define WSK_OPPING      0x9
+#define WSK_OPPONG      0xA
+
+/* close codes */
+#define WSK_PROTOCOL    1002  /* client broke the protocol */
+#define WSK_TOOBIG      1009  /* message won't fit */
+
+/* ws_wsflags bits */
+#define WSK_SERVING     0x01  /* handler is being run, the poll loop sends */
+#define WSK_PINGDUE     0x02  /* timer is up, send a ping */
+#define WSK_PINGED      0x04  /* ping sent, answer due at ws_wsping */
+#define WSK_CLOSESENT   0x08  /* close frame queued */
+#define WSK_CLOSERX     0x10  /* close frame came in, or input is done */
+
+static const char wsk_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char wsk_b64[] =
+   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define WSK_ROL(x, n)   ((((x) << (n)) | ((x) >> (32 - (n)))) & 0xffffffffUL)
+
+/* wsk_sha1()
+ *
+ * Make the SHA-1 digest of a short string (up to 119 bytes), for the
+ * handshake. Only 32 bits of each u_long are used.
+ */
+
+static void wsk_sha1(const u_char * data, int len, u_char * digest) {
+   u_char   msg[128];
+   u_long   h[5];
+   u_long   w[80];
+   u_long   a, b, c, d, e, f, k, t;
+   int      total;
+   int      blk;
+   int      i;
+
+   h[0] = 0x67452301UL;
+   h[1] = 0xEFCDAB89UL;
+   h[2] = 0x98BADCFEUL;
+   h[3] = 0x10325476UL;
+   h[4] = 0xC3D2E1F0UL;
+
+   /* pad to whole blocks, with the length in bits at the end */
+   total = (((len + 8) / 64) + 1) * 64;
+   memset(msg, 0, total);
+   memcpy(msg, data, len);
+   msg[len] = 0x80;
+   msg[total - 2] = (u_char)((len * 8) >> 8);
+   msg[total - 1] = (u_char)(len * 8);
+
+   for (blk = 0; blk < total; blk += 64) {
+      for (i = 0; i < 16; i++) {
+         w[i] = ((u_long)msg[blk + (i * 4)] << 24) |
+                ((u_long)msg[blk + (i * 4) + 1] << 16) |
+                ((u_long)msg[blk + (i * 4) + 2] << 8) |
+                (u_long)msg[blk + (i * 4) + 3];
+      }
+      for ( ; i < 80; i++) {
+         t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+         w[i] = WSK_ROL(t, 1);
+      }
+      a = h[0];
+      b = h[1];
+      c = h[2];
+      d = h[3];
+      e = h[4];
+      for (i = 0; i < 80; i++) {
+         if (i < 20) {
+            f = (b & c) | ((~b) & d);
+            k = 0x5A827999UL;
+         } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1UL;
+         } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDCUL;
+         } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6UL;
+         }
+         t = (WSK_ROL(a, 5) + (f & 0xffffffffUL) + e + k + w[i]) & 0xffffffffUL;
+         e = d;
+         d = c;
+         c = WSK_ROL(b, 30);
+         b = a;
+         a = t;
+      }
+      h[0] = (h[0] + a) & 0xffffffffUL;
+      h[1] = (h[1] + b) & 0xffffffffUL;
+      h[2] = (h[2] + c) & 0xffffffffUL;
+      h[3] = (h[3] + d) & 0xffffffffUL;
+      h[4] = (h[4] + e) & 0xffffffffUL;
+   }
+
+   for (i = 0; i < 20; i++) {
+      digest[i] = (u_char)(h[i / 4] >> (24 - ((i % 4) * 8)));
+   }
+}
+
+/* wsk_accept()
+ *
+ * Make the Sec-WebSocket-Accept value for a client's key: the base64
+ * of the SHA-1 of the key and the RFC's GUID. "accept" must have room
+ * for 29 bytes.
+ */
+
+static void wsk_accept(const char * key, int keylen, char * accept) {
+   u_char   buf[WSK_MAXKEY + sizeof(wsk_guid)];
+   u_char   digest[21];
+   u_long   bits;
+   int      i;
+
+   memcpy(buf, key, keylen);
+   memcpy(buf + keylen, wsk_guid, sizeof(wsk_guid) - 1);
+   wsk_sha1(buf, keylen + (int)sizeof(wsk_guid) - 1, digest);
+
+   digest[20] = 0;
+   for (i = 0; i < 21; i += 3) {
+      bits = ((u_long)digest[i] << 16) | ((u_long)digest[i + 1] << 8);
+      if (i + 2 < 20) {
+         bits |= digest[i + 2];
+      }
+      *accept++ = wsk_b64[(bits >> 18) & 0x3f];
+      *accept++ = wsk_b64[(bits >> 12) & 0x3f];
+      *accept++ = wsk_b64[(bits >> 6) & 0x3f];
+      *accept++ = (i + 2 < 20) ? wsk_b64[bits & 0x3f] : '=';
+   }
+   *accept = 0;
+}
+
+/* wsk_due() - wi_cticks "secs" from now, or 0 for never */
+
+static u_long wsk_due(int secs) {
+   u_long   due;
+
+   if (secs <= 0) {
+      return 0;
+   }
+   due = wi_cticks + (secs * TPS);
+   return due ? due : 1;      /* 0 means none */
+}
+
+/* wsk_put()
+ *
+ * Copy data to the end of the session's output, filling the last
+ * txbuf before adding another.
+ *
+ * Returns: 0 if OK, else WI_E_MEMORY.
+ */
+
+static int wsk_put(wi_sess * sess, const char * data, int len) {
+   txbuf *  tb = sess->ws_txtail;
+   int      size;
+
+   while (len > 0) {
+      if ((tb == NULL) || (tb == sess->ws_txmark) || tb->tb_ext ||
+          (tb->tb_total >= WI_TXBUFSIZE)) {
+         tb = wi_txalloc(sess);
+         if (tb == NULL) {
+            return WI_E_MEMORY;
+         }
+      }
+      size = WI_TXBUFSIZE - tb->tb_total;
+      if (size > len) {
+         size = len;
+      }
+      memcpy(tb->tb_data + tb->tb_total, data, size);
+      tb->tb_total += size;
+      data += size;
+      len -= size;
+   }
+   return 0;
+}
+
+/* wsk_frame()
+ *
+ * Queue a frame to the client. Frames from the server are not masked.
+ * One queued from outside the session's handler (e.g. by another
+ * session's) is sent on this pass.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wsk_frame(wi_sess * sess, int op, const char * data, int len) {
+   char  hdr[10];
+   int   hdrlen = 2;
+   int   error;
+
+   hdr[0] = (char)(0x80 | op);      /* FIN, all ours are whole */
+   if (len < 126) {
+      hdr[1] = (char)len;
+   } else if (len < 65536) {
+      hdr[1] = 126;
+      hdr[2] = (char)(len >> 8);
+      hdr[3] = (char)len;
+      hdrlen = 4;
+   } else {
+      hdr[1] = 127;
+      memset(&hdr[2], 0, 4);
+      hdr[6] = (char)(len >> 24);
+      hdr[7] = (char)(len >> 16);
+      hdr[8] = (char)(len >> 8);
+      hdr[9] = (char)len;
+      hdrlen = 10;
+   }
+   error = wsk_put(sess, hdr, hdrlen);
+   if ((error == 0) && (len > 0)) {
+      error = wsk_put(sess, data, len);
+   }
+   if ((sess->ws_wsflags & WSK_SERVING) == 0) {
+      wi_pushqueue(sess);
+   }
+   return error;
+}
+
+/* wsk_fail()
+ *
+ * Close the connection for the client's fault. It is dropped once
+ * the close frame is sent, the rest of its input is ignored.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wsk_fail(wi_sess * sess, int code) {
+   dprintf("websocket closed, %d\n", code);
+   sess->ws_wsflags |= WSK_CLOSERX;
+   sess->ws_wsmsg = 0;
+   sess->ws_wsop = 0;
+   sess->ws_rxsize = 0;
+   return wi_wsclose(sess, code);
+}
+
+/* wsk_control()
+ *
+ * Act on a control frame from the client. These may come between the
+ * fragments of a message.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wsk_control(wi_sess * sess, int op, const char * data, int len) {
+   switch (op) {
+   case WSK_OPPING:
+      if (sess->ws_wsflags & WSK_CLOSESENT) {
+         return 0;
+      }
+      return wsk_frame(sess, WSK_OPPONG, data, len);
+   case WSK_OPPONG:
+      return 0;      /* any input resets the ping timer */
+   case WSK_OPCLOSE:
+      /* Send the client's code back, unless we started the close */
+      sess->ws_wsflags |= WSK_CLOSERX;
+      if (sess->ws_wsflags & WSK_CLOSESENT) {
+         return 0;
+      }
+      sess->ws_wsflags |= WSK_CLOSESENT;
+      return wsk_frame(sess, WSK_OPCLOSE, data, (len >= 2) ? 2 : 0);
+   default:
+      return wsk_fail(sess, WSK_PROTOCOL);
+   }
+}
+
+/* wsk_deliver()
+ *
+ * Hand the message gathered at the front of rxbuf to the handler, then
+ * drop it from rxbuf. The message is null terminated while the handler
+ * has it. Messages which come in after we started a close are not
+ * handed over.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wsk_deliver(wi_sess * sess) {
+   char *   msg = sess->ws_rxbuf;
+   int      len = sess->ws_wsmsg;
+   char     hold;
+   int      error = 0;
+
+   hold = msg[len];
+   msg[len] = 0;
+   if ((sess->ws_wsflags & WSK_CLOSESENT) == 0) {
+      error = sess->ws_wsfunc(sess,
+         (sess->ws_wsop == WSK_OPTEXT) ? WI_WS_TEXT : WI_WS_BINARY, msg, len);
+   }
+   msg[len] = hold;
+
+   memmove(msg, msg + len, sess->ws_rxsize - len);
+   sess->ws_rxsize -= len;
+   sess->ws_wsmsg = 0;
+   sess->ws_wsop = 0;
+   return (error < 0) ? error : 0;
+}
+
+/* wsk_parse()
+ *
+ * Take the whole frames in rxbuf, past the message gathered so far.
+ * A part frame is left for the next call.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wsk_parse(wi_sess * sess) {
+   u_char * frame;
+   u_char * mask;
+   u_char * data;
+   int      avail;
+   int      hdrlen;
+   int      len;
+   int      fin;
+   int      op;
+   int      error;
+   int      i;
+
+   while ((sess->ws_state == WI_WEBSOCKET) &&
+          ((sess->ws_wsflags & WSK_CLOSERX) == 0)) {
+      frame = (u_char *)sess->ws_rxbuf + sess->ws_wsmsg;
+      avail = sess->ws_rxsize - sess->ws_wsmsg;
+      if (avail < 2) {
+         break;
+      }
+
+      /* No extensions are agreed, and clients must mask */
+      if ((frame[0] & 0x70) || ((frame[1] & 0x80) == 0)) {
+         return wsk_fail(sess, WSK_PROTOCOL);
+      }
+      fin = frame[0] & 0x80;
+      op = frame[0] & 0x0f;
+      len = frame[1] & 0x7f;
+      hdrlen = 2;
+      if (len == 126) {
+         if (avail < 4) {
+            break;
+         }
+         len = (frame[2] << 8) | frame[3];
+         hdrlen = 4;
+      } else if (len == 127) {
+         if (avail < 10) {
+            break;
+         }
+         if (frame[2] | frame[3] | frame[4] | frame[5] | (frame[6] & 0x80)) {
+            return wsk_fail(sess, WSK_TOOBIG);
+         }
+         len = (frame[6] << 24) | (frame[7] << 16) | (frame[8] << 8) | frame[9];
+         hdrlen = 10;
+      }
+      hdrlen += 4;      /* masking key */
+
+      if ((long)sess->ws_wsmsg + hdrlen + len > (WI_RXBUFSIZE - 1)) {
+         return wsk_fail(sess, WSK_TOOBIG);
+      }
+      if (avail < hdrlen + len) {
+         break;         /* wait for the rest */
+      }
+
+      mask = frame + hdrlen - 4;
+      data = frame + hdrlen;
+      for (i = 0; i < len; i++) {
+         data[i] ^= mask[i & 3];
+      }
+
+      if (op & 0x08) {
+         if (!fin || (len > 125)) {
+            return wsk_fail(sess, WSK_PROTOCOL);
+         }
+         error = wsk_control(sess, op, (char *)data, len);
+         if (sess->ws_rxsize == 0) {
+            return error;     /* wsk_fail() dropped the input */
+         }
+         memmove(frame, data + len, avail - hdrlen - len);
+         sess->ws_rxsize -= hdrlen + len;
+         if (error) {
+            return error;
+         }
+         continue;
+      }
+
+      /* A message starts with a text or binary frame, and any more
+       * of it follows in continuation frames.
+       */
+      if ((op == WSK_OPCONT) ? (sess->ws_wsop == 0) :
+          ((op > WSK_OPBINARY) || sess->ws_wsop)) {
+         return wsk_fail(sess, WSK_PROTOCOL);
+      }
+      if (op != WSK_OPCONT) {
+         sess->ws_wsop = op;
+      }
+      memmove(frame, data, avail - hdrlen);
+      sess->ws_rxsize -= hdrlen;
+      sess->ws_wsmsg += len;
+
+      if (fin) {
+         error = wsk_deliver(sess);
+         if (error) {
+            return error;
+         }
+      }
+   }
+   return 0;
+}
+
+/* wsk_rxdone()
+ *
+ * Deal with input added to rxbuf. Input is the answer to a ping, and
+ * puts off the next one.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wsk_rxdone(wi_sess * sess) {
+   int   error;
+
+   if ((sess->ws_wsflags & WSK_CLOSESENT) == 0) {
+      sess->ws_wsflags &= ~WSK_PINGED;
+      sess->ws_wsping = wsk_due(wi_pingtmo);
+   }
+   if (sess->ws_wsflags & WSK_CLOSERX) {
+      sess->ws_rxsize = 0;    /* nothing more is taken */
+   }
+   error = wsk_parse(sess);
+
+   /* Don't keep an empty receive buffer while the connection idles */
+   if (sess->ws_rxbuf && (sess->ws_rxsize == 0)) {
+      wi_rxfree(sess);
+   }
+   return error;
+}
+
+#ifndef WI_USE_URING
+
+/* wsk_input()
+ *
+ * Read from the socket into rxbuf and take the frames which are in.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wsk_input(wi_sess * sess) {
+   int   space;
+   int   len;
+
+   if ((sess->ws_rxbuf == NULL) && (wi_rxalloc(sess) == NULL)) {
+      return WI_E_MEMORY;
+   }
+   space = (WI_RXBUFSIZE - 1) - sess->ws_rxsize;
+   if (space <= 0) {
+      return wsk_fail(sess, WSK_TOOBIG);
+   }
+   len = recv(sess->ws_socket, sess->ws_rxbuf + sess->ws_rxsize, space, 0);
+   if (len < 0) {
+      if ((errno == EWOULDBLOCK) || (errno == EINTR)) {
+         return 0;
+      }
+      return wi_sockerr(sess, errno);
+   }
+   if (len == 0) {
+      sess->ws_state = WI_ENDING;   /* client went without a close frame */
+      return 0;
+   }
+   sess->ws_rxsize += len;
+   return wsk_rxdone(sess);
+}
+
+#endif   /* WI_USE_URING */
+
+/* wsk_flush() - send a WebSocket's queued output */
+
+static int wsk_flush(wi_sess * sess) {
+   if (sess->ws_txbufs == NULL) {
+      return 0;
+   }
+#ifdef WI_USE_URING
+   return wi_sockwrite(sess);    /* starts a send unless one is running */
+#else
+   if (sess->ws_flags & WF_TXBLOCKED) {
+      return 0;      /* wait until the socket is writable */
+   }
+   return wi_txflush(sess);
+#endif
+}
+
+/* wi_wsaccept()
+ *
+ * Upgrade a session to a WebSocket, with "func" as its handler. This
+ * is called by wi_readfile() for an EMF_WSOCK file. The handshake is
+ * checked as RFC 6455 section 4.2.1 says: a request which didn't ask
+ * to upgrade, or asked for a version other than 13, is refused with a
+ * 426 naming version 13; one which asked but is malformed gets a 400.
+ * The "101 Switching Protocols" reply is queued, and the handler is
+ * called with WI_WS_OPEN. Any frames the client sent behind its
+ * request are taken.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_wsaccept(wi_sess * sess, wi_wsfunc func) {
+   char  accept[32];
+   int   keylen;
+   int   len;
+   int   error;
+
+   if (func == NULL) {
+      return WI_E_BADFILE;
+   }
+   if (sess->ws_wsver < 0) {
+      wi_senderr(sess, 426);     /* not an upgrade request */
+      return WI_E_CLIENT;
+   }
+   /* A GET with "Connection: upgrade", a version and a key */
+   if ((sess->ws_wsver == 0) || (sess->ws_wskey == NULL) ||
+       (sess->ws_cmd != H_GET)) {
+      wi_senderr(sess, 400);
+      return WI_E_CLIENT;
+   }
+   keylen = (int)strlen(sess->ws_wskey);
+   if ((keylen == 0) || (keylen > WSK_MAXKEY)) {
+      wi_senderr(sess, 400);
+      return WI_E_CLIENT;
+   }
+   if (sess->ws_wsver != 13) {
+      wi_senderr(sess, 426);     /* says the version we speak */
+      return WI_E_CLIENT;
+   }
+   wsk_accept(sess->ws_wskey, keylen, accept);
+
+   /* Done with the request. Anything behind it is WebSocket frames. */
+   wi_resetsess(sess);
+   sess->ws_flags &= ~WF_PERSIST;
+   sess->ws_flags |= WF_HEADERSENT;
+   sess->ws_state = WI_WEBSOCKET;
+   sess->ws_wsfunc = func;
+   sess->ws_wsctx = NULL;
+   sess->ws_wsmsg = 0;
+   sess->ws_wsop = 0;
+   sess->ws_wsflags = WSK_SERVING;
+   sess->ws_wsping = wsk_due(wi_pingtmo);
+   wi_socktune(sess, WI_TUNE_PUSH, 0);
+
+   len = sprintf(hdrbuf, "HTTP/1.1 101 Switching Protocols\r\n"
+      "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+      "Sec-WebSocket-Accept: %s\r\nServer: %s\r\n\r\n", accept, wi_servername);
+   error = wsk_put(sess, hdrbuf, len);
+   if (error == 0) {
+      error = func(sess, WI_WS_OPEN, NULL, 0);
+   }
+   if ((error == 0) && sess->ws_rxsize) {
+      error = wsk_rxdone(sess);
+   }
+   sess->ws_wsflags &= ~WSK_SERVING;
+   return (error < 0) ? error : 0;
+}
+
+/* wi_wssend()
+ *
+ * Send a message to a WebSocket's client. "type" is WI_WS_TEXT or
+ * WI_WS_BINARY. The data is copied. This is called on the session's
+ * reactor, most often from its handler.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_wssend(wi_sess * sess, int type, const char * data, int len) {
+   if ((sess->ws_state != WI_WEBSOCKET) || (len < 0) ||
+       (sess->ws_wsflags & WSK_CLOSESENT)) {
+      return WI_E_BADPARM;
+   }
+   return wsk_frame(sess, (type == WI_WS_TEXT) ? WSK_OPTEXT : WSK_OPBINARY,
+                    data, len);
+}
+
+/* wi_wsclose()
+ *
+ * Start closing a WebSocket, with the RFC 6455 status "code" (e.g.
+ * 1000 for a normal close, or 0 for none). The session ends when the
+ * client answers with its close, or after wi_sendtmo if it doesn't.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_wsclose(wi_sess * sess, int code) {
+   char  status[2];
+
+   if ((sess->ws_state != WI_WEBSOCKET) || (sess->ws_wsflags & WSK_CLOSESENT)) {
+      return 0;
+   }
+   sess->ws_wsflags |= WSK_CLOSESENT;
+   sess->ws_wsflags &= ~(WSK_PINGDUE | WSK_PINGED);
+   sess->ws_wsping = wsk_due(wi_sendtmo);    /* for the answer */
+   status[0] = (char)(code >> 8);
+   status[1] = (char)code;
+   return wsk_frame(sess, WSK_OPCLOSE, status, code ? 2 : 0);
+}
+
+/* wi_wsserve()
+ *
+ * Run a WebSocket. "ready" is the WI_EV events on its socket. The
+ * frames which came in are taken, a ping is sent if one is due, and
+ * the output is sent. Once both sides have sent their close frames
+ * the session ends.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_wsserve(wi_sess * sess, int ready) {
+   int   error = 0;
+
+   sess->ws_wsflags |= WSK_SERVING;
+#ifdef WI_USE_URING
+   (void)ready;      /* wi_wsrecv() takes the input */
+#else
+   if (ready & WI_EVREAD) {
+      error = wsk_input(sess);
+   }
+#endif
+   if ((error == 0) && (sess->ws_wsflags & WSK_PINGDUE)) {
+      sess->ws_wsflags &= ~WSK_PINGDUE;
+      sess->ws_wsflags |= WSK_PINGED;
+      sess->ws_wsping = wsk_due(wi_pingtmo);
+      error = wsk_frame(sess, WSK_OPPING, NULL, 0);
+   }
+   if ((error == 0) && (sess->ws_state == WI_WEBSOCKET)) {
+      error = wsk_flush(sess);
+   }
+   sess->ws_wsflags &= ~WSK_SERVING;
+
+   if ((error == 0) && (sess->ws_state == WI_WEBSOCKET) &&
+       ((sess->ws_wsflags & (WSK_CLOSESENT | WSK_CLOSERX)) ==
+        (WSK_CLOSESENT | WSK_CLOSERX)) && (sess->ws_txbufs == NULL)) {
+      sess->ws_state = WI_ENDING;
+   }
+   return error;
+}
+
+/* wi_wsrecv()
+ *
+ * Take "len" bytes of input which the io_uring backend received for a
+ * WebSocket. They are added to rxbuf as the frames in it are taken.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_wsrecv(wi_sess * sess, const char * data, int len) {
+   int   space;
+   int   error = 0;
+
+   sess->ws_wsflags |= WSK_SERVING;
+   while ((len > 0) && (error == 0) && (sess->ws_state == WI_WEBSOCKET)) {
+      if ((sess->ws_rxbuf == NULL) && (wi_rxalloc(sess) == NULL)) {
+         error = WI_E_MEMORY;
+         break;
+      }
+      space = (WI_RXBUFSIZE - 1) - sess->ws_rxsize;
+      if (space <= 0) {
+         error = wsk_fail(sess, WSK_TOOBIG);
+         continue;
+      }
+      if (space > len) {
+         space = len;
+      }
+      memcpy(sess->ws_rxbuf + sess->ws_rxsize, data, space);
+      sess->ws_rxsize += space;
+      data += space;
+      len -= space;
+      error = wsk_rxdone(sess);
+   }
+   sess->ws_wsflags &= ~WSK_SERVING;
+   return error;
+}
+
+/* wi_wsexpire()
+ *
+ * Called when a WebSocket's session timer goes off. If it is quiet,
+ * that is the time to ping it.
+ *
+ * Returns: TRUE if a ping will be sent on this pass, FALSE if the
+ * session timed out sending, answering a ping, or closing.
+ */
+
+int wi_wsexpire(wi_sess * sess) {
+   if (sess->ws_txbufs ||
+       (sess->ws_wsflags & (WSK_PINGED | WSK_CLOSESENT))) {
+      return FALSE;
+   }
+   sess->ws_wsflags |= WSK_PINGDUE;
+   wi_pushqueue(sess);
+   return TRUE;
+}
+
+/* wi_wsend()
+ *
+ * Let a WebSocket's handler free its context when its session is
+ * deleted. Called by wi_delsess().
+ */
+
+void wi_wsend(wi_sess * sess) {
+   if (sess->ws_wsfunc) {
+      sess->ws_state = WI_ENDING;
+      sess->ws_wsfunc(sess, WI_WS_CLOSE, NULL, 0);
+      sess->ws_wsfunc = NULL;
+   }
+}
@@ -0,0 +1,260 @@
+/* websse.c
+ *
+ * Part of the Webio Open Source lightweight web server.
+ *
+ * Copyright (c) 2007 by John Bartas
+ * All rights reserved.
+ *
+ * Use license: Modified from standard BSD license.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation, advertising
+ * materials, Web server pages, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by John Bartas. The name "John Bartas" may not be used to
+ * endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "websys.h"
+#include "webio.h"
+
+#include <string.h>
+
+#ifdef LINUX
+#include <pthread.h>
+#endif
+
+/* This file contains the server-sent event streams. An EMF_SSE file
+ * is answered with a text/event-stream reply which the server keeps
+ * going by itself: the application only calls wi_ssesend(), from any
+ * thread. Each event is formatted once and goes to the stream's
+ * readers as a broadcast frame (see wi_publish()), with an id so a
+ * client which reconnects gets what it missed from the replay ring.
+ * An idle stream gets a comment line now and then to keep proxies
+ * from closing it, and small events sent close together may be held
+ * a little to go out in one write.
+ *
+ * A reader which falls too far behind has its reply ended. The client
+ * reconnects by itself, with the id of the last event it saw.
+ */
+
+#ifndef WI_SSEMAX
+#define WI_SSEMAX       2048  /* longest formatted event */
+#endif
+
+#define WSE_RING        64    /* default events kept, also the most */
+#define WSE_BEAT        15    /* default seconds between comments */
+#define WSE_HOLD        100   /* default msecs events may be held */
+
+/* setting "value" with 0 = default "def", -1 = off */
+#define WSE_SETTING(value, def)  (((value) == 0) ? (def) : (((value) < 0) ? 0 : (value)))
+
+#ifdef LINUX
+static pthread_mutex_t  wse_lock = PTHREAD_MUTEX_INITIALIZER;
+#define WSE_LOCK()      pthread_mutex_lock(&wse_lock)
+#define WSE_UNLOCK()    pthread_mutex_unlock(&wse_lock)
+#else
+#define WSE_LOCK()
+#define WSE_UNLOCK()
+#endif
+
+/* wse_chan()
+ *
+ * Get a stream's channel, making it on first use. Called with
+ * WSE_LOCK held.
+ *
+ * Returns: the channel, or NULL if out of memory.
+ */
+
+static wi_chan * wse_chan(wi_sse * stream) {
+   wi_chan *   chan;
+   int   ring;
+
+   if (stream->se_chan) {
+      return stream->se_chan;
+   }
+   ring = WSE_SETTING(stream->se_ring, WSE_RING);
+   if (ring > WSE_RING) {
+      ring = WSE_RING;
+   }
+
+   /* Leave room for a whole replay ahead of new events */
+   chan = wi_chancreate(WI_CAST_CLOSE, (ring * 2) + 1);
+   if (chan == NULL) {
+      return NULL;
+   }
+   if (ring > 0) {
+      if (wi_chanreplay(chan, ring)) {
+         wi_chanfree(chan);   /* out of memory, try again next time */
+         return NULL;
+      }
+   }
+   wi_chanhold(chan, WSE_SETTING(stream->se_hold, WSE_HOLD));
+   stream->se_chan = chan;
+   return chan;
+}
+
+/* wse_beat()
+ *
+ * Set the push timer for the stream's next comment, which is due once
+ * the session has been idle for the heartbeat time. If it is due now,
+ * send it.
+ */
+
+static void wse_beat(wi_sess * sess, wi_sse * stream) {
+   long  beat;
+   long  idle;
+
+   beat = WSE_SETTING(stream->se_heartbeat, WSE_BEAT) * TPS;
+   if (beat == 0) {
+      return;
+   }
+   idle = (long)(wi_cticks - sess->ws_last);
+   if (idle >= beat) {
+      wi_printf(sess, ":\n\n");
+      idle = 0;
+   }
+   wi_pushtimer(sess, ((beat - idle) * 1000) / TPS);
+}
+
+/* wse_push() - continuation for an event stream's session */
+
+static int wse_push(wi_sess * sess, void * ctx, int event) {
+   wi_sse * stream = (wi_sse *)ctx;
+   int      error;
+
+   switch (event) {
+   case WI_PUSH_WRITE:     /* first call, the reply header goes after it */
+      if (stream->se_retry > 0) {
+         wi_printf(sess, "retry: %d\n\n", stream->se_retry);
+      }
+      error = wi_subscribefrom(sess, stream->se_chan, sess->ws_lastevent);
+      if (error) {
+         return error;
+      }
+      wse_beat(sess, stream);
+      break;
+   case WI_PUSH_TIMER:
+      wse_beat(sess, stream);
+      break;
+   default:
+      break;
+   }
+   return WI_PUSH_WAIT;
+}
+
+/* wi_ssestart()
+ *
+ * Answer a request for an EMF_SSE file with its event stream. Called
+ * from wi_readfile() with the session in WI_PUSHING.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_ssestart(wi_sess * sess, wi_sse * stream) {
+   wi_chan *   chan;
+
+   if (stream == NULL) {
+      return WI_E_BADFILE;
+   }
+   WSE_LOCK();
+   chan = wse_chan(stream);
+   WSE_UNLOCK();
+   if (chan == NULL) {
+      return WI_E_MEMORY;
+   }
+   sess->ws_ftype = "text/event-stream";
+   return wi_pushstart(sess, wse_push, stream);
+}
+
+/* wse_format()
+ *
+ * Build an event in "buf". Each line of "data" goes on a data line of
+ * its own.
+ *
+ * Returns: length of the event, or -1 if it does not fit.
+ */
+
+static int wse_format(char * buf, int size, u_long id, const char * event,
+   const char * data)
+{
+   char *   cp = buf;
+   char *   end = buf + size;
+   int      len;
+
+   cp += sprintf(cp, "id: %lu\n", id);
+   if (event) {
+      len = strlen(event);
+      if ((cp + len + 8) > end) {
+         return -1;
+      }
+      cp += sprintf(cp, "event: %s\n", event);
+   }
+   for (;;) {
+      len = strcspn(data, "\r\n");
+      if ((cp + len + 9) > end) {   /* "data: ", newline, blank line */
+         return -1;
+      }
+      memcpy(cp, "data: ", 6);
+      memcpy(cp + 6, data, len);
+      cp += 6 + len;
+      *cp++ = '\n';
+      data += len;
+      if (*data == 0) {
+         break;
+      }
+      if ((data[0] == '\r') && (data[1] == '\n')) {
+         data++;
+      }
+      data++;
+   }
+   *cp++ = '\n';
+   return (int)(cp - buf);
+}
+
+/* wi_ssesend()
+ *
+ * Send an event to everyone reading a stream. "event" is its type, or
+ * NULL for the default "message". It may be called from any thread,
+ * and events go out in the order sent.
+ *
+ * Returns: 0 if OK, else negative WI_E_ error code.
+ */
+
+int wi_ssesend(wi_sse * stream, const char * event, const char * data) {
+   char        buf[WI_SSEMAX];
+   wi_chan *   chan;
+   u_long      id;
+   int   len;
+   int   error;
+
+   if ((stream == NULL) || (data == NULL) ||
+       (event && strpbrk(event, "\r\n"))) {
+      return WI_E_BADPARM;
+   }
+   WSE_LOCK();
+   chan = wse_chan(stream);
+   if (chan == NULL) {
+      WSE_UNLOCK();
+      return WI_E_MEMORY;
+   }
+   id = stream->se_lastid + 1;
+   len = wse_format(buf, sizeof(buf), id, event, data);
+   if (len < 0) {
+      WSE_UNLOCK();
+      return WI_E_BADPARM;
+   }
+   error = wi_publishid(chan, id, buf, len);
+   if (error == 0) {
+      stream->se_lastid = id;
+   }
+   WSE_UNLOCK();
+   return error;
+}
@@ -25,13 +25,30 @@
 #include "websys.h"
 #include "webio.h"
 
+#include <string.h>
+
 /* This file contains the routines which change from OS to OS 
  * These are:
  *
  * WI_NOBLOCKSOCK(socktype sock) - set a socket to non-blocking mode
+ * wi_socktune(sess, profile, size) - set a connection's TCP options
  *
  */
 
+/* Clock ticks (TPS per second) since some arbitrary start. This is read
+ * from a monotonic clock, so it doesn't jump when the date is set.
+ * Every reactor ticks its own copy at the top of its pass.
+ */
+WI_TLS u_long   wi_cticks;
+WI_TLS u_long   wi_cmsecs;      /* the same clock in milliseconds */
+
+/* Connection TCP options. May be changed at any time, they take effect
+ * on the next connection or reply.
+ */
+int   wi_nodelay = 1;               /* TCP_NODELAY on connections */
+int   wi_sndbufmax = 512 * 1024;    /* size SO_SNDBUF for files up to this */
+int   wi_pushlowat = 16 * 1024;     /* TCP_NOTSENT_LOWAT for server push */
+
 static char * day[] = 
 {   "Sun","Mon","Tue","Wed","Thu","Fri","Sat"};
 
@@ -51,7 +68,7 @@ int WI_NOBLOCKSOCK(long sock) {
 
 /* format: "Mon, 26 Feb 2007 01:43:54 GMT" */
 
-static char datebuf[36];
+static WI_TLS char datebuf[36];
 
 #include <time.h>
 
@@ -75,11 +92,32 @@ char * wi_getdate(wi_sess * sess) {
    return datebuf;
 }
 
+void wi_clocktick(void) {
+   wi_cmsecs = GetTickCount();
+   wi_cticks = wi_cmsecs / (1000 / TPS);
+}
+
+/* Winsock has no cork or send low water mark, only Nagle is changed */
+
+int wi_socktune(wi_sess * sess, int profile, long size) {
+   BOOL  opt = TRUE;
+
+   (void)size;
+   if ((profile == WI_TUNE_ACCEPT) && !wi_nodelay) {
+      return 0;
+   }
+   if ((profile == WI_TUNE_ACCEPT) || (profile == WI_TUNE_PUSH)) {
+      return setsockopt((SOCKET)sess->ws_socket, IPPROTO_TCP, TCP_NODELAY,
+                        (char *)&opt, sizeof(opt)) ? -1 : 0;
+   }
+   return 0;
+}
+
 #endif /* _WINSOCKAPI_ */
 
 #ifdef LINUX
 
-static char datebuf[36];
+static WI_TLS char datebuf[36];
 
 #include <time.h>
 
@@ -103,6 +141,95 @@ char * wi_getdate(wi_sess * sess) {
    return datebuf;
 }
 
+void wi_clocktick(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   wi_cticks = ((u_long)ts.tv_sec * TPS) + (ts.tv_nsec / (1000000000 / TPS));
+   wi_cmsecs = ((u_long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/* wi_socktune()
+ *
+ * Set a connection's TCP options for what it is about to do:
+ *
+ * WI_TUNE_ACCEPT - new connection. Nagle is turned off (wi_nodelay).
+ *    Replies are built whole and sent in gather writes, so Nagle only
+ *    holds back the last segment of each one for a delayed ACK.
+ * WI_TUNE_BINARY - start of a file reply of "size" bytes. The socket
+ *    is corked so the header goes out in the same segment as the start
+ *    of the file. A file of up to wi_sndbufmax bytes gets a send buffer
+ *    it fits in; bigger ones are left to the kernel's autotuning.
+ * WI_TUNE_DONE - reply finished. Uncork, so its tail goes out now.
+ * WI_TUNE_PUSH - session handed to server push. Nagle is turned off,
+ *    and TCP_NOTSENT_LOWAT (wi_pushlowat) keeps the socket from taking
+ *    more than a little unsent data, so new updates are not queued
+ *    behind stale ones.
+ *
+ * A failure is not fatal, the connection just runs untuned.
+ *
+ * Returns: 0 if the options were set, else -1.
+ */
+
+int wi_socktune(wi_sess * sess, int profile, long size) {
+   int   sock = (int)sess->ws_socket;
+   int   error = 0;
+   int   opt;
+   socklen_t optlen;
+
+   if (sess->ws_flags & WF_UNIX) {
+      return 0;      /* no TCP options on a unix domain socket */
+   }
+
+   switch (profile) {
+   case WI_TUNE_ACCEPT:
+      if (wi_nodelay) {
+         opt = 1;
+         error = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+      }
+      break;
+   case WI_TUNE_BINARY:
+      if ((size > 0) && (size <= wi_sndbufmax)) {
+         optlen = sizeof(opt);
+         if ((getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opt, &optlen) == 0) &&
+             (opt < size)) {
+            opt = (int)size;
+            error = setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt));
+         }
+      }
+      opt = 1;
+      if (setsockopt(sock, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt)) == 0) {
+         sess->ws_flags |= WF_CORKED;
+      } else {
+         error = -1;
+      }
+      break;
+   case WI_TUNE_DONE:
+      if (sess->ws_flags & WF_CORKED) {
+         opt = 0;
+         error = setsockopt(sock, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+         sess->ws_flags &= ~WF_CORKED;
+      }
+      break;
+   case WI_TUNE_PUSH:
+      opt = 1;
+      error = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef TCP_NOTSENT_LOWAT
+      if (wi_pushlowat > 0) {
+         opt = wi_pushlowat;
+         error |= setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                             &opt, sizeof(opt));
+      }
+#endif
+      break;
+   }
+   if (error) {
+      dprintf("wi_socktune %d: %s\n", profile, strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
 int strnicmp(char * s1, char * s2, int length) {
     int i;
     for (i = 0; i < length; i++) {
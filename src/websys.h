@@ -40,6 +40,10 @@
 
 #ifdef LINUX
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* for accept4() */
+#endif
+
 #define socktype  long
 
 typedef unsigned long u_long;
@@ -48,7 +52,40 @@ typedef unsigned long u_long;
 #include <errno.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>     /* AF_UNIX listeners */
 #include <fcntl.h>
+#include <sys/uio.h>    /* struct iovec, for gather writes */
+
+#ifdef WI_USE_URING
+#undef WI_USE_EPOLL     /* io_uring replaces the epoll() backend */
+#undef WI_USE_ZEROCOPY  /* ring sends are not zero copy */
+#endif
+
+#ifdef WI_USE_ZEROCOPY
+#include <linux/errqueue.h>   /* zero copy completions */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY  60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif   /* WI_USE_ZEROCOPY */
+
+#ifdef WI_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef WI_USE_REACTORS
+#include <pthread.h>
+#define WI_TLS   __thread    /* one copy of the variable per reactor thread */
+#endif
 
 #ifdef WI_USE_MALLOC
 #include <malloc.h>
@@ -56,7 +93,12 @@ typedef unsigned long u_long;
 
 #define WI_NOBLOCKSOCK(socket) fcntl(socket, F_SETFL, O_NONBLOCK)
 
+#ifdef WI_USE_URING
+int wu_closesocket(socktype sock);
+#define closesocket(socket) wu_closesocket(socket)
+#else
 #define closesocket(socket) close(socket)
+#endif
 
 /* Hard to believe the Posix kids renamed stricmp() */
 #ifndef stricmp
@@ -67,11 +109,9 @@ typedef unsigned long u_long;
 int strnicmp(char * s1, char * s2, int length);
 #endif
 
-#ifdef LINUX_DEMO
-
-extern u_long wi_cticks;
 #define TPS	10		// ticks per second
 
+#ifdef LINUX_DEMO
 
 #define TH_SLEEP(ticks) usleep(ticks * 100000)
 
@@ -93,7 +133,6 @@ extern u_long wi_cticks;
 #define socktype  long
 extern int WI_NOBLOCKSOCK(socktype sock);
 
-extern u_long wi_cticks;
 #define TPS 10
 #define TH_SLEEP( ticks ) Sleep(ticks)
 
@@ -134,6 +173,31 @@ extern u_long wi_cticks;
 
 /*********** Macros to system code ***************/
 
+/* Storage class for per-reactor data, such as the session list and
+ * object pools. Without reactor threads these are plain globals.
+ */
+#ifndef WI_TLS
+#define WI_TLS
+#endif
+
+/* Each reactor keeps its own clock, so the passes don't race */
+extern WI_TLS u_long wi_cticks;  /* monotonic clock, see wi_clocktick() */
+extern WI_TLS u_long wi_cmsecs;  /* same clock in milliseconds */
+
+/* send() flag to say more data follows. Only a hint, not all stacks have it */
+#ifndef MSG_MORE
+#define MSG_MORE  0
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Refresh wi_cticks and wi_cmsecs from the system's monotonic clock.
+ * The poll loop calls this once per pass.
+ */
+extern void wi_clocktick(void);
+
 #ifdef WI_USE_MALLOC
 
 /* Map Webio heap routine to system's */
@@ -150,6 +214,9 @@ struct wi_sess_s;
 struct wi_sess_s * wi_get_sess_slot(void);
 void wi_free_sess_slot(struct wi_sess_s * oldsess);
 
+char * wi_get_rxbuf_slot(void);
+void wi_free_rxbuf_slot(char * oldrxbuf);
+
 struct wi_form_s;
 struct wi_form_s * wi_get_form_slot(void);
 void wi_free_form_slot(struct wi_form_s * oldform);
@@ -176,6 +243,7 @@ extern void wi_dtrap();
 #endif
 
 #include <stdarg.h>
+#include <signal.h>   /* sig_atomic_t, for wi_shutdown() */
 
 void wi_panic(char * msg);
 
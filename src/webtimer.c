@@ -0,0 +1,348 @@
+/* webtimer.c
+ *
+ * Part of the Webio Open Source lightweight web server.
+ *
+ * Copyright (c) 2007 by John Bartas
+ * All rights reserved.
+ *
+ * Use license: Modified from standard BSD license.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation, advertising
+ * materials, Web server pages, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by John Bartas. The name "John Bartas" may not be used to
+ * endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "websys.h"
+#include "webio.h"
+
+/* This file contains the session timers. Every session has one timer,
+ * set to the deadline for the state the session is in. The timers are
+ * kept in a two level "timer wheel", so setting or clearing a timer
+ * takes constant time and wi_timercheck() only touches the timers
+ * which expire (plus, once every WT_SIZE ticks, the timers moved down
+ * from the upper level).
+ *
+ * Level 0 has a slot for each of the next WT_SIZE clock ticks. Level 1
+ * has a slot for each WT_SIZE ticks after that; when level 0 wraps,
+ * the next level 1 slot is spread out over level 0. Deadlines further
+ * out than level 1 can hold are parked in its last slot and re-filed
+ * when they come down.
+ *
+ * Each reactor has its own wheel, as it has its own sessions.
+ */
+
+/* Session timeouts, in seconds. May be changed at any time, they take
+ * effect as sessions change state.
+ */
+int   wi_hdrtmo = 10;               /* receive a complete request header */
+int   wi_idletmo = 15;              /* no progress reading POST data or making a reply */
+int   wi_sendtmo = 15;              /* no progress sending the reply */
+int   wi_persisttmo = WI_PERSISTTMO;   /* idle persistent connection */
+int   wi_pingtmo = 30;              /* idle WebSocket is pinged, and must answer, 0 = never */
+
+WI_TLS u_long  wi_timeouts = 0;     /* sessions deleted by their timer */
+
+#define WT_BITS      8
+#define WT_SIZE      (1 << WT_BITS)    /* slots per level */
+#define WT_MASK      (WT_SIZE - 1)
+
+/* Slot list heads. An empty slot is a head which points to itself. */
+static WI_TLS wi_timer  wt_wheel[2][WT_SIZE];
+static WI_TLS u_long    wt_now;        /* last tick processed */
+static WI_TLS int       wt_timers = -1;   /* timers set, -1 if wheel not set up */
+
+/* wt_init() - set up the calling reactor's wheel on first use */
+
+static void wt_init(void) {
+   int   level;
+   int   i;
+
+   for (level = 0; level < 2; level++) {
+      for (i = 0; i < WT_SIZE; i++) {
+         wt_wheel[level][i].tm_next = &wt_wheel[level][i];
+         wt_wheel[level][i].tm_prev = &wt_wheel[level][i];
+      }
+   }
+   wt_now = wi_cticks;
+   wt_timers = 0;
+}
+
+/* wt_insert() - file a timer in the slot for its expiry tick */
+
+static void wt_insert(wi_timer * tm) {
+   wi_timer *  head;
+   long        delta;
+
+   delta = (long)(tm->tm_expires - wt_now);
+   if (delta <= 0) {
+      head = &wt_wheel[0][(wt_now + 1) & WT_MASK];    /* fire on next tick */
+   } else if (delta < WT_SIZE) {
+      head = &wt_wheel[0][tm->tm_expires & WT_MASK];
+   } else if (delta < (WT_SIZE * WT_SIZE)) {
+      head = &wt_wheel[1][(tm->tm_expires >> WT_BITS) & WT_MASK];
+   } else {    /* too far out, park it in the last slot */
+      head = &wt_wheel[1][((wt_now >> WT_BITS) - 1) & WT_MASK];
+   }
+
+   tm->tm_next = head;
+   tm->tm_prev = head->tm_prev;
+   head->tm_prev->tm_next = tm;
+   head->tm_prev = tm;
+}
+
+/* wt_unlink() - take a timer out of its slot */
+
+static void wt_unlink(wi_timer * tm) {
+   tm->tm_prev->tm_next = tm->tm_next;
+   tm->tm_next->tm_prev = tm->tm_prev;
+   tm->tm_next = tm->tm_prev = NULL;
+}
+
+/* wi_timerset()
+ *
+ * Set a session's timer to go off at clock tick "expires", replacing
+ * any earlier setting.
+ */
+
+void wi_timerset(wi_sess * sess, u_long expires) {
+   wi_timer *  tm = &sess->ws_timer;
+
+   if (wt_timers < 0) {
+      wt_init();
+   }
+   if (tm->tm_next) {
+      if (tm->tm_expires == expires) {
+         return;     /* already set */
+      }
+      wt_unlink(tm);
+      wt_timers--;
+   }
+   tm->tm_sess = sess;
+   tm->tm_expires = expires;
+   wt_insert(tm);
+   wt_timers++;
+}
+
+/* wi_timerclear() - stop a session's timer, if it is set */
+
+void wi_timerclear(wi_sess * sess) {
+   if (sess->ws_timer.tm_next) {
+      wt_unlink(&sess->ws_timer);
+      wt_timers--;
+   }
+}
+
+/* wi_timerupdate()
+ *
+ * Set a session's timer for the deadline of the state it is in. This
+ * is called whenever the poll loop has run the session. Timeouts which
+ * measure "no progress" run from the session's last activity.
+ */
+
+void wi_timerupdate(wi_sess * sess) {
+   u_long   expires;
+
+   switch (sess->ws_state) {
+   case WI_HEADER:
+      if ((sess->ws_rxsize == 0) && (sess->ws_flags & WF_PERSIST)) {
+         /* waiting for the next request on a persistent connection */
+         expires = sess->ws_last + (wi_persisttmo * TPS);
+      } else {
+         expires = sess->ws_reqstart + (wi_hdrtmo * TPS);
+
+         /* Once it has started, past the grace time the header must
+          * keep coming at wi_hdrminrate. Each byte moves this deadline
+          * out a bit. A connection which has sent nothing yet just
+          * gets wi_hdrtmo.
+          */
+         if ((wi_hdrminrate > 0) && (sess->ws_rxsize > 0)) {
+            u_long   slow;
+
+            slow = sess->ws_reqstart + (wi_hdrgrace * TPS) +
+               (((u_long)sess->ws_rxsize * TPS) / wi_hdrminrate);
+            if ((long)(slow - expires) < 0) {
+               expires = slow;
+            }
+         }
+      }
+      break;
+   case WI_POSTRX:
+   case WI_CONTENT:
+      expires = sess->ws_last + (wi_idletmo * TPS);
+      break;
+   case WI_SENDDATA:
+      expires = sess->ws_last + (wi_sendtmo * TPS);
+      break;
+   case WI_PUSHING:
+      if (sess->ws_pushfunc) {
+         /* A push with a continuation must keep its output moving.
+          * With none unsent, it waits on its own timer if it has one.
+          * Broadcast frames being held go when the hold is up.
+          */
+         if (sess->ws_castdue) {
+            expires = sess->ws_castdue;
+         } else if (sess->ws_txbufs) {
+            expires = sess->ws_last + (wi_sendtmo * TPS);
+         } else if (sess->ws_pushdue) {
+            expires = sess->ws_pushdue;
+         } else {
+            wi_timerclear(sess);
+            return;
+         }
+         break;
+      }
+      /* The push routine owns the session. Look in once a second to
+       * see if it has ended it.
+       */
+      expires = wi_cticks + TPS;
+      break;
+   case WI_WEBSOCKET:
+      /* Output must keep moving. With none unsent, the connection is
+       * pinged when it has been quiet a while, and must answer.
+       */
+      if (sess->ws_txbufs) {
+         expires = sess->ws_last + (wi_sendtmo * TPS);
+      } else if (sess->ws_wsping) {
+         expires = sess->ws_wsping;
+      } else {
+         wi_timerclear(sess);
+         return;
+      }
+      break;
+   case WI_PARKED:
+      expires = sess->ws_parkdue;   /* the long poll is answered then */
+      break;
+   default:
+      wi_timerclear(sess);
+      return;
+   }
+   wi_timerset(sess, expires);
+}
+
+/* wt_expire() - a session's timer went off */
+
+static void wt_expire(wi_sess * sess) {
+   switch (sess->ws_state) {
+   case WI_PUSHING:
+      if (sess->ws_pushfunc == NULL) {
+         wi_timerupdate(sess);   /* still pushing, look again later */
+         break;
+      }
+      if (wi_pushexpire(sess)) {
+         break;      /* the push's own timer, it is run on this pass */
+      }
+      dprintf("push send timeout\n");
+      wi_timeouts++;
+      wi_delsess(sess);
+      break;
+   case WI_WEBSOCKET:
+      if (wi_wsexpire(sess)) {
+         break;      /* time for a ping, it is run on this pass */
+      }
+      dprintf("websocket timeout\n");
+      wi_timeouts++;
+      wi_delsess(sess);
+      break;
+   case WI_PARKED:
+      wi_parkexpire(sess);    /* not a timeout, its handler answers */
+      break;
+   case WI_ENDING:
+      wi_delsess(sess);
+      break;
+   default:
+      dprintf("session timeout in state %d\n", sess->ws_state);
+      wi_timeouts++;
+      wi_delsess(sess);
+      break;
+   }
+}
+
+/* wi_timercheck()
+ *
+ * Bring the calling reactor's wheel up to wi_cticks, handling every
+ * timer which expires on the way. An expired session is deleted.
+ *
+ * Returns: number of timers which expired.
+ */
+
+int wi_timercheck(void) {
+   wi_timer *  head;
+   wi_timer *  tm;
+   int   expired = 0;
+
+   if (wt_timers < 0) {
+      wt_init();
+   }
+
+   while ((long)(wi_cticks - wt_now) > 0) {
+      wt_now++;
+
+      /* Level 0 wrapped, spread out the next level 1 slot */
+      if ((wt_now & WT_MASK) == 0) {
+         head = &wt_wheel[1][(wt_now >> WT_BITS) & WT_MASK];
+         while (head->tm_next != head) {
+            tm = head->tm_next;
+            wt_unlink(tm);
+            wt_insert(tm);
+         }
+      }
+
+      head = &wt_wheel[0][wt_now & WT_MASK];
+      while (head->tm_next != head) {
+         tm = head->tm_next;
+         wt_unlink(tm);
+         wt_timers--;
+         expired++;
+         wt_expire(tm->tm_sess);
+      }
+   }
+   return expired;
+}
+
+/* wi_timerwait()
+ *
+ * Figure out how long the poll backend may wait for events without
+ * making a timer late.
+ *
+ * Returns: "msecs", or the milliseconds to the next timer if sooner.
+ */
+
+long wi_timerwait(long msecs) {
+   wi_timer *  head;
+   long  ticks;
+   int   i;
+
+   if (wt_timers <= 0) {
+      return msecs;
+   }
+
+   /* Look for the next busy level 0 slot. If there is none, the next
+    * level 1 slot comes down when level 0 wraps.
+    */
+   ticks = WT_SIZE - (long)(wt_now & WT_MASK);
+   for (i = 1; i < ticks; i++) {
+      head = &wt_wheel[0][(wt_now + i) & WT_MASK];
+      if (head->tm_next != head) {
+         ticks = i;
+         break;
+      }
+   }
+   ticks -= (long)(wi_cticks - wt_now);   /* ticks we are behind */
+   if (ticks <= 0) {
+      return 0;
+   }
+   if ((ticks * (1000 / TPS)) < msecs) {
+      return ticks * (1000 / TPS);
+   }
+   return msecs;
+}
@@ -0,0 +1,787 @@
+/* weburing.c
+ *
+ * Part of the Webio Open Source lightweight web server.
+ *
+ * Copyright (c) 2007 by John Bartas
+ * All rights reserved.
+ *
+ * Use license: Modified from standard BSD license.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation, advertising
+ * materials, Web server pages, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by John Bartas. The name "John Bartas" may not be used to
+ * endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#include "websys.h"
+#include "webio.h"
+#include "webfs.h"
+#include "weburing.h"
+
+#ifdef WI_USE_URING
+
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* This file contains the io_uring I/O engine. Rather than waiting for
+ * socket readiness and then making a system call per operation, the
+ * engine queues accepts, receives, sends and binary file reads as ring
+ * requests. All the requests queued during a pass of wi_poll() go to
+ * the kernel in one io_uring_enter() call, which also collects the
+ * completions. The ring is set up with the raw system calls, so
+ * liburing is not needed.
+ *
+ * Each reactor thread has its own ring. Accepts and receives are
+ * "multishot" requests which stay active across many completions.
+ * Received data lands in a ring of provided buffers and is copied to
+ * the session's rxbuf, so idle connections don't tie up buffers.
+ */
+
+typedef struct wu_ring_s {
+   int         wu_fd;            /* ring descriptor, -1 if not open */
+
+   unsigned *  wu_sqhead;        /* submission queue, shared with kernel */
+   unsigned *  wu_sqtail;
+   unsigned    wu_sqmask;
+   unsigned    wu_sqentries;
+   unsigned    wu_sqlocal;       /* our tail, ahead of *wu_sqtail */
+   struct io_uring_sqe * wu_sqes;
+
+   unsigned *  wu_cqhead;        /* completion queue, shared with kernel */
+   unsigned *  wu_cqtail;
+   unsigned    wu_cqmask;
+   struct io_uring_cqe * wu_cqes;
+
+   struct io_uring_buf_ring * wu_br;   /* provided receive buffers */
+   unsigned short wu_brtail;
+   char *      wu_bufs;
+
+   void *      wu_sqmap;         /* mappings, for wu_cleanup() */
+   size_t      wu_sqmaplen;
+   void *      wu_cqmap;
+   size_t      wu_cqmaplen;
+} wu_ring;
+
+static WI_TLS wu_ring wu = { -1 };
+
+#define WU_BGID      0        /* buffer group ID of receive buffers */
+
+/* wu_setup()
+ *
+ * Map the rings of the newly created ring descriptor "fd".
+ *
+ * Returns 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wu_setup(int fd, struct io_uring_params * p) {
+   unsigned *  array;
+   unsigned    i;
+
+   wu.wu_sqmaplen = p->sq_off.array + (p->sq_entries * sizeof(unsigned));
+   wu.wu_cqmaplen = p->cq_off.cqes + (p->cq_entries * sizeof(struct io_uring_cqe));
+   if (p->features & IORING_FEAT_SINGLE_MMAP) {
+      if (wu.wu_cqmaplen > wu.wu_sqmaplen) {
+         wu.wu_sqmaplen = wu.wu_cqmaplen;
+      }
+      wu.wu_cqmaplen = wu.wu_sqmaplen;
+   }
+
+   wu.wu_sqmap = mmap(NULL, wu.wu_sqmaplen, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+   if (wu.wu_sqmap == MAP_FAILED) {
+      wu.wu_sqmap = NULL;
+      return WI_E_MEMORY;
+   }
+   if (p->features & IORING_FEAT_SINGLE_MMAP) {
+      wu.wu_cqmap = wu.wu_sqmap;
+   } else {
+      wu.wu_cqmap = mmap(NULL, wu.wu_cqmaplen, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (wu.wu_cqmap == MAP_FAILED) {
+         wu.wu_cqmap = NULL;
+         return WI_E_MEMORY;
+      }
+   }
+   wu.wu_sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+   if (wu.wu_sqes == MAP_FAILED) {
+      wu.wu_sqes = NULL;
+      return WI_E_MEMORY;
+   }
+
+   wu.wu_sqhead = (unsigned *)((char *)wu.wu_sqmap + p->sq_off.head);
+   wu.wu_sqtail = (unsigned *)((char *)wu.wu_sqmap + p->sq_off.tail);
+   wu.wu_sqmask = *(unsigned *)((char *)wu.wu_sqmap + p->sq_off.ring_mask);
+   wu.wu_sqentries = p->sq_entries;
+   wu.wu_sqlocal = *wu.wu_sqtail;
+
+   /* SQEs are always used in ring order, so the index array is fixed */
+   array = (unsigned *)((char *)wu.wu_sqmap + p->sq_off.array);
+   for (i = 0; i < p->sq_entries; i++) {
+      array[i] = i;
+   }
+
+   wu.wu_cqhead = (unsigned *)((char *)wu.wu_cqmap + p->cq_off.head);
+   wu.wu_cqtail = (unsigned *)((char *)wu.wu_cqmap + p->cq_off.tail);
+   wu.wu_cqmask = *(unsigned *)((char *)wu.wu_cqmap + p->cq_off.ring_mask);
+   wu.wu_cqes = (struct io_uring_cqe *)((char *)wu.wu_cqmap + p->cq_off.cqes);
+
+   return 0;
+}
+
+/* wu_bufadd() - give receive buffer "bid" to the kernel. */
+
+static void wu_bufadd(int bid) {
+   struct io_uring_buf * buf;
+
+   buf = &wu.wu_br->bufs[wu.wu_brtail & (WU_NBUFS - 1)];
+   buf->addr = (unsigned long)(wu.wu_bufs + (bid * WU_BUFSIZE));
+   buf->len = WU_BUFSIZE;
+   buf->bid = (unsigned short)bid;
+   wu.wu_brtail++;
+   __atomic_store_n(&wu.wu_br->tail, wu.wu_brtail, __ATOMIC_RELEASE);
+}
+
+/* wu_init()
+ *
+ * Create the calling reactor's ring and register its receive buffers.
+ * This does nothing if the ring is already open.
+ *
+ * Returns 0 if OK, else negative WI_E_ error code.
+ */
+
+int wu_init(void) {
+   struct io_uring_params  params;
+   struct io_uring_buf_reg reg;
+   int   error;
+   int   i;
+
+   if (wu.wu_fd >= 0) {
+      return 0;
+   }
+
+   memset(&params, 0, sizeof(params));
+   wu.wu_fd = (int)syscall(__NR_io_uring_setup, WU_ENTRIES, &params);
+   if (wu.wu_fd < 0) {
+      dprintf("io_uring_setup error %d\n", errno);
+      return WI_E_SOCKET;
+   }
+   /* wu_wait() passes its timeout with the extended arguments */
+   if ((params.features & IORING_FEAT_EXT_ARG) == 0) {
+      dprintf("io_uring too old\n");
+      wu_cleanup();
+      return WI_E_SOCKET;
+   }
+   error = wu_setup(wu.wu_fd, &params);
+   if (error) {
+      dprintf("io_uring map error %d\n", errno);
+      wu_cleanup();
+      return error;
+   }
+
+   /* The buffer ring must be page aligned, mmap() takes care of that */
+   wu.wu_br = mmap(NULL, WU_NBUFS * sizeof(struct io_uring_buf),
+      PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+   wu.wu_bufs = mmap(NULL, WU_NBUFS * WU_BUFSIZE,
+      PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+   if ((wu.wu_br == MAP_FAILED) || (wu.wu_bufs == MAP_FAILED)) {
+      if (wu.wu_br == MAP_FAILED) wu.wu_br = NULL;
+      if (wu.wu_bufs == MAP_FAILED) wu.wu_bufs = NULL;
+      wu_cleanup();
+      return WI_E_MEMORY;
+   }
+
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (unsigned long)wu.wu_br;
+   reg.ring_entries = WU_NBUFS;
+   reg.bgid = WU_BGID;
+   error = (int)syscall(__NR_io_uring_register, wu.wu_fd,
+      IORING_REGISTER_PBUF_RING, &reg, 1);
+   if (error < 0) {
+      dprintf("io_uring buffer ring error %d\n", errno);
+      wu_cleanup();
+      return WI_E_SOCKET;
+   }
+
+   wu.wu_brtail = 0;
+   for (i = 0; i < WU_NBUFS; i++) {
+      wu_bufadd(i);
+   }
+
+   return 0;
+}
+
+/* wu_cleanup() - close the calling reactor's ring and free its memory */
+
+void wu_cleanup(void) {
+   if (wu.wu_fd >= 0) {
+      close(wu.wu_fd);
+      wu.wu_fd = -1;
+   }
+   if (wu.wu_sqes) {
+      munmap(wu.wu_sqes, wu.wu_sqentries * sizeof(struct io_uring_sqe));
+      wu.wu_sqes = NULL;
+   }
+   if (wu.wu_cqmap && (wu.wu_cqmap != wu.wu_sqmap)) {
+      munmap(wu.wu_cqmap, wu.wu_cqmaplen);
+   }
+   wu.wu_cqmap = NULL;
+   if (wu.wu_sqmap) {
+      munmap(wu.wu_sqmap, wu.wu_sqmaplen);
+      wu.wu_sqmap = NULL;
+   }
+   if (wu.wu_br) {
+      munmap(wu.wu_br, WU_NBUFS * sizeof(struct io_uring_buf));
+      wu.wu_br = NULL;
+   }
+   if (wu.wu_bufs) {
+      munmap(wu.wu_bufs, WU_NBUFS * WU_BUFSIZE);
+      wu.wu_bufs = NULL;
+   }
+}
+
+/* wu_enter()
+ *
+ * Pass the queued requests to the kernel, and optionally wait for a
+ * completion. "msecs" is the longest time to wait, or -1 for no wait.
+ *
+ * Returns 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wu_enter(long msecs) {
+   struct io_uring_getevents_arg arg;
+   struct __kernel_timespec ts;
+   unsigned    tosubmit;
+   unsigned    flags = 0;
+   unsigned    waitfor = 0;
+   int         error;
+
+   __atomic_store_n(wu.wu_sqtail, wu.wu_sqlocal, __ATOMIC_RELEASE);
+   tosubmit = wu.wu_sqlocal - __atomic_load_n(wu.wu_sqhead, __ATOMIC_ACQUIRE);
+
+   memset(&arg, 0, sizeof(arg));
+   if (msecs >= 0) {
+      ts.tv_sec = msecs / 1000;
+      ts.tv_nsec = (msecs % 1000) * 1000000;
+      arg.ts = (unsigned long)&ts;
+      flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+      waitfor = 1;
+   } else if (tosubmit == 0) {
+      return 0;
+   }
+
+   error = (int)syscall(__NR_io_uring_enter, wu.wu_fd, tosubmit, waitfor,
+      flags, (flags ? (void *)&arg : NULL), (flags ? sizeof(arg) : 0));
+   if (error < 0) {
+      error = errno;
+      if ((error == ETIME) || (error == EINTR) || (error == EBUSY) ||
+          (error == EAGAIN)) {
+         return 0;   /* timed out, or come back after reaping completions */
+      }
+      dprintf("io_uring_enter error %d\n", error);
+      return WI_E_SOCKET;
+   }
+   return 0;
+}
+
+/* wu_getsqe()
+ *
+ * Get a cleared submission queue entry for a new request. If the
+ * queue is full, the queued requests are passed to the kernel first.
+ *
+ * Returns: pointer to SQE, or NULL if the queue stays full.
+ */
+
+static struct io_uring_sqe * wu_getsqe(void) {
+   struct io_uring_sqe * sqe;
+
+   if ((wu.wu_sqlocal - __atomic_load_n(wu.wu_sqhead, __ATOMIC_ACQUIRE)) >=
+       wu.wu_sqentries) {
+      wu_enter(-1);
+      if ((wu.wu_sqlocal - __atomic_load_n(wu.wu_sqhead, __ATOMIC_ACQUIRE)) >=
+          wu.wu_sqentries) {
+         dprintf("io_uring submission queue full\n");
+         return NULL;
+      }
+   }
+   sqe = &wu.wu_sqes[wu.wu_sqlocal & wu.wu_sqmask];
+   wu.wu_sqlocal++;
+   memset(sqe, 0, sizeof(*sqe));
+   return sqe;
+}
+
+/* wu_sessreq()
+ *
+ * Get an SQE for a request on behalf of a session, and count it as
+ * in progress. The session is not deleted until all its requests
+ * have completed, see wi_delsess().
+ *
+ * Returns: pointer to SQE, or NULL if none.
+ */
+
+static struct io_uring_sqe * wu_sessreq(wi_sess * sess, int op, int fd) {
+   struct io_uring_sqe * sqe;
+
+   sqe = wu_getsqe();
+   if (sqe == NULL) {
+      return NULL;
+   }
+   sqe->fd = fd;
+   sqe->user_data = (unsigned long)sess | op;
+   sess->ws_ioinflight++;
+   return sqe;
+}
+
+/* wu_accept() - start a multishot accept on listen socket "lsock" */
+
+int wu_accept(socktype lsock) {
+   struct io_uring_sqe * sqe;
+
+   sqe = wu_getsqe();
+   if (sqe == NULL) {
+      return WI_E_MEMORY;
+   }
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = (int)lsock;
+   sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+   sqe->accept_flags = SOCK_NONBLOCK;
+   sqe->user_data = ((unsigned long)lsock << 3) | WU_ACCEPT;
+   return 0;
+}
+
+/* wu_cancel()
+ *
+ * Cancel the multishot accept on listen socket "lsock". Closing the
+ * socket would not end it if another process shares the socket, and
+ * shutting it down would end it for them too.
+ */
+
+int wu_cancel(socktype lsock) {
+   struct io_uring_sqe * sqe;
+
+   sqe = wu_getsqe();
+   if (sqe == NULL) {
+      return WI_E_MEMORY;
+   }
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->fd = -1;
+   sqe->addr = ((unsigned long)lsock << 3) | WU_ACCEPT;
+   sqe->user_data = WU_CANCEL;
+   return 0;
+}
+
+/* wu_pollwake()
+ *
+ * Start a multishot poll on the reactor's wakeup descriptor, so a
+ * wakeup from another thread ends the ring wait. See wi_pushwake().
+ */
+
+int wu_pollwake(int fd) {
+   struct io_uring_sqe * sqe;
+
+   sqe = wu_getsqe();
+   if (sqe == NULL) {
+      return WI_E_MEMORY;
+   }
+   sqe->opcode = IORING_OP_POLL_ADD;
+   sqe->fd = fd;
+   sqe->len = IORING_POLL_ADD_MULTI;
+   sqe->poll32_events = POLLIN;
+   sqe->user_data = WU_WAKE;
+   return 0;
+}
+
+/* wu_recv() - start a multishot receive on a session's socket */
+
+int wu_recv(wi_sess * sess) {
+   struct io_uring_sqe * sqe;
+
+   sqe = wu_sessreq(sess, WU_RECV, (int)sess->ws_socket);
+   if (sqe == NULL) {
+      return WI_E_MEMORY;
+   }
+   sqe->opcode = IORING_OP_RECV;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = WU_BGID;
+   return 0;
+}
+
+/* wu_wait()
+ *
+ * Submit all queued requests and wait up to "msecs" milliseconds for
+ * at least one completion.
+ *
+ * Returns 0 if OK, else negative WI_E_ error code.
+ */
+
+int wu_wait(long msecs) {
+   return wu_enter(msecs);
+}
+
+/* wu_getcqe()
+ *
+ * Fetch the next completion, if any, and release its queue slot.
+ *
+ * Returns TRUE if a completion was returned, else FALSE.
+ */
+
+int wu_getcqe(u_long * udata, int * res, unsigned * flags) {
+   struct io_uring_cqe * cqe;
+   unsigned    head;
+
+   head = *wu.wu_cqhead;
+   if (head == __atomic_load_n(wu.wu_cqtail, __ATOMIC_ACQUIRE)) {
+      return FALSE;
+   }
+   cqe = &wu.wu_cqes[head & wu.wu_cqmask];
+   *udata = (u_long)cqe->user_data;
+   *res = cqe->res;
+   *flags = cqe->flags;
+   __atomic_store_n(wu.wu_cqhead, head + 1, __ATOMIC_RELEASE);
+   return TRUE;
+}
+
+/* wu_rxdata()
+ *
+ * Handle a receive completion. The data is copied from the ring's
+ * buffer to the session's rxbuf and the buffer is returned to the
+ * ring. The receive is restarted if the kernel ended it while the
+ * session still wants input.
+ *
+ * Returns 0 if OK, else negative WI_E_ error code. On error the
+ * session is put in WI_ENDING.
+ */
+
+int wu_rxdata(wi_sess * sess, int res, unsigned flags) {
+   int   bid = -1;
+   int   space;
+
+   if (flags & IORING_CQE_F_BUFFER) {
+      bid = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+   }
+
+   if ((res > 0) && (sess->ws_state == WI_PUSHING)) {
+      /* nothing to do with it, a push only watches for the close */
+   } else if ((res > 0) && (sess->ws_state == WI_WEBSOCKET)) {
+      /* WebSocket frames are taken as they come, rxbuf only has to
+       * hold a message.
+       */
+      if (wi_wsrecv(sess, wu.wu_bufs + (bid * WU_BUFSIZE), res)) {
+         sess->ws_state = WI_ENDING;
+      }
+   } else if ((res > 0) && (sess->ws_state != WI_ENDING)) {
+      /* Attach a receive buffer when the first data shows up */
+      if ((sess->ws_rxbuf == NULL) && (wi_rxalloc(sess) == NULL)) {
+         dprintf("no rx buffer for session\n");
+         sess->ws_state = WI_ENDING;
+      } else {
+         /* Leave room for a null, the header parser uses string calls */
+         space = (WI_RXBUFSIZE - 1) - sess->ws_rxsize;
+         if (res > space) {
+            dprintf("rx buffer overflow\n");
+            sess->ws_state = WI_ENDING;
+         } else {
+            if (sess->ws_rxsize == 0) {
+               sess->ws_reqstart = wi_cticks;   /* next request started */
+            }
+            memcpy(sess->ws_rxbuf + sess->ws_rxsize,
+               wu.wu_bufs + (bid * WU_BUFSIZE), res);
+            /* A pipelined request arriving while the current one is
+             * answered goes where its end was null terminated. Keep
+             * the terminator, and its byte for wi_resetsess().
+             */
+            if (sess->ws_reqlen && (sess->ws_state != WI_POSTRX) &&
+                (sess->ws_reqlen == sess->ws_rxsize)) {
+               sess->ws_rxhold = sess->ws_rxbuf[sess->ws_reqlen];
+               sess->ws_rxbuf[sess->ws_reqlen] = 0;
+            }
+            sess->ws_rxsize += res;
+            sess->ws_rxbuf[sess->ws_rxsize] = 0;
+            sess->ws_last = wi_cticks;
+         }
+      }
+   }
+   if (bid >= 0) {
+      wu_bufadd(bid);
+   }
+
+   if (flags & IORING_CQE_F_MORE) {
+      return 0;      /* receive is still active */
+   }
+
+   if ((res > 0) || (res == -ENOBUFS)) {
+      /* Kernel stopped the receive, not the peer. Restart it. */
+      if ((sess->ws_state != WI_ENDING) && (sess->ws_socket != INVALID_SOCKET)) {
+         if (wu_recv(sess)) {
+            sess->ws_state = WI_ENDING;
+            return WI_E_MEMORY;
+         }
+      }
+      return 0;
+   }
+
+   /* Peer closed or socket error. A request which is being answered is
+    * allowed to finish, otherwise the session is done. A long poll is
+    * dropped, there is no one left to answer.
+    */
+   sess->ws_flags &= ~WF_PERSIST;
+   if (sess->ws_state == WI_ENDING) {
+      return 0;      /* we closed it */
+   }
+   if (((sess->ws_state == WI_HEADER) && sess->ws_rxsize) ||
+       (sess->ws_state == WI_POSTRX) || (res < 0)) {
+      wi_sockerr(sess, -res);    /* a request was cut off */
+   }
+   if ((sess->ws_state == WI_HEADER) || (sess->ws_state == WI_POSTRX) ||
+       (sess->ws_pushfunc && (sess->ws_state == WI_PUSHING)) ||
+       (sess->ws_state == WI_WEBSOCKET) || (sess->ws_state == WI_PARKED) ||
+       (res < 0)) {
+      sess->ws_state = WI_ENDING;
+   }
+   return (res < 0) ? WI_E_SOCKET : 0;
+}
+
+/* wu_sendtx()
+ *
+ * Start a send of the session's txbuf chain. Up to WI_MAXIOV buffers
+ * go in one request.
+ *
+ * Returns 0 if OK, else negative WI_E_ error code.
+ */
+
+static int wu_sendtx(wi_sess * sess) {
+   struct io_uring_sqe * sqe;
+
+   memset(&sess->ws_msg, 0, sizeof(sess->ws_msg));
+   sess->ws_msg.msg_iov = sess->ws_iov;
+   sess->ws_msg.msg_iovlen = wi_txiov(sess, sess->ws_iov, WI_MAXIOV);
+
+   sqe = wu_sessreq(sess, WU_SENDMSG, (int)sess->ws_socket);
+   if (sqe == NULL) {
+      return WI_E_MEMORY;
+   }
+   sqe->opcode = IORING_OP_SENDMSG;
+   sqe->addr = (unsigned long)&sess->ws_msg;
+   sqe->len = 1;
+   sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+   sess->ws_flags |= WF_TXBUSY;
+   return 0;
+}
+
+/* wu_sendblock() - start a send of the unsent part of a binary file block */
+
+static int wu_sendblock(wi_sess * sess, wi_file * fi) {
+   struct io_uring_sqe * sqe;
+
+   sqe = wu_sessreq(sess, WU_SEND, (int)sess->ws_socket);
+   if (sqe == NULL) {
+      return WI_E_MEMORY;
+   }
+   sqe->opcode = IORING_OP_SEND;
+   sqe->addr = (unsigned long)&fi->wf_data[fi->wf_nextbuf];
+   sqe->len = fi->wf_inbuf - fi->wf_nextbuf;
+   sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+   sess->ws_flags |= WF_TXBUSY;
+   return 0;
+}
+
+/* wu_readblock() - start a read of the next block of a binary disk file */
+
+static int wu_readblock(wi_sess * sess, wi_file * fi, int fd) {
+   struct io_uring_sqe * sqe;
+
+   sqe = wu_sessreq(sess, WU_READ, fd);
+   if (sqe == NULL) {
+      return WI_E_MEMORY;
+   }
+   sqe->opcode = IORING_OP_READ;
+   sqe->addr = (unsigned long)fi->wf_data;
+   sqe->len = sizeof(fi->wf_data);
+   sqe->off = sess->ws_fileoff;
+   sess->ws_flags |= WF_TXBUSY;
+   return 0;
+}
+
+/* wu_sockwrite()
+ *
+ * The io_uring version of wi_sockwrite(). This starts the next send
+ * (or file read) of the reply and returns; the completion brings us
+ * back here through wu_txcomplete() until the reply is done. The HTTP
+ * header is put at the front of the txbuf chain so it goes out in the
+ * same send as the data.
+ *
+ * Returns: 0 if no error, else negative WI_E_ error code.
+ */
+
+int wu_sockwrite(wi_sess * sess) {
+   wi_file *   fi;
+   txbuf *     tb;
+   int         contentlen = 0;
+   int         fd;
+
+   if (sess->ws_flags & WF_TXBUSY) {
+      return 0;      /* completion of current request will continue */
+   }
+   fi = sess->ws_filelist;
+
+   if ((sess->ws_flags & WF_HEADERSENT) == 0) { /* header sent yet? */
+      if (sess->ws_flags & WF_BINARY) {
+         int   current;
+
+         current = wi_ftell(fi);
+         wi_fseek(fi, 0, SEEK_END);
+         contentlen = wi_ftell(fi);
+         wi_fseek(fi, current, SEEK_SET);
+
+         /* wi_readfile() already read the first block */
+         sess->ws_fileoff = fi->wf_inbuf;
+         wi_socktune(sess, WI_TUNE_BINARY, contentlen);
+      } else {
+         tb = sess->ws_txmark ? sess->ws_txmark->tb_next : sess->ws_txbufs;
+         for ( ; tb; tb = tb->tb_next)
+            contentlen += tb->tb_total;
+      }
+
+      if (wi_queuehdr(sess, contentlen)) {
+         return WI_E_MEMORY;
+      }
+
+      /* Reply is complete, hold it if another request is waiting */
+      if (((sess->ws_flags & WF_BINARY) == 0) && wi_pipehold(sess)) {
+         return 0;
+      }
+   }
+
+   if (sess->ws_txbufs) {
+      return wu_sendtx(sess);
+   }
+
+   if (sess->ws_flags & WF_BINARY) {
+      if (fi->wf_nextbuf < fi->wf_inbuf) {
+         return wu_sendblock(sess, fi);
+      }
+
+      /* Read disk files in the ring, others have no descriptor */
+      fd = -1;
+      if (fi->wf_routines->wfs_fileno) {
+         fd = fi->wf_routines->wfs_fileno(fi->wf_fd);
+      }
+      if (fd >= 0) {
+         return wu_readblock(sess, fi, fd);
+      }
+
+      fi->wf_nextbuf = 0;
+      fi->wf_inbuf = wi_fread(fi->wf_data, 1, sizeof(fi->wf_data), fi);
+      if (fi->wf_inbuf < 0) {
+         return WI_E_BADFILE;
+      }
+      if (fi->wf_inbuf > 0) {
+         return wu_sendblock(sess, fi);
+      }
+      wi_fclose(fi);
+   }
+
+   /* fall to here when the whole reply is sent. */
+   return wi_txdone(sess);
+}
+
+/* wu_txcomplete()
+ *
+ * Handle completion of a send or file read started by wu_sockwrite(),
+ * and start the next one.
+ *
+ * Returns: 0 if no error, else negative WI_E_ error code. On error
+ * the session is put in WI_ENDING.
+ */
+
+int wu_txcomplete(wi_sess * sess, int op, int res) {
+   wi_file *   fi;
+   int         error;
+
+   sess->ws_flags &= ~WF_TXBUSY;
+   if ((sess->ws_state != WI_SENDDATA) && (sess->ws_state != WI_PUSHING) &&
+       (sess->ws_state != WI_WEBSOCKET) && (sess->ws_state != WI_CONTENT) &&
+       (sess->ws_state != WI_PARKED)) {
+      return 0;      /* session is ending */
+   }
+   if ((res == -EAGAIN) || (res == -EINTR)) {
+      res = 0;       /* just try again */
+   } else if (res < 0) {
+      sess->ws_state = WI_ENDING;
+      if (op == WU_READ) {
+         dprintf("ring read error %d\n", -res);
+         return WI_E_BADFILE;
+      }
+      return wi_sockerr(sess, -res);
+   }
+   fi = sess->ws_filelist;
+
+   switch (op) {
+   case WU_SENDMSG:
+      /* Free the txbufs which were sent, note progress in the next */
+      wi_txsent(sess, res);
+      break;
+   case WU_SEND:
+      fi->wf_nextbuf += res;
+      break;
+   case WU_READ:
+      if (res == 0) {      /* end of file */
+         wi_fclose(fi);
+         error = wi_txdone(sess);
+         if (error) {
+            sess->ws_state = WI_ENDING;
+         }
+         return error;
+      }
+      fi->wf_inbuf = res;
+      fi->wf_nextbuf = 0;
+      sess->ws_fileoff += res;
+      break;
+   default:
+      dtrap();
+      break;
+   }
+   sess->ws_last = wi_cticks;
+   if (sess->ws_state == WI_PUSHING) {
+      return 0;      /* wi_pushserve() sends the rest */
+   }
+   if (sess->ws_state == WI_WEBSOCKET) {
+      return 0;      /* wi_wsserve() sends the rest */
+   }
+   if ((sess->ws_state == WI_CONTENT) || (sess->ws_state == WI_PARKED)) {
+      return 0;      /* a streamed reply, wi_readfile() makes more */
+   }
+
+   error = wu_sockwrite(sess);
+   if (error) {
+      sess->ws_state = WI_ENDING;
+   }
+   return error;
+}
+
+/* wu_closesocket()
+ *
+ * Replacement for close() on sockets. A ring request keeps its own
+ * reference to the socket, so close() alone would leave a multishot
+ * receive running; shutting the socket down first ends it.
+ */
+
+int wu_closesocket(socktype sock) {
+   shutdown((int)sock, SHUT_RDWR);
+   return close((int)sock);
+}
+
+#endif   /* WI_USE_URING */
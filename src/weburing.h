@@ -0,0 +1,76 @@
+/* weburing.h
+ *
+ * Part of the Webio Open Source lightweight web server.
+ *
+ * Copyright (c) 2007 by John Bartas
+ * All rights reserved.
+ *
+ * Use license: Modified from standard BSD license.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation, advertising
+ * materials, Web server pages, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by John Bartas. The name "John Bartas" may not be used to
+ * endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTIBILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+#ifndef _WEBURING_H_
+#define _WEBURING_H_    1
+
+/* Optional Linux io_uring I/O engine. This is used in place of the
+ * select() or epoll() wi_poll() when WI_USE_URING is defined.
+ */
+
+#ifdef WI_USE_URING
+
+#include <linux/io_uring.h>
+
+#ifndef WU_ENTRIES
+#define WU_ENTRIES   256      /* submission queue size, per reactor */
+#endif
+
+#ifndef WU_NBUFS
+#define WU_NBUFS     64       /* receive buffers in ring, power of 2 */
+#endif
+
+#ifndef WU_BUFSIZE
+#define WU_BUFSIZE   WI_RXBUFSIZE   /* size of each receive buffer */
+#endif
+
+/* Request types. These are kept in the low bits of each request's
+ * user_data, the rest is the session pointer (or, for WU_ACCEPT, the
+ * listen socket).
+ */
+#define WU_ACCEPT    1        /* multishot accept on listen socket */
+#define WU_RECV      2        /* multishot receive into ring buffers */
+#define WU_SENDMSG   3        /* send of txbuf chain */
+#define WU_SEND      4        /* send of binary file block */
+#define WU_READ      5        /* read of binary file block */
+#define WU_CANCEL    6        /* cancel of the accept on a listen socket */
+#define WU_WAKE      7        /* multishot poll of wi_wakefd */
+
+#define WU_OPMASK    7        /* session structs are at least 8 aligned */
+
+extern   int      wu_init(void);
+extern   void     wu_cleanup(void);
+extern   int      wu_accept(socktype lsock);
+extern   int      wu_cancel(socktype lsock);
+extern   int      wu_pollwake(int fd);
+extern   int      wu_recv(wi_sess * sess);
+extern   int      wu_wait(long msecs);
+extern   int      wu_getcqe(u_long * udata, int * res, unsigned * flags);
+extern   int      wu_rxdata(wi_sess * sess, int res, unsigned flags);
+extern   int      wu_sockwrite(wi_sess * sess);
+extern   int      wu_txcomplete(wi_sess * sess, int op, int res);
+
+#endif   /* WI_USE_URING */
+
+#endif   /* _WEBURING_H_ */
@@ -30,9 +30,10 @@
 
 #ifdef LINUX
 #include <unistd.h>
+#include <sys/sendfile.h>
 #endif
 
-char hdrbuf[HDRBUFSIZE];   /* For building HTTP headers */
+WI_TLS char hdrbuf[HDRBUFSIZE];   /* For building HTTP headers */
 
 int   (*wi_execfunc)(wi_sess * sess, char * args) = NULL;
 
@@ -50,19 +51,31 @@ struct httperror {
 	{ 401,  "Authentication required" },
 	{ 402,  "Payment required" },
 	{ 404,  "File not found" },
+	{ 413,  "Content too large" },
+	{ 426,  "Upgrade required" },
+	{ 431,  "Request header too large" },
 	{ 501,  "Server error" },
 };
 
+/* Most of the URI an error reply echoes, so it fits in hdrbuf */
+#define ERRURIMAX    200
+
 /* wi_senderr()
  * 
  * This is called when a session needs to send an error to the client..
+ * If replies to earlier pipelined requests are still held in the txbuf
+ * chain, the error is queued behind them and the session goes to
+ * WI_SENDDATA, which sends it and closes the connection. Otherwise it
+ * is sent at once and the session is ended.
  *
  * Returns: 0 if a;ll went OK, else negative WI_E_ error code.
  */
 
 int wi_senderr(wi_sess * sess, int httpcode ) {
    int            i;
+   int            len;
    char *         cp;
+   txbuf *        tb;
    const char *   errortext = "Unknown HTTP Error";
 
    for (i = 0; i < (sizeof(httperrors)/sizeof(struct httperror)); i++) {
@@ -72,13 +85,25 @@ int wi_senderr(wi_sess * sess, int httpcode ) {
       }
    }
 
+   /* The header of a chunked reply is gone already, the client can
+    * only be told by cutting the reply short.
+    */
+   if (sess->ws_flags & WF_CHUNKED) {
+      httpcode = 0;
+      goto errclose;
+   }
+
    /* Build a header */
    sprintf(hdrbuf, "HTTP/1.1 %d %s\r\n", httpcode, errortext);
    cp = hdrbuf + strlen(hdrbuf);
    sprintf(cp, "Date: %s\r\n", wi_getdate(sess) );
    cp += strlen(cp);
    if (httpcode == 401) {
-      sprintf(cp, "WWW-Authenticate: Basic realm=\"%s\"\r\n", sess->ws_uri );
+      sprintf(cp, "WWW-Authenticate: Basic realm=\"%.*s\"\r\n", ERRURIMAX, sess->ws_uri );
+      cp += strlen(cp);
+   }
+   if (httpcode == 426) {     /* only WebSockets ask for it, see wi_wsaccept() */
+      sprintf(cp, "Upgrade: websocket\r\nSec-WebSocket-Version: 13\r\n");
       cp += strlen(cp);
    }
    sprintf(cp, "Server: %s\r\n", wi_servername );
@@ -92,16 +117,43 @@ int wi_senderr(wi_sess * sess, int httpcode ) {
    sprintf(cp, "<body><h2>Error %d: %s<br></h2>\r\n", httpcode, errortext);
    cp += strlen(cp);
    if (sess->ws_uri) {
-      sprintf(cp, "File: %s<br>\r\n", sess->ws_uri);
+      sprintf(cp, "File: %.*s<br>\r\n", ERRURIMAX, sess->ws_uri);
       cp += strlen(cp);
    }
 
    sprintf(cp, "</body></html>\r\n");
    cp += strlen(cp);
 
-   send(sess->ws_socket, hdrbuf, strlen(hdrbuf), 0);
+   /* Whatever was built of the current reply is replaced by the error */
+   while ((tb = sess->ws_txmark ? sess->ws_txmark->tb_next : sess->ws_txbufs)) {
+      wi_txfree(tb);
+   }
+
+   /* Replies held for pipelined requests go out ahead of the error */
+   if (sess->ws_txbufs) {
+      for (cp = hdrbuf; *cp; cp += len) {
+         tb = wi_txalloc(sess);
+         if (tb == NULL) {
+            goto errclose;
+         }
+         len = (int)strlen(cp);
+         if (len > WI_TXBUFSIZE) {
+            len = WI_TXBUFSIZE;
+         }
+         memcpy(tb->tb_data, cp, len);
+         tb->tb_total = len;
+      }
+      sess->ws_flags &= ~(WF_PERSIST | WF_BINARY | WF_SVRPUSH);
+      sess->ws_flags |= (WF_HEADERSENT | WF_ERRREPLY);
+      sess->ws_state = WI_SENDDATA;
+      return 0;
+   }
+
+   send(sess->ws_socket, hdrbuf, strlen(hdrbuf), MSG_NOSIGNAL);
 
+errclose:
    /* Close socket and mark session for deletion */
+   sess->ws_flags &= ~WF_PERSIST;
    closesocket(sess->ws_socket);
    sess->ws_socket = INVALID_SOCKET;
    sess->ws_state = WI_ENDING;
@@ -110,10 +162,17 @@ int wi_senderr(wi_sess * sess, int httpcode ) {
 }
 
 
-int wi_replyhdr(wi_sess * sess, int contentlen) {
+/* wi_buildhdr()
+ * 
+ * Build the HTTP "200 OK" reply header for a session in hdrbuf. A
+ * contentlen of -1 is for a reply of unknown length, chunked for
+ * HTTP/1.1 clients.
+ *
+ * Returns: length of the header.
+ */
+
+int wi_buildhdr(wi_sess * sess, int contentlen) {
    char *   cp;
-   int      hdrlen;
-   int      error;
 
    sprintf(hdrbuf, "HTTP/1.1 200 OK\r\n");
    cp = hdrbuf + strlen(hdrbuf);
@@ -121,29 +180,202 @@ int wi_replyhdr(wi_sess * sess, int contentlen) {
    cp += strlen(cp);
    sprintf(cp, "Server: %s\r\n", wi_servername );
    cp += strlen(cp);
-   sprintf(cp, "Connection: close\r\n");
+   if (sess->ws_flags & WF_PERSIST) {
+      sprintf(cp, "Connection: keep-alive\r\nKeep-Alive: timeout=%d\r\n", 
+         wi_persisttmo);
+   } else {
+      sprintf(cp, "Connection: close\r\n");
+   }
    cp += strlen(cp);
    sprintf(cp, "Content-Type: %s\r\n", sess->ws_ftype );
    cp += strlen(cp);
-   sprintf(cp, "Content-Length: %d\r\n\r\n", contentlen );
+   if (sess->ws_state == WI_PUSHING) {
+      sprintf(cp, "Cache-Control: no-cache\r\n");   /* it is live */
+      cp += strlen(cp);
+   }
+   if (contentlen < 0) {
+      sprintf(cp, (sess->ws_flags & WF_HTTP11) ?
+         "Transfer-Encoding: chunked\r\n\r\n" : "\r\n");
+   } else {
+      sprintf(cp, "Content-Length: %d\r\n\r\n", contentlen );
+   }
    cp += strlen(cp);
 
-   hdrlen = strlen(hdrbuf);
-   error = send(sess->ws_socket, hdrbuf, hdrlen, 0);
-   if (error < hdrlen) {
-      dtrap();    /* Does this ever happen? */
-      error = errno;
-      return WI_E_SOCKET;
+   return (int)(cp - hdrbuf);
+}
+
+
+/* wi_queuehdr()
+ *
+ * Build the reply header and put it in a txbuf at the front of the
+ * current reply, so it is sent along with the data.
+ *
+ * Returns: 0 if no error, else negative WI_E_ error code.
+ */
+
+int wi_queuehdr(wi_sess * sess, int contentlen) {
+   txbuf *  tb;
+   int      hdrlen;
+
+   hdrlen = wi_buildhdr(sess, contentlen);
+   tb = wi_txpush(sess);
+   if (tb == NULL) {
+      return WI_E_MEMORY;
    }
+   memcpy(tb->tb_data, hdrbuf, hdrlen);
+   tb->tb_total = hdrlen;
    sess->ws_flags |= WF_HEADERSENT;
    return 0;
 }
 
+
+/* wi_chunk()
+ *
+ * Make the reply data queued since the last chunk into an HTTP/1.1
+ * chunk, so it can be sent while the rest of the reply is built. The
+ * first call queues a chunked reply header. If "last" is set the zero
+ * length chunk which ends the reply is added too. An HTTP/1.0 client
+ * gets the data as is, and closing the connection ends the reply.
+ *
+ * The framed data is kept behind ws_txmark, as for held pipelined
+ * replies, so the next chunk's size line goes in after it.
+ *
+ * Returns: 0 if no error, else negative WI_E_ error code.
+ */
+
+int wi_chunk(wi_sess * sess, int last) {
+   txbuf *  tb;
+   int      len = 0;
+   int      error;
+
+   if ((sess->ws_flags & WF_CHUNKED) == 0) {
+      if ((sess->ws_flags & WF_HTTP11) == 0) {
+         sess->ws_flags &= ~WF_PERSIST;   /* close ends the reply */
+      }
+      error = wi_queuehdr(sess, -1);
+      if (error) {
+         return error;
+      }
+      sess->ws_txmark = sess->ws_txmark ? sess->ws_txmark->tb_next :
+                                          sess->ws_txbufs;
+      sess->ws_flags |= WF_CHUNKED;
+   }
+   if ((sess->ws_flags & WF_HTTP11) == 0) {
+      sess->ws_txmark = sess->ws_txtail;
+      return 0;
+   }
+
+   tb = sess->ws_txmark ? sess->ws_txmark->tb_next : sess->ws_txbufs;
+   for ( ; tb; tb = tb->tb_next) {
+      len += tb->tb_total - tb->tb_done;
+   }
+   if (len > 0) {
+      tb = wi_txpush(sess);
+      if (tb == NULL) {
+         return WI_E_MEMORY;
+      }
+      tb->tb_total = sprintf(tb->tb_data, "%x\r\n", len);
+      wi_printf(sess, "\r\n");
+   }
+   if (last) {
+      wi_printf(sess, "0\r\n\r\n");
+   }
+   sess->ws_txmark = sess->ws_txtail;
+   return 0;
+}
+
+
+/* wi_replyhdr()
+ *
+ * Queue the reply header with wi_queuehdr() and send as much of the
+ * txbuf chain as the socket will take. Whatever did not fit is left in
+ * ws_txbufs, to go before any more of the reply.
+ *
+ * Returns: 0 if no error, else negative WI_E_ error code.
+ */
+
+int wi_replyhdr(wi_sess * sess, int contentlen) {
+   int      error;
+
+   error = wi_queuehdr(sess, contentlen);
+   if (error) {
+      return error;
+   }
+   return wi_txflush(sess);
+}
+
+#ifdef LINUX
+
+/* wi_sendfile()
+ *
+ * The wi_movebinary() fast path for files on a filesystem which can
+ * give us a descriptor (see wfs_fileno). After the block which
+ * wi_readfile() read, the file is sent with sendfile(), which saves
+ * copying it through wf_data and a read call per block. The file
+ * offset is kept in ws_fileoff, so the descriptor's own position
+ * does not matter.
+ *
+ * Returns 0 if OK, else negative error code.
+ */
+
+static int wi_sendfile(wi_sess * sess, wi_file * fi, int fd) {
+   off_t    offset;
+   int      error;
+   int      tosend;
+
+   while (sess->ws_state == WI_SENDDATA) {
+      /* Finish the block already in wf_data */
+      if (fi->wf_nextbuf < fi->wf_inbuf) {
+         tosend = fi->wf_inbuf - fi->wf_nextbuf;
+         error = send(sess->ws_socket, &fi->wf_data[fi->wf_nextbuf],
+            tosend, MSG_NOSIGNAL);
+         if (error < 0) {
+            if (errno == EWOULDBLOCK) {
+               wi_txblocked(sess, 0);
+               return 0;
+            }
+            return wi_sockerr(sess, errno);
+         }
+         fi->wf_nextbuf += error;
+         sess->ws_last = wi_cticks;
+         if (error < tosend) {
+            wi_txblocked(sess, error);
+            return 0;
+         }
+         continue;
+      }
+
+      offset = sess->ws_fileoff;
+      error = sendfile(sess->ws_socket, fd, &offset, WI_SENDFILEMAX);
+      if (error < 0) {
+         if (errno == EWOULDBLOCK) {
+            wi_txblocked(sess, 0);
+            return 0;      /* try again later */
+         }
+         return wi_sockerr(sess, errno);
+      }
+      if (error == 0) {    /* end of file */
+         wi_fclose(fi);
+         wi_txdone(sess);  /* will cause break from while () loop */
+         break;
+      }
+      sess->ws_fileoff = (long)offset;
+      sess->ws_last = wi_cticks;
+   }
+
+   return 0;   /* OK return */
+}
+
+#endif   /* LINUX */
+
 /* wi_movebinary()
  * 
  * This is called, often iterativly, to send a binary file to a socket.
  * It does no processing or scanning of the file contents. 
- * It sends until the socket returns EWOULDBLOCK or file reaches EOF.
+ * It sends until the socket is full or file reaches EOF. The part of
+ * wf_data already sent is kept in wf_nextbuf. The header is queued in
+ * the txbufs, behind any held pipelined replies, and they are sent
+ * before the file.
  * After EWOULDBLOCK the socket blocks on the select call in webio.c
  * until the socket can send again, then this routine is called again.
  * 
@@ -153,6 +385,7 @@ int wi_replyhdr(wi_sess * sess, int contentlen) {
 int wi_movebinary(wi_sess * sess, wi_file * fi) {
    int   filelen;
    int   error;
+   int   tosend;
 
    if ((sess->ws_flags & WF_HEADERSENT) == 0) { /* header sent yet? */
       int   current;
@@ -160,44 +393,140 @@ int wi_movebinary(wi_sess * sess, wi_file * fi) {
       wi_fseek(fi, 0, SEEK_END);
       filelen = wi_ftell(fi);
       wi_fseek(fi, current, SEEK_SET);
-      wi_replyhdr(sess, filelen);
+      wi_socktune(sess, WI_TUNE_BINARY, filelen);
+      error = wi_queuehdr(sess, filelen);
+      if (error) {
+         return error;
+      }
+
+      /* wi_readfile() already read the first block */
+      sess->ws_fileoff = fi->wf_inbuf;
    }
 
+   /* Held replies and the header go before any of the file */
+   if (sess->ws_txbufs) {
+      error = wi_txflush(sess);
+      if (error || sess->ws_txbufs) {
+         return error;
+      }
+   }
+
+#ifdef LINUX
+   /* Files with a descriptor go straight from the page cache */
+   if (fi->wf_routines->wfs_fileno) {
+      int   fd = fi->wf_routines->wfs_fileno(fi->wf_fd);
+
+      if (fd >= 0) {
+         return wi_sendfile(sess, fi, fd);
+      }
+   }
+#endif
+
    while (sess->ws_state == WI_SENDDATA) {
       /* see if we need to get another block from the file */
-      if (fi->wf_inbuf == 0) {
-         fi->wf_inbuf = wi_fread(fi->wf_data, 1, sizeof(fi->wf_data), fi );
-
-         if (fi->wf_inbuf < 0) {
-        	 return WI_E_BADFILE;
+      if (fi->wf_nextbuf >= fi->wf_inbuf) {
+         if ((fi->wf_inbuf > 0) && (fi->wf_inbuf < sizeof(fi->wf_data))) {
+            fi->wf_inbuf = 0;    /* last block was short, end of file */
+         } else {
+            fi->wf_inbuf = wi_fread(fi->wf_data, 1, sizeof(fi->wf_data), fi );
+            if (fi->wf_inbuf < 0) {
+               return WI_E_BADFILE;
+            }
+         }
+         fi->wf_nextbuf = 0;
+         if (fi->wf_inbuf == 0) {  /* end of file? */
+            wi_fclose(fi);
+            wi_txdone(sess);  /* will cause break from while () loop */
+            break;
          }
       }
-      error = send(sess->ws_socket, fi->wf_data, fi->wf_inbuf, 0);
+
+      /* Send from where the last send left off */
+      tosend = fi->wf_inbuf - fi->wf_nextbuf;
+      error = send(sess->ws_socket, &fi->wf_data[fi->wf_nextbuf], tosend,
+                   MSG_NOSIGNAL);
       if (error < 0) {
-         error = errno;
-         if (error == EWOULDBLOCK) {
+         if (errno == EWOULDBLOCK) {
+            wi_txblocked(sess, 0);
         	 return 0;      /* try again later */
          } else {
-        	 return WI_E_SOCKET;
+        	 return wi_sockerr(sess, errno);
          }
       }
-      if (fi->wf_inbuf < sizeof(fi->wf_data)) { /* end of file? */
-         wi_fclose(fi);
-         wi_txdone(sess);     /* will cause break from while () loop */
-      } else {
-         fi->wf_inbuf = 0;    /* clear buffer for another file read */
+      fi->wf_nextbuf += error;
+      sess->ws_last = wi_cticks;
+      if (error < tosend) {
+         wi_txblocked(sess, error);
+         return 0;
       }
    }
 
    return 0;   /* OK return */
 }
 
+/* wi_nextget()
+ *
+ * See if rxbuf holds another complete GET request after the current
+ * one. Other requests may have to wait for content, so they are not
+ * worth holding a reply for.
+ *
+ * Returns: TRUE if so, else FALSE.
+ */
+
+static int wi_nextget(wi_sess * sess) {
+   char *   next;
+   char     save;
+   int      complete;
+
+   if ((sess->ws_rxbuf == NULL) || (sess->ws_reqlen <= 0) ||
+       (sess->ws_reqlen >= sess->ws_rxsize)) {
+      return FALSE;
+   }
+
+   /* Put back the byte which may have been nulled to end POST data */
+   next = sess->ws_rxbuf + sess->ws_reqlen;
+   save = *next;
+   *next = sess->ws_rxhold;
+   complete = (strncmp(next, "GET ", 4) == 0) &&
+              (strstr(next, "\r\n\r\n") != NULL);
+   *next = save;
+
+   return complete;
+}
+
+/* wi_pipehold()
+ *
+ * Called when a reply has been queued in the session's txbufs. If the
+ * client has already sent its next request, hold the reply back and
+ * move on to that request, so the replies to a run of pipelined
+ * requests go out together in as few writes as possible. The batch is
+ * bounded by wi_pipemax replies and wi_pipebytes bytes.
+ *
+ * Returns: TRUE if the reply was held, FALSE if it should be sent now.
+ */
+
+int wi_pipehold(wi_sess * sess) {
+   if (((sess->ws_flags & WF_PERSIST) == 0) ||
+       ((sess->ws_pipelined + 1) >= wi_pipemax)) {
+      return FALSE;
+   }
+   if ((wi_txqueued(sess) >= wi_pipebytes) || !wi_nextget(sess)) {
+      return FALSE;
+   }
+
+   sess->ws_txmark = sess->ws_txtail;
+   sess->ws_pipelined++;
+   wi_resetsess(sess);
+   return TRUE;
+}
+
+
 int wi_txdone(wi_sess * sess) {
 
 	/* If connection is persistent change the state to read the next file  */
    if (sess->ws_flags & WF_PERSIST) {
-      dtrap();
-      sess->ws_state = WI_HEADER;
+      wi_socktune(sess, WI_TUNE_DONE, 0);    /* send the tail now */
+      wi_resetsess(sess);
 	  return 0;
    } else if (sess->ws_flags & WF_SVRPUSH) {
  	  int	error;
@@ -321,13 +650,62 @@ char * wi_getline( char * linetype, char * httphdr ) {
             return(cp);
          }
       }
-      if (strncmp(cp, "\r\n\r\n", 4) == 0)
+      /* Stop at the blank line. Just test "\n\r\n", wi_argterm() may
+       * have nulled the CR of the last header line.
+       */
+      if (strncmp(cp, "\n\r\n", 3) == 0)
          return NULL;
    }
 //   dtrap();       /* Didn't find end OR field??? */
    return NULL;
 }
 
+/* wi_hastoken()
+ *
+ * See if the first header line of the passed type lists "token" in
+ * its comma separated value, e.g. "upgrade" in "Connection: keep-alive,
+ * Upgrade". Case is ignored. Call this before wi_getline() for the
+ * same line, since that ends the value at its first space.
+ *
+ * Returns: TRUE if the token is there, else FALSE.
+ */
+
+int wi_hastoken( char * linetype, char * token, char * httphdr ) {
+   char *   cp;
+   int      typelen;
+   int      toklen;
+
+   typelen = strlen(linetype);
+   toklen = strlen(token);
+   for (cp = httphdr; cp < (httphdr + WI_RXBUFSIZE); cp++) {
+      if (strncmp(cp, "\n\r\n", 3) == 0) {
+         return FALSE;     /* end of header */
+      }
+      if ((*cp == *linetype) && ((cp == httphdr) || (cp[-1] == '\n')) &&
+          (strnicmp(cp, linetype, typelen) == 0)) {
+         break;
+      }
+   }
+   if (cp >= (httphdr + WI_RXBUFSIZE)) {
+      return FALSE;
+   }
+   cp += typelen;
+   while ((*cp != '\r') && (*cp != '\n') && (*cp != 0)) {
+      if ((*cp == ' ') || (*cp == '\t') || (*cp == ',')) {
+         cp++;
+         continue;
+      }
+      if ((strnicmp(cp, token, toklen) == 0) &&
+          ((cp[toklen] == ',') || (cp[toklen] <= ' '))) {
+         return TRUE;
+      }
+      while ((*cp != ',') && (*cp != '\r') && (*cp != '\n') && (*cp != 0)) {
+         cp++;
+      }
+   }
+   return FALSE;
+}
+
 /* wi_argterm()
  * 
  * Terminates the passed string, which is assumed to be in an HTML 
@@ -506,7 +884,7 @@ struct wi_ftype {
 	    /* WMV */  { 0x574D5600, "video/x-ms-wmv",                FT_BINARY },
 	    /* PDF */  { 0x50444600, "application/pdf",               FT_BINARY },
 	    /* SWF */  { 0x53574600, "application/x-shockwave-flash", FT_BINARY },
-	    /* BIN */  { 0x66494E00, "application/octet-binary",      FT_BINARY },
+	    /* BIN */  { 0x42494E00, "application/octet-binary",      FT_BINARY },
 	    /* JS */   { 0x4A530000, "application/javascript",        FT_ASCII  },
 	    /* CSS */  { 0x43535300, "text/css",                      FT_ASCII  },
 	    /* TXT */  { 0x54585400, "text/plain",                    FT_ASCII  }
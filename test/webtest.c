@@ -39,15 +39,41 @@
 
 extern void exit(int code);
 
+#ifdef LINUX
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* SIGTERM shuts the server down gracefully. To update it without
+ * refusing any connections, start the new server on the same listen
+ * socket (passed in WEBIO_LISTEN_FD, or by systemd) and then send the
+ * old one SIGTERM.
+ */
+static void webtest_term(int sig) {
+   (void)sig;
+   wi_shutdown(wi_draintmo);
+}
+#endif
+
 /* Sample authentication code & "database" */
+static wi_chan * cast_chan;      /* casttest.htm's feed */
+wi_sse events_sse = { 0, 0, 0, 3000 };   /* events.sse, clients retry in 3s */
+static volatile u_long status_count;     /* status.cgi's, see status_cgi() */
+#define STATUS_KEY   ((u_long)&status_count)   /* its wi_park() key */
+#ifdef LINUX
+static void * cast_feed(void * arg);
+#endif
+
 static const char test_name[32] = {"test"};
 static const char test_passwd[32] = {"test"};
 
 int wfs_auth(void * fd, const char * name, const char * password);
 
-u_long wi_cticks = 0;
-
+#ifdef WI_USE_REACTORS
+char * usage = "usage: webio [port [reactors]] - TCP port for listening, number of reactor threads\n";
+#else
 char * usage = "only valid command line arg is a TCP port number for listening\n";
+#endif
 
 int main( int argc, char * argv[] ) {
    int error;
@@ -68,13 +94,48 @@ int main( int argc, char * argv[] ) {
 
    if (argc > 1) {
 	    httpport = atoi(argv[1]);
-		if (httpport < 1) {
+		if (httpport < 0) {     /* 0 is OK with WEBIO_UNIX */
 			dprintf("%s", usage);
 			dtrap();
 			exit(EXIT_FAILURE);
 		}
    }
+#ifdef WI_USE_REACTORS
+   if (argc > 2) {
+	    wi_reactors = atoi(argv[2]);
+		if (wi_reactors < 1) {
+			dprintf("%s", usage);
+			dtrap();
+			exit(EXIT_FAILURE);
+		}
+   }
+#endif
+
+   /* Install our port-local authentication routine. Do this before 
+    * wi_init() since reactor threads may start serving right away.
+    */
+   emfs.wfs_fauth = wfs_auth;
 
+   /* Slow watchers of casttest.htm skip to the newest line */
+   cast_chan = wi_chancreate(WI_CAST_COALESCE, 8);
+
+#ifdef WI_USE_STDFILES
+   /* WEBIO_DOCROOT names a host directory to serve files from too */
+   wi_docroot = getenv("WEBIO_DOCROOT");
+#endif
+
+#ifdef LINUX
+   /* WEBIO_UNIX names a unix domain socket to serve on too, e.g. for
+    * a local reverse proxy. A leading '@' makes it abstract.
+    */
+   if (getenv("WEBIO_UNIX")) {
+      error = wi_addunix(getenv("WEBIO_UNIX"));
+      if (error) {
+         dprintf("wi_addunix error %d\n", error);
+         exit(EXIT_FAILURE);
+      }
+   }
+#endif
 
    error = wi_init();
    if (error < 0) {
@@ -86,9 +147,15 @@ int main( int argc, char * argv[] ) {
       exit(EXIT_FAILURE);
    }
 
-   /* Install our port-local authentication routine */
-   emfs.wfs_fauth = wfs_auth;
 
+#ifdef LINUX
+   signal(SIGTERM, webtest_term);
+   if (cast_chan) {
+      pthread_t   feed;
+
+      pthread_create(&feed, NULL, cast_feed, NULL);
+   }
+#endif
 
    error = wi_thread();   /* blocks here until killed */
    if (error < 0) {
@@ -139,12 +206,6 @@ void wi_panic(char * msg) {
  *
  */
 
-extern u_long   wi_blocks;
-extern u_long   wi_bytes;
-extern u_long   wi_maxbytes;
-extern u_long   wi_totalblocks;
-
-
 int memory_ssi(wi_sess * sess, EOFILE * eofile) {
    /* print memory stats to the session's TX buffers */
    wi_printf(sess, "Current blocks: %d <br>", wi_blocks );
@@ -189,11 +250,142 @@ const char * testaction_cgi(wi_sess * sess, EOFILE * eofile) {
 
 /* PUSH
  *
- * pushtest_func routine stub
+ * pushtest_func sends a line a second for ten seconds. It hands the
+ * session back to the server with wi_pushstart(), which then calls
+ * pushtest_tick() to make each line.
  */
 
+static int pushtest_tick(wi_sess * sess, void * ctx, int event) {
+   int * ticks = (int *)ctx;
+
+   switch (event) {
+   case WI_PUSH_WRITE:     /* first call */
+      wi_printf(sess, "<html><body><pre>\r\n");
+      wi_pushtimer(sess, 1000);
+      break;
+   case WI_PUSH_WAKE:
+      wi_printf(sess, "wakeup\r\n");
+      break;
+   case WI_PUSH_TIMER:
+      wi_printf(sess, "tick %d\r\n", ++(*ticks));
+      if (*ticks >= 10) {
+         wi_printf(sess, "</pre></body></html>\r\n");
+         free(ticks);
+         return WI_PUSH_DONE;
+      }
+      wi_pushtimer(sess, 1000);
+      break;
+   case WI_PUSH_END:
+      free(ticks);
+      break;
+   }
+   return WI_PUSH_WAIT;
+}
+
 int pushtest_func(wi_sess * sess, EOFILE * eofile) {
-   /* Add your code here */
+   int * ticks;
+
+   (void)eofile;
+   ticks = (int *)malloc(sizeof(int));
+   if (ticks == NULL) {
+      return WI_E_MEMORY;
+   }
+   *ticks = 0;
+   if (wi_pushstart(sess, pushtest_tick, ticks)) {
+      free(ticks);
+      return WI_E_BADPARM;
+   }
    return 0;
 }
 
+/* casttest_func sends each line published to cast_chan until the
+ * client goes away. The lines come from cast_feed(), a thread of its
+ * own, and are made once for all the watchers. cast_feed() sends the
+ * same count as a "tick" event on events.sse, and to status.cgi.
+ */
+
+static int casttest_watch(wi_sess * sess, void * ctx, int event) {
+   (void)ctx;
+   if (event == WI_PUSH_WRITE) {    /* first call */
+      wi_printf(sess, "<html><body><pre>\r\n");
+      if (wi_subscribe(sess, cast_chan)) {
+         return WI_E_BADPARM;
+      }
+   }
+   return WI_PUSH_WAIT;
+}
+
+int casttest_func(wi_sess * sess, EOFILE * eofile) {
+   (void)eofile;
+   if (cast_chan == NULL) {
+      return WI_E_MEMORY;
+   }
+   return wi_pushstart(sess, casttest_watch, NULL);
+}
+
+/* LONG POLL
+ *
+ * status_cgi answers "status.cgi?since=N" with the count once it is
+ * past N. Until then the request is parked, for up to 20 seconds;
+ * cast_feed() wakes it as the count goes up.
+ */
+
+const char * status_cgi(wi_sess * sess, EOFILE * eofile) {
+   long  since = 0;
+
+   (void)eofile;
+   wi_formint(sess, "since", &since);
+   if (((long)status_count <= since) &&
+       (sess->ws_parkevent != WI_PARK_TIMEOUT)) {
+      if (wi_park(sess, STATUS_KEY, 20000) == 0) {
+         return NULL;      /* run again when the count changes */
+      }
+   }
+   wi_printf(sess, "%lu\r\n", status_count);
+   return NULL;
+}
+
+/* WEBSOCKET
+ *
+ * panel_ws answers the messages of a control panel on panel.ws. A
+ * "stats" message gets the server's counters, anything else is sent
+ * back as it came.
+ */
+
+int panel_ws(wi_sess * sess, int event, char * msg, int len) {
+   char  reply[120];
+
+   switch (event) {
+   case WI_WS_TEXT:
+      if (strcmp(msg, "stats") == 0) {
+         sprintf(reply, "{\"sessions\": %d, \"txbufs\": %d, \"blocks\": %lu}",
+            wi_nsess, wi_ntxbufs, wi_totalblocks);
+         return wi_wssend(sess, WI_WS_TEXT, reply, (int)strlen(reply));
+      }
+      /* fall through */
+   case WI_WS_BINARY:
+      return wi_wssend(sess, event, msg, len);
+   }
+   return 0;
+}
+
+#ifdef LINUX
+static void * cast_feed(void * arg) {
+   char  line[80];
+   u_long   count = 0;
+
+   (void)arg;
+   for (;;) {
+      sleep(1);
+      wi_clocktick();   /* wi_cticks is per thread, keep this one's going */
+      sprintf(line, "frame %lu at tick %lu\r\n", ++count, (u_long)wi_cticks);
+      wi_publish(cast_chan, line, (int)strlen(line));
+      sprintf(line, "%lu", count);
+      wi_ssesend(&events_sse, "tick", line);
+      status_count = count;
+      wi_wake(STATUS_KEY);
+   }
+   return NULL;
+}
+#endif
+